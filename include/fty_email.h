@@ -30,5 +30,8 @@
 #define FTY_EMAIL_ADDRESS_SENDMAIL_ONLY  "fty-email-sendmail-only"
 #define FTY_EMAIL_ENDPOINT "ipc://@/malamute"
 #define FTY_EMAIL_CONFIG_FILE "/etc/fty-email/fty-email.cfg"
+// attachment frames of SENDMAIL which are not paths, see fty_email_server.h
+#define FTY_EMAIL_ATTACH_INLINE "inline:"
+#define FTY_EMAIL_ATTACH_FD "fd:"
 
 #endif
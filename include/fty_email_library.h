@@ -34,6 +34,7 @@
 #include <malamute.h>
 #include <ftyproto.h>
 #include <magic.h>
+#include <openssl/ssl.h>
 #include <cxxtools/allocator.h>
 
 //  FTY_EMAIL version macros for compile-time API detection
@@ -35,7 +35,22 @@ extern "C" {
 //  server
 //      verbose             1 turns verbose mode on, 0 off
 //      assets              path to state file for assets
-//      alerts              path to state file for alerts
+//      alerts              path to state file for alerts, changes are appended
+//                          to <alerts>.journal and compacted into it
+//      flush_interval      ms since the first unsaved change of assets
+//                          after which the assets file is written [5000]
+//      flush_changes       number of changes of assets after which the file
+//                          is written regardless of flush_interval [1000]
+//      spool               directory where emails wait for delivery, so they
+//                          survive relay outage and restart, read on the first
+//                          LOAD, not used if not set, sendmail-only actor
+//                          uses its subdirectory sendmail-only
+//      spool_retry         ms before the first retry after relay outage [5000],
+//                          doubled with each failed retry
+//      spool_retry_max     maximum ms between retries [600000]
+//      digest_window       seconds notification emails to one recipient
+//                          are collected and sent as one email, 0 sends
+//                          them one by one [0]
 //  smtp
 //      server              address of smtp server
 //      port                port number
@@ -44,8 +59,36 @@ extern "C" {
 //      from                From: header of email
 //      encryption          encryption, can be (none|tls|starttls)
 //      msmtppath           path to msmtp command
+//      transport           how to deliver emails, can be (msmtp|native) [msmtp]
+//      pool_size           number of idle connections kept by native transport [4]
+//      keepalive           seconds the idle connection is kept open [60]
 //      smsgateway          email to sms gateway
+//      sms_max_size        maximum size of sms text in bytes, longer text
+//                          is shortened [160]
 //      verify_ca           1 turns on CA verification, 0 off
+//      workers             number of threads delivering emails [1]
+//      queue_size          maximum number of emails waiting for delivery [1024]
+//      rate_limit          notifications over the limit are deferred, not dropped
+//          global              emails per minute, 0 is unlimited [0]
+//          global_burst        emails sent at once before the limit applies [10]
+//          recipient           emails per minute to one address [0]
+//          recipient_burst     [5]
+//          sms_domain          sms per minute to one sms gateway domain [0]
+//          sms_domain_burst    [5]
+//  templates               files with ${field} placeholders, built-in if not set,
+//                          fields are rulename, assetname, description,
+//                          priority, severity and state, re-read on LOAD
+//                          if they have changed
+//      subject_active      subject of notification about active alert
+//      body_active         body of notification about active alert
+//      subject_resolved    subject of notification about resolved alert
+//      body_resolved       body of notification about resolved alert
+//      sms_active          text of sms about active alert
+//      sms_resolved        text of sms about resolved alert
+//      directory           files <name>[.<state>][.<severity>], name is
+//                          email.subject, email.body or sms.body, e.g.
+//                          email.subject.resolved or sms.body.active.critical,
+//                          the most specific one wins over the files above
 //  malamute
 //      verbose             1 setup verbose mode of mlm_client, 0 turn it off
 //      endpoint            malamute endpoint address
@@ -60,6 +103,22 @@ extern "C" {
 //  LOAD    path            load and apply configuration from zpl file
 //                          see Configuration format section
 //
+//  CHECK_NOW               send notifications and digests which are due,
+//                          server does it by itself when the next one is due
+//
+//  STATS                   reply with [key|value|key|value|...] counters
+//                          smtp/pool_hits      email sent over open connection
+//                          smtp/pool_misses    new connection had to be opened
+//                          smtp/pool_expired   idle connections closed after keepalive
+//                          smtp/pool_idle      number of idle connections
+//                          ratelimit/allowed   notifications within the limits
+//                          ratelimit/deferred  notifications over the limits
+//                          ratelimit/global_tokens  left in global bucket, -1 unlimited
+//                          ratelimit/recipients     recipients being limited
+//                          ratelimit/domains        sms gateway domains being limited
+//                          ratelimit/queued_digests recipients with deferred emails
+//                          ratelimit/queued_sms     recipients with deferred sms
+//
 //  Malamute protocol (mailbox agent-smtp)
 //  ======================================
 //
@@ -69,16 +128,40 @@ extern "C" {
 //      sends email to $to, with subject $subject and body $body
 //      $headers state additional headers to be passed to email
 //      $attachment1, $attachment2, ... are names of files to be attached
-//      see fty_email_encode to handy way to encode such message
+//      files are read when the email is spooled or sent, so they must not
+//      be removed before the reply (SENDMAIL-QUEUED [...|SPOOLED] is enough)
+//      attachment can be also given as
+//          inline:$name|$content   content in the next frame, e.g. from
+//                                  another host
+//          fd:$pid:$fd:$name       descriptor $fd of local process $pid,
+//                                  e.g. from memfd_create, the server opens
+//                                  /proc/$pid/fd/$fd as soon as the request
+//                                  is accepted, so it can be closed once any
+//                                  reply comes, $pid must run as the same
+//                                  user as the server, $fd must be a regular
+//                                  file
+//      see fty_email_encode and fty_email_encode_attachments to handy way
+//      to encode such message
 //
 //      [$uuid|$to|$subject|$body]
 //      sends emails via configured environment to address $to, with subject $subject and body $body
 //  REP: subject=SENDMAIL-OK [$uuid|0|OK]
 //      if email was sent
+//  REP: subject=SENDMAIL-QUEUED [$uuid|0|SPOOLED]
+//      if the relay is unreachable and server/spool is set, the email is
+//      sent later, without another reply
 //  REP: subject=SENDMAIL-ERR [$uuid|$error code|$error message]
 //      if email wasn't sent, or there was improper number of arguments
 //      error message comes from msmtp stderr and is NOT normalized!
 //
+//  REQ: subject=SENDMAIL-ASYNC
+//      same frames as SENDMAIL, for callers having several requests in flight
+//  REP: subject=SENDMAIL-QUEUED [$uuid|0|QUEUED] or [$uuid|0|SPOOLED]
+//      as soon as the email is accepted (spooled, if server/spool is set)
+//      SENDMAIL-OK or SENDMAIL-ERR with the same $uuid follows once the email
+//      is delivered, replies of different requests can come in any order.
+//      SENDMAIL-ERR is the only reply if the email can't be accepted.
+//
 //  args:
 //      "sendmail-only"      : ignore consumer/ part, connect as $(malamute/address)-sendmail-only
 FTY_EMAIL_EXPORT void
@@ -105,6 +188,32 @@ FTY_EMAIL_EXPORT zmsg_t *
         const char *body,
         ...);
 
+// attachment of fty_email_encode_attachments
+//  name - file name shown in email, path of the file if data is NULL
+//         and fd is -1
+//  data - content of size bytes sent in the message
+//  fd   - descriptor of this process the server reads the content from,
+//         e.g. from memfd_create, -1 if not used, regular file only, the
+//         server must run as the same user
+typedef struct {
+    const char *name;
+    const void *data;
+    size_t size;
+    int fd;
+} fty_email_attachment_t;
+
+// encode email message to zmsg_t like fty_email_encode does, attachments
+// are given by array of count items
+FTY_EMAIL_EXPORT zmsg_t *
+    fty_email_encode_attachments (
+        const char *uuid,
+        const char *to,
+        const char *subject,
+        zhash_t *headers,
+        const char *body,
+        const fty_email_attachment_t *attachments,
+        size_t count);
+
 //  @end
 
 #ifdef __cplusplus
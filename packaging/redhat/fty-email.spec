@@ -55,6 +55,7 @@ BuildRequires:  czmq-devel
 BuildRequires:  malamute-devel
 BuildRequires:  fty-proto-devel
 BuildRequires:  file-devel
+BuildRequires:  openssl-devel
 BuildRequires:  cxxtools-devel
 BuildRoot:      %{_tmppath}/%{name}-%{version}-build
 
@@ -84,6 +85,7 @@ Requires:       czmq-devel
 Requires:       malamute-devel
 Requires:       fty-proto-devel
 Requires:       file-devel
+Requires:       openssl-devel
 Requires:       cxxtools-devel
 
 %description devel
@@ -28,42 +28,180 @@
 
 #include "fty_email_classes.h"
 
+#include <mutex>
+#include <unordered_set>
+
+static std::mutex s_pool_mutex;
+
+static std::unordered_set <std::string>&
+s_pool ()
+{
+    // never destroyed, strings may be referenced until the very end
+    static std::unordered_set <std::string> *pool = new std::unordered_set <std::string> ();
+    return *pool;
+}
+
+const std::string *InternedString::s_empty ()
+{
+    static const std::string *empty = new std::string ();
+    return empty;
+}
+
+const std::string *InternedString::intern (const std::string& s)
+{
+    if (s.empty ())
+        return s_empty ();
+    std::lock_guard <std::mutex> lock (s_pool_mutex);
+    return &*s_pool ().insert (s).first;
+}
+
+bool InternedString::lookup (const std::string& s, InternedString& ret)
+{
+    if (s.empty ()) {
+        ret._s = s_empty ();
+        return true;
+    }
+    std::lock_guard <std::mutex> lock (s_pool_mutex);
+    auto it = s_pool ().find (s);
+    if (it == s_pool ().end ())
+        return false;
+    ret._s = &*it;
+    return true;
+}
+
+std::string alert_rule_name (const char *rule)
+{
+    std::string ret (rule);
+    std::transform (ret.begin(), ret.end(), ret.begin(), ::tolower);
+    return ret;
+}
+
+Alert::Alert (fty_proto_t *message) :
+    rule (alert_rule_name (fty_proto_rule (message))),
+    element (fty_proto_name (message)),
+    description (fty_proto_description (message)),
+    time (fty_proto_time (message)),
+    last_email_notification (0),
+    last_update (fty_proto_time (message)),
+    last_sms_notification (0),
+    state (alert_state (fty_proto_state (message))),
+    severity (alert_severity (fty_proto_severity (message))),
+    action (alert_action (fty_proto_action (message)))
+{
+}
+
+static const char *ALERT_STATES [] = {
+    "UNKNOWN", "ACTIVE", "ACK-WIP", "ACK-IGNORE", "ACK-PAUSE", "ACK-SILENCE", "RESOLVED"
+};
+
+static const char *ALERT_SEVERITIES [] = {
+    "UNKNOWN", "CRITICAL", "WARNING", "INFO"
+};
+
+AlertState alert_state (const char *state)
+{
+    for (size_t i = 1; i != sizeof (ALERT_STATES) / sizeof (ALERT_STATES [0]); i++) {
+        if (streq (state, ALERT_STATES [i]))
+            return static_cast <AlertState> (i);
+    }
+    zsys_warning ("Unknown alert state '%s'", state);
+    return AlertState::UNKNOWN;
+}
+
+const char *alert_state_str (AlertState state)
+{
+    return ALERT_STATES [static_cast <size_t> (state)];
+}
+
+AlertSeverity alert_severity (const char *severity)
+{
+    for (size_t i = 1; i != sizeof (ALERT_SEVERITIES) / sizeof (ALERT_SEVERITIES [0]); i++) {
+        if (streq (severity, ALERT_SEVERITIES [i]))
+            return static_cast <AlertSeverity> (i);
+    }
+    zsys_warning ("Unknown alert severity '%s'", severity);
+    return AlertSeverity::UNKNOWN;
+}
+
+const char *alert_severity_str (AlertSeverity severity)
+{
+    return ALERT_SEVERITIES [static_cast <size_t> (severity)];
+}
+
+uint8_t alert_action (const char *action)
+{
+    uint8_t ret = 0;
+    if (strcasestr (action, "EMAIL") != NULL)
+        ret |= ALERT_ACTION_EMAIL;
+    if (strcasestr (action, "SMS") != NULL)
+        ret |= ALERT_ACTION_SMS;
+    return ret;
+}
+
+const char *alert_action_str (uint8_t action)
+{
+    static const char *ACTIONS [] = {"", "EMAIL", "SMS", "EMAIL/SMS"};
+    return ACTIONS [action & (ALERT_ACTION_EMAIL | ALERT_ACTION_SMS)];
+}
+
 /*
  * \brief Serialzation of Alert
  */
 void operator<<= (cxxtools::SerializationInfo& si, const Alert& alert)
 {
-    si.addMember("rule") <<= alert.rule;
-    si.addMember("element") <<= alert.element;
-    si.addMember("state") <<= alert.state;
-    si.addMember("severity") <<= alert.severity;
+    si.addMember("rule") <<= alert.rule.str ();
+    si.addMember("element") <<= alert.element.str ();
+    si.addMember("state") <<= std::string (alert_state_str (alert.state));
+    si.addMember("severity") <<= std::string (alert_severity_str (alert.severity));
     si.addMember("description") <<= alert.description;
     si.addMember("time") <<= alert.time;
     si.addMember("last_update") <<= alert.last_update;
     // TODO consider to rename this in state file
     si.addMember("last_notification") <<= alert.last_email_notification;
-    si.addMember("action") <<= alert.action;
+    si.addMember("action") <<= std::string (alert_action_str (alert.action));
     si.addMember("last_sms_notification") <<= alert.last_sms_notification;
 }
 
+JsonWriter& operator<< (JsonWriter& json, const Alert& alert)
+{
+    return json.beginObject ()
+        .member ("rule", alert.rule)
+        .member ("element", alert.element)
+        .member ("state", alert_state_str (alert.state))
+        .member ("severity", alert_severity_str (alert.severity))
+        .member ("description", alert.description)
+        .member ("time", alert.time)
+        .member ("last_update", alert.last_update)
+        .member ("last_notification", alert.last_email_notification)
+        .member ("action", alert_action_str (alert.action))
+        .member ("last_sms_notification", alert.last_sms_notification)
+        .endObject ();
+}
+
 /*
  * \brief Deserialzation of Alert
  */
 void operator>>= (const cxxtools::SerializationInfo& si, Alert& alert)
 {
-    si.getMember("rule") >>= alert.rule;
-    si.getMember("element") >>= alert.element;
-    si.getMember("state") >>= alert.state;
-    si.getMember("severity") >>= alert.severity;
+    std::string temp;
+    si.getMember("rule") >>= temp;
+    alert.rule = temp;
+    si.getMember("element") >>= temp;
+    alert.element = temp;
+    si.getMember("state") >>= temp;
+    alert.state = alert_state (temp.c_str ());
+    si.getMember("severity") >>= temp;
+    alert.severity = alert_severity (temp.c_str ());
     si.getMember("description") >>= alert.description;
     si.getMember("time") >>= alert.time;
     si.getMember("last_update") >>= alert.last_update;
     si.getMember("last_notification") >>= alert.last_email_notification;
     try {
-        si.getMember ("action") >>= alert.action;
+        si.getMember ("action") >>= temp;
+        alert.action = alert_action (temp.c_str ());
     }
     catch (const cxxtools::SerializationError &e) {
-        alert.action = "EMAIL/SMS";
+        alert.action = ALERT_ACTION_EMAIL | ALERT_ACTION_SMS;
     }
     try {
         si.getMember ("last_sms_notification") >>= alert.last_sms_notification;
@@ -85,10 +223,40 @@ alert_test (bool verbose)
     Alert a;
     assert ( a.action_sms() == false );
     assert ( a.action_email() == false );
-    a.action = "EMAIL/SMS";
+    a.action = alert_action ("EMAIL/SMS");
     assert ( a.action_sms() == true );
     assert ( a.action_email() == true );
     //  @selftest
+    assert (alert_action ("email") == ALERT_ACTION_EMAIL);
+    assert (alert_action ("GPO_INTERACTION") == 0);
+    assert (streq (alert_action_str (ALERT_ACTION_SMS), "SMS"));
+    assert (streq (alert_action_str (alert_action ("SMS/EMAIL")), "EMAIL/SMS"));
+
+    for (const char *state : {"ACTIVE", "ACK-WIP", "ACK-IGNORE", "ACK-PAUSE", "ACK-SILENCE", "RESOLVED"})
+        assert (streq (alert_state_str (alert_state (state)), state));
+    assert (alert_state ("active") == AlertState::UNKNOWN);
+    for (const char *severity : {"CRITICAL", "WARNING", "INFO"})
+        assert (streq (alert_severity_str (alert_severity (severity)), severity));
+    assert (alert_severity ("FATAL") == AlertSeverity::UNKNOWN);
+
+    a.state = AlertState::ACTIVE;
+    assert (!a.silenced ());
+    a.state = AlertState::ACK_SILENCE;
+    assert (a.silenced ());
+
+    // interned strings share the instance
+    InternedString s1 ("alert-test-rule");
+    InternedString s2 (std::string ("alert-test-") + "rule");
+    assert (s1 == s2);
+    assert (&s1.str () == &s2.str ());
+    assert (s1 == "alert-test-rule");
+    assert (InternedString () == "");
+    InternedString found;
+    assert (InternedString::lookup ("alert-test-rule", found));
+    assert (found == s1);
+    assert (!InternedString::lookup ("alert-test-never-interned", found));
+    assert (found == s1);
+    assert (alert_rule_name ("Rule@UPS") == "rule@ups");
     //  @end
     printf ("OK\n");
 }
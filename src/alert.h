@@ -24,51 +24,124 @@
 
 
 #include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
 #include <fty_proto.h>
 
 #include <cxxtools/serializationinfo.h>
 
 
 
+/**
+ * \brief String stored once per process
+ *
+ * Rule and asset names repeat in many alerts, so alerts refer to one
+ * copy in the pool. Equal strings share the instance, comparison and
+ * hashing work on the pointer. Strings are never removed from the pool,
+ * it is bounded by the number of distinct rules and assets.
+ */
+class InternedString {
+ public:
+    InternedString () : _s (s_empty ()) {};
+    InternedString (const std::string& s) : _s (intern (s)) {};
+    InternedString (const char *s) : _s (intern (s)) {};
+
+    const std::string& str () const { return *_s; }
+    operator const std::string& () const { return *_s; }
+    const char *c_str () const { return _s->c_str (); }
+    bool empty () const { return _s->empty (); }
+    size_t hash () const { return std::hash <const std::string *> () (_s); }
+
+    bool operator== (const InternedString& other) const { return _s == other._s; }
+    bool operator!= (const InternedString& other) const { return _s != other._s; }
+    bool operator== (const std::string& other) const { return *_s == other; }
+    bool operator== (const char *other) const { return *_s == other; }
+    bool operator< (const InternedString& other) const { return _s != other._s && *_s < *other._s; }
+
+    // finds string in the pool without adding it, returns false if it is not there
+    static bool lookup (const std::string& s, InternedString& ret);
+
+ private:
+    static const std::string *intern (const std::string& s);
+    static const std::string *s_empty ();
+
+    const std::string *_s;
+};
+
+namespace std {
+template <> struct hash <InternedString> {
+    size_t operator() (const InternedString& s) const { return s.hash (); }
+};
+}
+
+// [rule, element] identifying the alert
+typedef std::pair <InternedString, InternedString> AlertKey;
+
+// State, severity and action are parsed once when alert arrives,
+// strings are used only for serialization and templates.
+enum class AlertState : uint8_t {
+    UNKNOWN,
+    ACTIVE,
+    ACK_WIP,
+    ACK_IGNORE,
+    ACK_PAUSE,
+    ACK_SILENCE,
+    RESOLVED
+};
+
+enum class AlertSeverity : uint8_t {
+    UNKNOWN,
+    CRITICAL,
+    WARNING,
+    INFO
+};
+
+// bit flags of Alert::action
+static const uint8_t ALERT_ACTION_EMAIL = 1;
+static const uint8_t ALERT_ACTION_SMS = 2;
+
+AlertState alert_state (const char *state);
+const char *alert_state_str (AlertState state);
+AlertSeverity alert_severity (const char *severity);
+const char *alert_severity_str (AlertSeverity severity);
+// "EMAIL/SMS" -> ALERT_ACTION_EMAIL | ALERT_ACTION_SMS, case insensitive
+uint8_t alert_action (const char *action);
+const char *alert_action_str (uint8_t action);
+
 class Alert {
  public:
-    Alert () : time(0), last_email_notification(0), last_update(0), last_sms_notification(0) {};
-    Alert (fty_proto_t *message) :
-            rule (fty_proto_rule (message)),
-            element (fty_proto_name (message)),
-            state (fty_proto_state (message)),
-            severity (fty_proto_severity (message)),
-            description (fty_proto_description (message)),
-            action (fty_proto_action (message)),
-            time (fty_proto_time (message)),
-            last_email_notification (0),
-            last_update (fty_proto_time (message)),
-            last_sms_notification (0)
-    {
-        std::transform (rule.begin(), rule.end(), rule.begin(), ::tolower);
-    };
-
-    bool action_email () { return strcasestr (action.c_str (), "EMAIL") != NULL; }
-    bool action_sms () { return strcasestr (action.c_str (), "SMS") != NULL; }
-
-    std::string rule;
-    std::string element;
-    std::string state;
-    std::string severity;
+    Alert () : time(0), last_email_notification(0), last_update(0), last_sms_notification(0),
+        state (AlertState::UNKNOWN), severity (AlertSeverity::UNKNOWN), action (0) {};
+    Alert (fty_proto_t *message);
+
+    AlertKey key () const { return AlertKey (rule, element); }
+
+    bool action_email () const { return (action & ALERT_ACTION_EMAIL) != 0; }
+    bool action_sms () const { return (action & ALERT_ACTION_SMS) != 0; }
+    // no reminders are sent in these states
+    bool silenced () const {
+        return state == AlertState::ACK_PAUSE
+            || state == AlertState::ACK_IGNORE
+            || state == AlertState::ACK_SILENCE
+            || state == AlertState::RESOLVED;
+    }
+
+    InternedString rule; // lower case
+    InternedString element;
     std::string description;
-    std::string action;
     uint64_t time; // when alert started
     uint64_t last_email_notification; // last email notification was sent
     uint64_t last_update; // last time, when alert was changed (for example serevity/status/description)
     uint64_t last_sms_notification; // when last sms notification was sent
+    AlertState state;
+    AlertSeverity severity;
+    uint8_t action;
 };
 
-// Alerts are compared by pair [rule, element]
-struct cmpAlertById {
-    bool operator() (const Alert& a, const Alert& b) const {
-        return (a.rule < b.rule) || (a.rule == b.rule && a.element < b.element);
-    }
-};
+// lower case rule name, as rules are stored in Alert
+std::string alert_rule_name (const char *rule);
+
 /*
  * \brief Serialzation of Alert
  */
@@ -79,6 +152,12 @@ void operator<<= (cxxtools::SerializationInfo& si, const Alert& alert);
  */
 void operator>>= (const cxxtools::SerializationInfo& si, Alert& alert);
 
+/*
+ * \brief Streaming serialization of Alert, same format as operator<<=
+ */
+class JsonWriter;
+JsonWriter& operator<< (JsonWriter& json, const Alert& alert);
+
 void
 alert_test (bool verbose);
 
@@ -0,0 +1,448 @@
+/*  =========================================================================
+    alertjournal - Persistence of alerts state
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    alertjournal - Persistence of alerts state
+@discuss
+    Snapshot is binary, see snapshot class. State file in JSON format
+    (older versions) is imported on load and overwritten by next save.
+
+    Journal is a text file with one JSON object per line
+
+        {"op":"update","alert":{...}}
+        {"op":"erase","rule":"...","element":"..."}
+
+    Records store the full state of the alert, so replaying them over
+    a newer snapshot is harmless. That's why the journal is truncated
+    only after the new snapshot was renamed in place. Partially written
+    last line (crash) is ignored and cut off on load.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cxxtools/jsondeserializer.h>
+
+// fixed-width record of the snapshot, strings are indexes to string table
+struct AlertRecord {
+    uint32_t rule;
+    uint32_t element;
+    uint32_t state;
+    uint32_t severity;
+    uint32_t description;
+    uint32_t action;
+    uint64_t time;
+    uint64_t last_email_notification;
+    uint64_t last_update;
+    uint64_t last_sms_notification;
+};
+
+static int
+s_load_snapshot (SnapshotReader& reader, AlertTable& alerts)
+{
+    for (uint32_t i = 0; i != reader.size (); i++) {
+        const AlertRecord *record = static_cast <const AlertRecord *> (reader.record (i));
+        SnapshotString rule, element, state, severity, description, action;
+        if (!reader.string (record->rule, rule)
+        ||  !reader.string (record->element, element)
+        ||  !reader.string (record->state, state)
+        ||  !reader.string (record->severity, severity)
+        ||  !reader.string (record->description, description)
+        ||  !reader.string (record->action, action))
+            return -1;
+
+        Alert alert;
+        alert.rule = rule.str ();
+        alert.element = element.str ();
+        alert.state = alert_state (state.data);
+        alert.severity = alert_severity (severity.data);
+        alert.description.assign (description.data, description.size);
+        alert.action = alert_action (action.data);
+        alert.time = record->time;
+        alert.last_email_notification = record->last_email_notification;
+        alert.last_update = record->last_update;
+        alert.last_sms_notification = record->last_sms_notification;
+        alerts.set (alert);
+    }
+    return 0;
+}
+
+AlertJournal::AlertJournal () :
+    _path (),
+    _fd (-1),
+    _size (0),
+    _threshold (1024)
+{
+}
+
+AlertJournal::~AlertJournal ()
+{
+    close ();
+}
+
+void AlertJournal::setFile (const std::string& path_to_file)
+{
+    if (path_to_file == _path)
+        return;
+    close ();
+    _path = path_to_file;
+    _size = 0;
+}
+
+int AlertJournal::open ()
+{
+    if (_fd != -1)
+        return 0;
+    std::string journal = _path + ".journal";
+    _fd = ::open (journal.c_str (), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (_fd == -1) {
+        zsys_error ("Cannot open file '%s' for write: %s", journal.c_str (), strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+void AlertJournal::close ()
+{
+    if (_fd != -1) {
+        ::close (_fd);
+        _fd = -1;
+    }
+}
+
+int AlertJournal::load (AlertTable& alerts)
+{
+    if (!isSet ()) {
+        zsys_warning ("state file for alerts is not set up, no state is persist");
+        return 0;
+    }
+
+    int ret = 0;
+    SnapshotReader reader;
+    int r = reader.open (_path, SNAPSHOT_ALERTS, sizeof (AlertRecord));
+    if (r == 0) {
+        if (s_load_snapshot (reader, alerts) != 0) {
+            zsys_error ("Snapshot '%s' is damaged: string index out of range", _path.c_str ());
+            ret = -1;
+        }
+        reader.close ();
+    }
+    else
+    if (r == 1) {
+        // import of JSON state file
+        std::ifstream ifs (_path, std::ios::in);
+        try {
+            cxxtools::JsonDeserializer json (ifs);
+            cxxtools::SerializationInfo si;
+            json.deserialize (si);
+            // std::map of [rule, element] -> alert, the key is in alert as well
+            for (auto it = si.begin (); it != si.end (); ++it) {
+                Alert alert;
+                it->getMember ("value") >>= alert;
+                alerts.set (alert);
+            }
+        }
+        catch ( const std::exception &e) {
+            zsys_error ("Cannot deserialize the file '%s'. Error: '%s'", _path.c_str (), e.what());
+            ret = -1;
+        }
+        ifs.close ();
+    }
+    else
+        ret = -1;
+
+    std::string journal = _path + ".journal";
+    std::ifstream jfs (journal, std::ios::in);
+    if (!jfs.good ())
+        return ret;
+
+    std::string line;
+    size_t lineno = 0;
+    off_t good = 0;
+    _size = 0;
+    while (std::getline (jfs, line)) {
+        lineno ++;
+        if (jfs.eof ()) {
+            // last line without newline, the write was interrupted
+            zsys_warning ("%s:%zu: incomplete record ignored", journal.c_str (), lineno);
+            break;
+        }
+        good += line.size () + 1;
+        if (line.empty ())
+            continue;
+        try {
+            cxxtools::SerializationInfo si;
+            std::stringstream s (line);
+            cxxtools::JsonDeserializer json (s);
+            json.deserialize (si);
+
+            std::string op;
+            si.getMember ("op") >>= op;
+            if (op == "update") {
+                Alert alert;
+                si.getMember ("alert") >>= alert;
+                alerts.set (alert);
+            }
+            else
+            if (op == "erase") {
+                std::string rule, element;
+                si.getMember ("rule") >>= rule;
+                si.getMember ("element") >>= element;
+                alerts.erase (rule, element);
+            }
+            else {
+                zsys_warning ("%s:%zu: unknown operation '%s', ignored", journal.c_str (), lineno, op.c_str ());
+                continue;
+            }
+            _size ++;
+        }
+        catch (const std::exception &e) {
+            zsys_warning ("%s:%zu: damaged record ignored: %s", journal.c_str (), lineno, e.what ());
+        }
+    }
+    jfs.close ();
+
+    // next record must not be glued to the incomplete one
+    struct stat st;
+    if (stat (journal.c_str (), &st) == 0 && st.st_size > good) {
+        if (truncate (journal.c_str (), good) != 0)
+            zsys_error ("Cannot truncate file '%s': %s", journal.c_str (), strerror (errno));
+    }
+    return 0;
+}
+
+int AlertJournal::save (const AlertTable& alerts)
+{
+    if (!isSet ()) {
+        zsys_warning ("state file for alerts is not set up, no state is persist");
+        return 0;
+    }
+
+    SnapshotWriter writer (SNAPSHOT_ALERTS, sizeof (AlertRecord));
+    for (const Alert& alert : alerts) {
+        AlertRecord record;
+        record.rule = writer.intern (alert.rule);
+        record.element = writer.intern (alert.element);
+        record.state = writer.intern (alert_state_str (alert.state));
+        record.severity = writer.intern (alert_severity_str (alert.severity));
+        record.description = writer.intern (alert.description);
+        record.action = writer.intern (alert_action_str (alert.action));
+        record.time = alert.time;
+        record.last_email_notification = alert.last_email_notification;
+        record.last_update = alert.last_update;
+        record.last_sms_notification = alert.last_sms_notification;
+        writer.append (&record);
+    }
+    if (writer.save (_path) != 0)
+        return -1;
+
+    // snapshot contains everything from the journal now
+    if (open () != 0)
+        return -3;
+    if (ftruncate (_fd, 0) != 0) {
+        zsys_error ("Cannot truncate file '%s'.journal: %s", _path.c_str (), strerror (errno));
+        return -3;
+    }
+    _size = 0;
+    return 0;
+}
+
+int AlertJournal::exportJson (const AlertTable& alerts, const std::string& path)
+{
+    // same layout as cxxtools serialization of std::map and std::pair
+    JsonWriter json;
+    if (json.open (path) != 0)
+        return -1;
+    json.beginArray ();
+    for (const Alert& alert : alerts) {
+        json.beginObject ();
+        json.key ("key").beginObject ()
+            .member ("first", alert.rule.str ())
+            .member ("second", alert.element.str ())
+            .endObject ();
+        json.key ("value") << alert;
+        json.endObject ();
+    }
+    json.endArray ();
+    return json.commit ();
+}
+
+int AlertJournal::update (const Alert& alert)
+{
+    return append ([&alert] (JsonWriter& json) {
+        json.beginObject ().member ("op", "update");
+        json.key ("alert") << alert;
+        json.endObject ();
+    });
+}
+
+int AlertJournal::erase (const std::string& rule, const std::string& element)
+{
+    return append ([&rule, &element] (JsonWriter& json) {
+        json.beginObject ()
+            .member ("op", "erase")
+            .member ("rule", rule)
+            .member ("element", element)
+            .endObject ();
+    });
+}
+
+int AlertJournal::append (const std::function <void (JsonWriter&)>& record)
+{
+    if (!isSet ())
+        return 0;
+    if (open () != 0)
+        return -1;
+
+    // records up to the buffer size are written at once, the line is
+    // complete with LF only, load () drops the incomplete last line
+    JsonWriter json (_fd);
+    record (json);
+    json.newline ();
+    if (json.flush () != 0) {
+        zsys_error ("Cannot append to '%s'.journal: %s", _path.c_str (), strerror (errno));
+        return -1;
+    }
+    _size ++;
+    return 0;
+}
+
+bool AlertJournal::needsCompaction (size_t alerts) const
+{
+    // compacting after journal outgrows the table keeps amortized cost O(1)
+    return _size > std::max (_threshold, alerts);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+alertjournal_test (bool verbose)
+{
+    printf (" * alertjournal: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string path = std::string (SELFTEST_DIR_RW) + "/alertjournal-state";
+    std::remove (path.c_str ());
+    std::remove ((path + ".journal").c_str ());
+
+    Alert a1;
+    a1.rule = "rule1";
+    a1.element = "ups";
+    a1.state = AlertState::ACTIVE;
+    a1.severity = AlertSeverity::CRITICAL;
+    a1.action = ALERT_ACTION_EMAIL;
+    a1.time = 42;
+    Alert a2 = a1;
+    a2.rule = "rule2";
+    a2.description = "line\nbreak";
+
+    {
+    // journal only, no snapshot yet
+    AlertJournal journal;
+    journal.setFile (path);
+    assert (journal.update (a1) == 0);
+    assert (journal.update (a2) == 0);
+    a1.last_email_notification = 100;
+    assert (journal.update (a1) == 0);
+    assert (journal.erase ("rule2", "ups") == 0);
+    assert (journal.size () == 4);
+
+    AlertTable alerts;
+    assert (journal.load (alerts) == 0);
+    assert (alerts.size () == 1);
+    assert (alerts.at ("rule1", "ups").last_email_notification == 100);
+
+    // compaction
+    journal.setThreshold (2);
+    assert (journal.needsCompaction (alerts.size ()));
+    assert (journal.save (alerts) == 0);
+    assert (journal.size () == 0);
+    assert (!journal.needsCompaction (alerts.size ()));
+
+    // changes after the snapshot
+    assert (journal.update (a2) == 0);
+    }
+
+    {
+    AlertJournal journal;
+    journal.setFile (path);
+    AlertTable alerts;
+    assert (journal.load (alerts) == 0);
+    assert (alerts.size () == 2);
+    assert (alerts.at ("rule2", "ups").description == "line\nbreak");
+    assert (journal.size () == 1);
+    }
+
+    {
+    // partially written record is ignored
+    std::ofstream ofs (path + ".journal", std::ios::app);
+    ofs << "{\"op\":\"erase\",\"rule\":\"rule1\",\"elem";
+    ofs.close ();
+
+    AlertJournal journal;
+    journal.setFile (path);
+    AlertTable alerts;
+    assert (journal.load (alerts) == 0);
+    assert (alerts.size () == 2);
+    assert (journal.erase ("rule1", "ups") == 0);
+
+    AlertTable alerts2;
+    assert (journal.load (alerts2) == 0);
+    assert (alerts2.size () == 1);
+    assert (alerts2.find ("rule2", "ups") != NULL);
+    }
+
+    {
+    // JSON state file of older versions is imported
+    AlertTable alerts;
+    AlertJournal journal;
+    journal.setFile (path);
+    assert (journal.load (alerts) == 0);
+    std::remove ((path + ".journal").c_str ());
+    assert (AlertJournal::exportJson (alerts, path) == 0);
+
+    AlertTable imported;
+    assert (journal.load (imported) == 0);
+    assert (imported.size () == 1);
+    assert (imported.at ("rule2", "ups").description == "line\nbreak");
+    assert (imported.at ("rule2", "ups").time == 42);
+    }
+
+    std::remove (path.c_str ());
+    std::remove ((path + ".journal").c_str ());
+    //  @end
+    printf ("OK\n");
+}
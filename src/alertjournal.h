@@ -0,0 +1,103 @@
+/*  =========================================================================
+    alertjournal - Persistence of alerts state
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ALERTJOURNAL_H_INCLUDED
+#define ALERTJOURNAL_H_INCLUDED
+
+#include <string>
+#include <functional>
+
+#include "alerttable.h"
+
+class JsonWriter;
+
+/**
+ * \class AlertJournal
+ *
+ * \brief Snapshot of alerts plus append-only journal of changes
+ *
+ * Snapshot is the state file in binary format. Each change of an alert
+ * is appended to '<file>.journal' as one line, so the cost of a change
+ * does not depend on the number of alerts. Once the journal grows bigger
+ * than the table, it is compacted into a new snapshot, see save ().
+ * On startup load () replays the journal on top of the snapshot.
+ *
+ * Example:
+ *
+ *    AlertJournal journal;
+ *    journal.setFile ("/var/lib/fty/fty-email/state-alerts");
+ *    journal.load (alerts);
+ *    ...
+ *    journal.update (alert);
+ *    if (journal.needsCompaction (alerts.size ()))
+ *        journal.save (alerts);
+ */
+class AlertJournal
+{
+ public:
+    AlertJournal ();
+    ~AlertJournal ();
+
+    void    setFile (const std::string& path_to_file);
+    bool    isSet () const { return !_path.empty (); }
+
+    // read the snapshot and replay the journal
+    // returns 0 on success, -1 if neither snapshot nor journal can be read
+    int     load (AlertTable& alerts);
+
+    // write the snapshot and empty the journal
+    // returns 0 on success, negative number on error
+    int     save (const AlertTable& alerts);
+
+    // write alerts in JSON format accepted by load (), returns 0 on success
+    static int exportJson (const AlertTable& alerts, const std::string& path);
+
+    // append the change to the journal, returns 0 on success
+    int     update (const Alert& alert);
+    int     erase (const std::string& rule, const std::string& element);
+
+    // number of changes in the journal
+    size_t  size () const { return _size; }
+
+    // true if journal is bigger than max (threshold, number of alerts)
+    bool    needsCompaction (size_t alerts) const;
+    void    setThreshold (size_t threshold) { _threshold = threshold; }
+
+ private:
+    // writes the record and LF to the journal
+    int     append (const std::function <void (JsonWriter&)>& record);
+    int     open ();
+    void    close ();
+
+    std::string _path;
+    int _fd;
+    size_t _size;
+    size_t _threshold;
+
+    AlertJournal (const AlertJournal&) = delete;
+    AlertJournal& operator= (const AlertJournal&) = delete;
+};
+
+//  Self test of this class
+void
+    alertjournal_test (bool verbose);
+
+#endif
@@ -0,0 +1,168 @@
+/*  =========================================================================
+    alertscheduler - Schedule of alert notifications
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    alertscheduler - Schedule of alert notifications
+@discuss
+    Agent used to walk all alerts every 5 minutes to find those to notify
+    about. Scheduler tells when the next one is due, so the agent sleeps
+    until then and touches only the due alerts.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+void AlertScheduler::schedule (const Key& key, uint64_t due)
+{
+    auto it = _due.find (key);
+    if (it != _due.end ()) {
+        if (it->second == due)
+            return;
+        it->second = due;
+    }
+    else
+        _due.emplace (key, due);
+    _heap.push (Entry {due, key});
+    compact ();
+}
+
+void AlertScheduler::cancel (const Key& key)
+{
+    if (_due.erase (key) != 0)
+        compact ();
+}
+
+void AlertScheduler::compact ()
+{
+    if (_heap.size () > 2 * _due.size () + 64)
+        rebuild ();
+}
+
+uint64_t AlertScheduler::when (const Key& key) const
+{
+    auto it = _due.find (key);
+    return it == _due.end () ? 0 : it->second;
+}
+
+bool AlertScheduler::stale (const Entry& entry) const
+{
+    auto it = _due.find (entry.key);
+    return it == _due.end () || it->second != entry.due;
+}
+
+uint64_t AlertScheduler::next ()
+{
+    while (!_heap.empty () && stale (_heap.top ()))
+        _heap.pop ();
+    return _heap.empty () ? 0 : _heap.top ().due;
+}
+
+std::vector <AlertScheduler::Key> AlertScheduler::due (uint64_t now)
+{
+    std::vector <Key> ret;
+    while (!_heap.empty () && _heap.top ().due <= now) {
+        const Entry& entry = _heap.top ();
+        if (!stale (entry)) {
+            _due.erase (entry.key);
+            ret.push_back (entry.key);
+        }
+        _heap.pop ();
+    }
+    return ret;
+}
+
+void AlertScheduler::clear ()
+{
+    _due.clear ();
+    _heap = decltype (_heap) ();
+}
+
+void AlertScheduler::rebuild ()
+{
+    std::vector <Entry> entries;
+    entries.reserve (_due.size ());
+    for (const auto& it : _due)
+        entries.push_back (Entry {it.second, it.first});
+    _heap = decltype (_heap) (std::greater <Entry> (), std::move (entries));
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+alertscheduler_test (bool verbose)
+{
+    printf (" * alertscheduler: ");
+
+    //  @selftest
+    AlertScheduler scheduler;
+    AlertScheduler::Key a {"rule1", "ups"};
+    AlertScheduler::Key b {"rule2", "ups"};
+    AlertScheduler::Key c {"rule1", "epdu"};
+    assert (scheduler.next () == 0);
+    assert (scheduler.due (1000).empty ());
+
+    scheduler.schedule (a, 300);
+    scheduler.schedule (b, 100);
+    scheduler.schedule (c, 200);
+    assert (scheduler.size () == 3);
+    assert (scheduler.next () == 100);
+    assert (scheduler.when (c) == 200);
+
+    // reschedule and cancel leave stale entries behind
+    scheduler.schedule (b, 400);
+    scheduler.cancel (c);
+    assert (scheduler.when (c) == 0);
+    assert (scheduler.next () == 300);
+    assert (scheduler.due (299).empty ());
+
+    std::vector <AlertScheduler::Key> due = scheduler.due (1000);
+    assert (due.size () == 2);
+    assert (due [0] == a);
+    assert (due [1] == b);
+    assert (scheduler.size () == 0);
+    assert (scheduler.next () == 0);
+
+    // rescheduling many times does not grow the heap without limit
+    for (uint64_t i = 0; i != 10000; i++)
+        scheduler.schedule (a, 10000 - i);
+    assert (scheduler.next () == 1);
+    due = scheduler.due (10000);
+    assert (due.size () == 1);
+
+    // cancelling many alerts does not leave the stale entries behind
+    for (uint64_t i = 0; i != 1000; i++)
+        scheduler.schedule (AlertScheduler::Key {"rule", std::to_string (i)}, 100 + i);
+    assert (scheduler.entries () == 1000);
+    for (uint64_t i = 0; i != 990; i++)
+        scheduler.cancel (AlertScheduler::Key {"rule", std::to_string (i)});
+    assert (scheduler.size () == 10);
+    assert (scheduler.entries () <= 2 * 10 + 64);
+    assert (scheduler.next () == 1090);
+
+    scheduler.schedule (a, 1);
+    scheduler.clear ();
+    assert (scheduler.next () == 0);
+    //  @end
+    printf ("OK\n");
+}
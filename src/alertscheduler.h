@@ -0,0 +1,94 @@
+/*  =========================================================================
+    alertscheduler - Schedule of alert notifications
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef ALERTSCHEDULER_H_INCLUDED
+#define ALERTSCHEDULER_H_INCLUDED
+
+#include <cstdint>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "alert.h"
+
+/**
+ * \class AlertScheduler
+ *
+ * \brief Min-heap of times when alerts are due for notification
+ *
+ * Each alert [rule, element] has at most one due time. Rescheduling or
+ * cancelling leaves the old heap entry in place, it is recognized as
+ * stale and dropped when it gets to the top. The heap is rebuilt from the
+ * live ones by schedule () or cancel () once it holds more than twice as
+ * many entries as there are scheduled alerts, plus 64.
+ *
+ * Example:
+ *
+ *    scheduler.schedule (key, last_notification + interval);
+ *    ...
+ *    zpoller_wait (poller, (scheduler.next () - now) * 1000);
+ *    for (const auto& key : scheduler.due (now))
+ *        notify (key);
+ */
+class AlertScheduler
+{
+ public:
+    typedef AlertKey Key;
+
+    // (re)schedule alert to time [s], replaces the previous time
+    void    schedule (const Key& key, uint64_t due);
+    void    cancel (const Key& key);
+    // due time of the alert, 0 if not scheduled
+    uint64_t when (const Key& key) const;
+
+    // earliest due time, 0 if nothing is scheduled
+    uint64_t next ();
+    // removes and returns alerts due at 'now', earliest first
+    std::vector <Key> due (uint64_t now);
+
+    size_t  size () const { return _due.size (); }
+    // heap entries, stale ones included
+    size_t  entries () const { return _heap.size (); }
+    void    clear ();
+
+ private:
+    struct Entry {
+        uint64_t due;
+        Key key;
+        bool operator> (const Entry& other) const { return due > other.due; }
+    };
+
+    bool    stale (const Entry& entry) const;
+    // rebuilds the heap if there are too many stale entries
+    void    compact ();
+    void    rebuild ();
+
+    std::priority_queue <Entry, std::vector <Entry>, std::greater <Entry>> _heap;
+    std::map <Key, uint64_t> _due;
+};
+
+//  Self test of this class
+void
+    alertscheduler_test (bool verbose);
+
+#endif
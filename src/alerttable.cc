@@ -0,0 +1,293 @@
+/*  =========================================================================
+    alerttable - Hash table of tracked alerts
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    alerttable - Hash table of tracked alerts
+@discuss
+    _index is a power of two sized array of entry numbers. Erased slots
+    become DELETED, so probes of other alerts continue over them, and are
+    dropped on next rehash. Table grows when used and deleted slots take
+    more than half of it.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <stdexcept>
+
+static const uint32_t EMPTY = UINT32_MAX;
+static const uint32_t DELETED = UINT32_MAX - 1;
+static const size_t MIN_CAPACITY = 16;
+
+static size_t
+s_hash (const InternedString& rule, const InternedString& element)
+{
+    // pointers are aligned, mix the bits before masking
+    uint64_t h = (uint64_t) rule.hash () * 0x9E3779B97F4A7C15ULL ^ (uint64_t) element.hash ();
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    return (size_t) h;
+}
+
+AlertTable::AlertTable () :
+    _index (MIN_CAPACITY, EMPTY),
+    _size (0),
+    _deleted (0)
+{
+}
+
+size_t AlertTable::probe (const InternedString& rule, const InternedString& element) const
+{
+    size_t mask = _index.size () - 1;
+    for (size_t i = s_hash (rule, element) & mask; ; i = (i + 1) & mask) {
+        uint32_t n = _index [i];
+        if (n == EMPTY)
+            return i;
+        if (n == DELETED)
+            continue;
+        const Alert& alert = _entries [n].alert;
+        if (alert.rule == rule && alert.element == element)
+            return i;
+    }
+}
+
+void AlertTable::rehash (size_t capacity)
+{
+    _index.assign (capacity, EMPTY);
+    _deleted = 0;
+    for (size_t n = 0; n != _entries.size (); n++) {
+        if (_entries [n].used)
+            _index [probe (_entries [n].alert.rule, _entries [n].alert.element)] = n;
+    }
+}
+
+Alert *AlertTable::find (const AlertKey& key)
+{
+    uint32_t n = _index [probe (key.first, key.second)];
+    return n == EMPTY ? NULL : &_entries [n].alert;
+}
+
+const Alert *AlertTable::find (const AlertKey& key) const
+{
+    uint32_t n = _index [probe (key.first, key.second)];
+    return n == EMPTY ? NULL : &_entries [n].alert;
+}
+
+Alert *AlertTable::find (const std::string& rule, const std::string& element)
+{
+    AlertKey key;
+    if (!InternedString::lookup (rule, key.first) || !InternedString::lookup (element, key.second))
+        return NULL;
+    return find (key);
+}
+
+const Alert& AlertTable::at (const std::string& rule, const std::string& element) const
+{
+    AlertKey key;
+    const Alert *alert = NULL;
+    if (InternedString::lookup (rule, key.first) && InternedString::lookup (element, key.second))
+        alert = find (key);
+    if (!alert)
+        throw std::out_of_range ("AlertTable::at");
+    return *alert;
+}
+
+std::pair <Alert *, bool> AlertTable::insert (const Alert& alert)
+{
+    size_t i = probe (alert.rule, alert.element);
+    if (_index [i] != EMPTY)
+        return std::make_pair (&_entries [_index [i]].alert, false);
+
+    if ((_size + _deleted + 1) * 2 > _index.size ()) {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity < (_size + 1) * 4)
+            capacity *= 2;
+        rehash (capacity);
+        i = probe (alert.rule, alert.element);
+    }
+
+    uint32_t n;
+    if (_free.empty ()) {
+        n = _entries.size ();
+        _entries.push_back (Entry {alert, true});
+    }
+    else {
+        n = _free.back ();
+        _free.pop_back ();
+        _entries [n].alert = alert;
+        _entries [n].used = true;
+    }
+    _index [i] = n;
+    _size ++;
+    _by_asset [alert.element].push_back (n);
+    return std::make_pair (&_entries [n].alert, true);
+}
+
+Alert& AlertTable::set (const Alert& alert)
+{
+    std::pair <Alert *, bool> r = insert (alert);
+    if (!r.second)
+        *r.first = alert;
+    return *r.first;
+}
+
+bool AlertTable::erase (const AlertKey& key)
+{
+    size_t i = probe (key.first, key.second);
+    uint32_t n = _index [i];
+    if (n == EMPTY)
+        return false;
+
+    _index [i] = DELETED;
+    _deleted ++;
+    _size --;
+
+    auto it = _by_asset.find (key.second);
+    std::vector <uint32_t>& entries = it->second;
+    entries.erase (std::find (entries.begin (), entries.end (), n));
+    if (entries.empty ())
+        _by_asset.erase (it);
+
+    _entries [n].alert = Alert ();
+    _entries [n].used = false;
+    _free.push_back (n);
+    return true;
+}
+
+bool AlertTable::erase (const std::string& rule, const std::string& element)
+{
+    AlertKey key;
+    if (!InternedString::lookup (rule, key.first) || !InternedString::lookup (element, key.second))
+        return false;
+    return erase (key);
+}
+
+std::vector <Alert *> AlertTable::ofAsset (const std::string& element)
+{
+    std::vector <Alert *> ret;
+    InternedString e;
+    if (!InternedString::lookup (element, e))
+        return ret;
+    auto it = _by_asset.find (e);
+    if (it == _by_asset.end ())
+        return ret;
+    for (uint32_t n : it->second)
+        ret.push_back (&_entries [n].alert);
+    return ret;
+}
+
+void AlertTable::clear ()
+{
+    _entries.clear ();
+    _free.clear ();
+    _index.assign (MIN_CAPACITY, EMPTY);
+    _size = 0;
+    _deleted = 0;
+    _by_asset.clear ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+alerttable_test (bool verbose)
+{
+    printf (" * alerttable: ");
+
+    //  @selftest
+    AlertTable alerts;
+    assert (alerts.empty ());
+    assert (alerts.begin () == alerts.end ());
+
+    Alert a;
+    a.rule = "rule1";
+    a.element = "ups";
+    a.description = "first";
+    std::pair <Alert *, bool> r = alerts.insert (a);
+    assert (r.second);
+    Alert *first = r.first;
+
+    a.description = "second";
+    r = alerts.insert (a);
+    assert (!r.second);
+    assert (r.first == first);
+    assert (first->description == "first");
+    alerts.set (a);
+    assert (first->description == "second");
+    assert (alerts.size () == 1);
+
+    // enough alerts to rehash several times and keep pointers
+    for (int i = 0; i != 1000; i++) {
+        Alert b;
+        b.rule = "rule" + std::to_string (i % 10);
+        b.element = "asset" + std::to_string (i / 10);
+        b.time = i;
+        assert (alerts.insert (b).second);
+    }
+    assert (alerts.size () == 1001);
+    assert (alerts.find ("rule1", "ups") == first);
+    assert (alerts.find ("rule7", "asset42")->time == 427);
+    assert (alerts.at ("rule3", "asset99").time == 993);
+    assert (alerts.find ("rule1", "nonexistent-asset") == NULL);
+    assert (alerts.find (AlertKey ("rule1", "ups")) == first);
+
+    bool thrown = false;
+    try {
+        alerts.at ("no-such-rule", "ups");
+    }
+    catch (const std::out_of_range& e) {
+        thrown = true;
+    }
+    assert (thrown);
+
+    // per asset index
+    assert (alerts.ofAsset ("asset5").size () == 10);
+    assert (alerts.ofAsset ("ups").size () == 1);
+    assert (alerts.ofAsset ("nonexistent-asset").empty ());
+
+    // erase and reuse
+    for (int i = 0; i != 10; i++)
+        assert (alerts.erase (AlertKey ("rule" + std::to_string (i), "asset5")));
+    assert (!alerts.erase (std::string ("rule1"), std::string ("asset5")));
+    assert (alerts.ofAsset ("asset5").empty ());
+    assert (alerts.size () == 991);
+    assert (alerts.find ("rule7", "asset42")->time == 427);
+    a.rule = "rule1";
+    a.element = "asset5";
+    assert (alerts.insert (a).second);
+    assert (alerts.find ("rule1", "asset5")->description == "second");
+
+    size_t count = 0;
+    for (const Alert& alert : alerts) {
+        assert (!alert.rule.empty ());
+        count ++;
+    }
+    assert (count == alerts.size ());
+
+    alerts.clear ();
+    assert (alerts.size () == 0);
+    assert (alerts.find ("rule1", "ups") == NULL);
+    //  @end
+    printf ("OK\n");
+}
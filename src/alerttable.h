@@ -0,0 +1,126 @@
+/*  =========================================================================
+    alerttable - Hash table of tracked alerts
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef ALERTTABLE_H_INCLUDED
+#define ALERTTABLE_H_INCLUDED
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "alert.h"
+
+/**
+ * \class AlertTable
+ *
+ * \brief Alerts tracked by the agent, indexed by [rule, element]
+ *
+ * Open addressing (linear probing) over interned rule and element, so
+ * lookup hashes two pointers. Alerts themselves live in a deque, which
+ * keeps pointers returned by find () and insert () valid until the
+ * alert is erased. Alerts of one asset are indexed too, see ofAsset ().
+ *
+ * Example:
+ *
+ *    AlertTable alerts;
+ *    Alert *alert = alerts.find (rule, asset);
+ *    if (!alert)
+ *        alert = alerts.insert (Alert (message)).first;
+ *    for (Alert& alert : alerts)
+ *        ...
+ */
+class AlertTable
+{
+    struct Entry {
+        Alert alert;
+        bool used;
+    };
+
+ public:
+    template <typename A, typename I>
+    class Iterator {
+     public:
+        Iterator (I it, I end) : _it (it), _end (end) { skip (); }
+        A& operator* () const { return _it->alert; }
+        A* operator-> () const { return &_it->alert; }
+        Iterator& operator++ () { ++_it; skip (); return *this; }
+        bool operator== (const Iterator& other) const { return _it == other._it; }
+        bool operator!= (const Iterator& other) const { return _it != other._it; }
+     private:
+        void skip () { while (_it != _end && !_it->used) ++_it; }
+        I _it;
+        I _end;
+    };
+    typedef Iterator <Alert, std::deque <Entry>::iterator> iterator;
+    typedef Iterator <const Alert, std::deque <Entry>::const_iterator> const_iterator;
+
+    AlertTable ();
+
+    // returns NULL if there is no such alert
+    Alert   *find (const AlertKey& key);
+    const Alert *find (const AlertKey& key) const;
+    // does not add strings to the pool, unknown strings can't be in the table
+    Alert   *find (const std::string& rule, const std::string& element);
+    // throws std::out_of_range if there is no such alert
+    const Alert& at (const std::string& rule, const std::string& element) const;
+
+    // inserts the alert unless there is one with the same rule and element
+    // returns the alert in the table and true if it was inserted
+    std::pair <Alert *, bool> insert (const Alert& alert);
+    // inserts or overwrites the alert
+    Alert&  set (const Alert& alert);
+    // returns true if the alert was there
+    bool    erase (const AlertKey& key);
+    bool    erase (const std::string& rule, const std::string& element);
+
+    // alerts on the asset
+    std::vector <Alert *> ofAsset (const std::string& element);
+
+    size_t  size () const { return _size; }
+    bool    empty () const { return _size == 0; }
+    void    clear ();
+
+    iterator begin () { return iterator (_entries.begin (), _entries.end ()); }
+    iterator end () { return iterator (_entries.end (), _entries.end ()); }
+    const_iterator begin () const { return const_iterator (_entries.begin (), _entries.end ()); }
+    const_iterator end () const { return const_iterator (_entries.end (), _entries.end ()); }
+
+ private:
+    // returns position in _index of the alert or of the empty slot ending the probe
+    size_t  probe (const InternedString& rule, const InternedString& element) const;
+    void    rehash (size_t capacity);
+
+    std::deque <Entry> _entries;
+    std::vector <uint32_t> _free;       // unused entries
+    std::vector <uint32_t> _index;      // entry numbers, EMPTY or DELETED
+    size_t _size;
+    size_t _deleted;
+    std::unordered_map <InternedString, std::vector <uint32_t>> _by_asset;
+};
+
+//  Self test of this class
+void
+    alerttable_test (bool verbose);
+
+#endif
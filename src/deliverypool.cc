@@ -0,0 +1,323 @@
+/*  =========================================================================
+    deliverypool - Pool of worker threads delivering emails
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    deliverypool - Pool of worker threads delivering emails
+@discuss
+    Actor renders the email and submits it to the pool. One of the workers
+    then sends it (via msmtp or the native client) and posts [id|code|message]
+    to the results socket.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+DeliveryPool::DeliveryPool (size_t workers, size_t capacity):
+    _endpoint {},
+    _results {NULL},
+    _capacity {capacity},
+    _last_id {0},
+    _stop {false},
+    _queue {},
+    _threads {},
+    _mutex {},
+    _cond {}
+{
+    char *endpoint = zsys_sprintf ("inproc://fty-email-delivery-%p", (void*) this);
+    _endpoint = endpoint;
+    zstr_free (&endpoint);
+
+    _results = zsock_new_pull (("@" + _endpoint).c_str ());
+    if (!_results)
+        throw std::runtime_error ("Cannot bind " + _endpoint);
+
+    this->workers (workers);
+}
+
+DeliveryPool::~DeliveryPool ()
+{
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        _stop = true;
+        if (!_queue.empty ())
+            zsys_warning ("DeliveryPool: dropping %zu undelivered emails", _queue.size ());
+        _queue.clear ();
+    }
+    _cond.notify_all ();
+    for (auto &thread : _threads)
+        thread.join ();
+    zsock_destroy (&_results);
+}
+
+void DeliveryPool::workers (size_t workers)
+{
+    if (workers < _threads.size ()) {
+        zsys_warning ("DeliveryPool: can't decrease number of workers from %zu to %zu, restart the agent",
+                _threads.size (), workers);
+        return;
+    }
+    while (_threads.size () < workers)
+        _threads.push_back (std::thread (&DeliveryPool::worker, this));
+}
+
+void DeliveryPool::capacity (size_t capacity)
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    _capacity = capacity;
+}
+
+uint64_t DeliveryPool::submit (
+        std::shared_ptr <const Smtp> smtp,
+        const std::string& data)
+{
+    return submit (Job {0, smtp, data, nullptr, nullptr});
+}
+
+uint64_t DeliveryPool::submit (
+        std::shared_ptr <const Smtp> smtp,
+        std::shared_ptr <const MimeWriter> mime)
+{
+    return submit (Job {0, smtp, std::string (), mime, nullptr});
+}
+
+uint64_t DeliveryPool::submit (std::function <int ()> task)
+{
+    return submit (Job {0, nullptr, std::string (), nullptr, task});
+}
+
+uint64_t DeliveryPool::submit (Job&& job)
+{
+    uint64_t id = 0;
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        if (_queue.size () >= _capacity)
+            return 0;
+        id = ++_last_id;
+        job.id = id;
+        _queue.push_back (std::move (job));
+    }
+    _cond.notify_one ();
+    return id;
+}
+
+size_t DeliveryPool::queued () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    return _queue.size ();
+}
+
+bool DeliveryPool::recv (zsock_t *results, DeliveryResult& result)
+{
+    zmsg_t *msg = zmsg_recv (results);
+    if (!msg)
+        return false;
+
+    if (zmsg_size (msg) != 3) {
+        zsys_error ("DeliveryPool: malformed result, expected 3 frames, got %zu", zmsg_size (msg));
+        zmsg_destroy (&msg);
+        return false;
+    }
+
+    char *id = zmsg_popstr (msg);
+    char *code = zmsg_popstr (msg);
+    char *message = zmsg_popstr (msg);
+
+    result.id = strtoull (id, NULL, 10);
+    result.code = static_cast <SmtpError> (strtoul (code, NULL, 10));
+    result.message = message;
+
+    zstr_free (&id);
+    zstr_free (&code);
+    zstr_free (&message);
+    zmsg_destroy (&msg);
+    return true;
+}
+
+void DeliveryPool::worker ()
+{
+    // native transport writes to sockets, broken connection must not kill the agent
+    sigset_t sigpipe;
+    sigemptyset (&sigpipe);
+    sigaddset (&sigpipe, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigpipe, NULL);
+
+    zsock_t *push = zsock_new_push ((">" + _endpoint).c_str ());
+    assert (push);
+
+    while (true) {
+        Job job;
+        {
+            std::unique_lock <std::mutex> lock (_mutex);
+            _cond.wait (lock, [this] { return _stop || !_queue.empty (); });
+            if (_stop)
+                break;
+            job = std::move (_queue.front ());
+            _queue.pop_front ();
+        }
+
+        SmtpError code = SmtpError::Succeeded;
+        std::string message = "OK";
+        try {
+            if (job.task) {
+                if (job.task () != 0) {
+                    code = SmtpError::Unknown;
+                    message = "Task failed";
+                }
+            }
+            else
+            if (job.mime)
+                job.smtp->sendmail (*job.mime);
+            else
+                job.smtp->sendmail (job.data);
+        }
+        catch (const std::runtime_error &re) {
+            code = smtp_error_code (re);
+            if (code == SmtpError::Succeeded)
+                code = SmtpError::Unknown;
+            message = re.what ();
+        }
+        // anything else must not kill the agent, the job gets its result
+        catch (const std::exception &e) {
+            code = SmtpError::Unknown;
+            message = e.what ();
+        }
+        catch (...) {
+            code = SmtpError::Unknown;
+            message = "Unknown exception";
+        }
+
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstrf (msg, "%" PRIu64, job.id);
+        zmsg_addstrf (msg, "%" PRIu32, static_cast <uint32_t> (code));
+        zmsg_addstr (msg, message.c_str ());
+        if (zmsg_send (&msg, push) == -1) {
+            zsys_error ("DeliveryPool: can't post result of job %" PRIu64, job.id);
+            zmsg_destroy (&msg);
+        }
+    }
+
+    zsock_destroy (&push);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+deliverypool_test (bool verbose)
+{
+    printf (" * deliverypool: ");
+
+    //  @selftest
+    std::mutex mutex;
+    std::vector <std::string> sent;
+    std::shared_ptr <Smtp> smtp = std::make_shared <Smtp> ();
+    smtp->sendmail_set_test_fn (
+        [&mutex, &sent] (const std::string &data) {
+            if (data == "fail")
+                throw std::runtime_error ("msmtp: cannot connect to mail.example.com, port 25");
+            std::lock_guard <std::mutex> lock (mutex);
+            sent.push_back (data);
+        });
+
+    {
+    // no workers yet, so the queue is not drained
+    DeliveryPool pool {0, 2};
+    uint64_t id1 = pool.submit (smtp, "email");
+    uint64_t id2 = pool.submit (smtp, "fail");
+    assert (id1 != 0);
+    assert (id2 != 0 && id2 != id1);
+    assert (pool.queued () == 2);
+    // queue is bounded
+    assert (pool.submit (smtp, "email") == 0);
+
+    pool.workers (2);
+    assert (pool.workers () == 2);
+
+    zpoller_t *poller = zpoller_new (pool.results (), NULL);
+    for (int i = 0; i != 2; i++) {
+        void *which = zpoller_wait (poller, 5000);
+        assert (which == pool.results ());
+        DeliveryResult result;
+        assert (DeliveryPool::recv (pool.results (), result));
+        if (result.id == id1) {
+            assert (result.code == SmtpError::Succeeded);
+            assert (result.message == "OK");
+        }
+        else {
+            assert (result.id == id2);
+            assert (result.code == SmtpError::ServerUnreachable);
+        }
+    }
+    zpoller_destroy (&poller);
+    assert (pool.queued () == 0);
+    }
+    assert (sent.size () == 1);
+    assert (sent [0] == "email");
+
+    // email is encoded by the worker
+    {
+    DeliveryPool pool {1, 2};
+    std::shared_ptr <MimeWriter> mime = std::make_shared <MimeWriter> ();
+    mime->header ("To", "joe@example.com");
+    mime->body ("mime");
+    uint64_t id = pool.submit (smtp, mime);
+    assert (id != 0);
+    zpoller_t *poller = zpoller_new (pool.results (), NULL);
+    void *which = zpoller_wait (poller, 5000);
+    assert (which == pool.results ());
+    DeliveryResult result;
+    assert (DeliveryPool::recv (pool.results (), result));
+    assert (result.id == id);
+    assert (result.code == SmtpError::Succeeded);
+    zpoller_destroy (&poller);
+    std::lock_guard <std::mutex> lock (mutex);
+    assert (sent.size () == 2);
+    assert (sent [1] == mime->str ());
+    }
+
+    // tasks are run by the worker, nothing is sent
+    {
+    DeliveryPool pool {1, 4};
+    std::thread::id runner;
+    uint64_t ok = pool.submit ([&runner] { runner = std::this_thread::get_id (); return 0; });
+    uint64_t failed = pool.submit ([] { return -1; });
+    assert (ok != 0 && failed != 0);
+    // any exception is the failure of the job
+    assert (pool.submit ([] () -> int { throw std::bad_alloc (); }) != 0);
+    assert (pool.submit ([] () -> int { throw 42; }) != 0);
+    zpoller_t *poller = zpoller_new (pool.results (), NULL);
+    for (int i = 0; i != 4; i++) {
+        void *which = zpoller_wait (poller, 5000);
+        assert (which == pool.results ());
+        DeliveryResult result;
+        assert (DeliveryPool::recv (pool.results (), result));
+        assert (result.code == (result.id == ok ? SmtpError::Succeeded : SmtpError::Unknown));
+    }
+    zpoller_destroy (&poller);
+    assert (runner != std::thread::id ());
+    assert (runner != std::this_thread::get_id ());
+    std::lock_guard <std::mutex> lock (mutex);
+    assert (sent.size () == 2);
+    }
+    //  @end
+    printf ("OK\n");
+}
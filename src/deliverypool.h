@@ -0,0 +1,175 @@
+/*  =========================================================================
+    deliverypool - Pool of worker threads delivering emails
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   deliverypool.h
+    \brief  Bounded queue of emails served by a pool of worker threads
+
+Example:
+
+    DeliveryPool pool {2, 128};
+    std::shared_ptr <const Smtp> smtp = std::make_shared <Smtp> (configured_smtp);
+
+    uint64_t id = pool.submit (smtp, smtp->compose (to, subject, body));
+    if (id == 0)
+        // queue is full, try it later
+
+    // in the actor loop, poll on pool.results ()
+    DeliveryResult result;
+    if (DeliveryPool::recv (pool.results (), result))
+        // result.id == id, result.code == SmtpError::Succeeded on success
+
+*/
+#ifndef DELIVERYPOOL_H_INCLUDED
+#define DELIVERYPOOL_H_INCLUDED
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "email.h"
+
+/**
+ * \class DeliveryResult
+ *
+ * Outcome of one delivery job, as posted back by a worker
+ */
+struct DeliveryResult {
+    uint64_t id;
+    SmtpError code;
+    std::string message;
+};
+
+/**
+ * \class DeliveryPool
+ *
+ * \brief Pool of worker threads calling Smtp::sendmail
+ *
+ * Emails are rendered by the caller and put into a bounded queue. Worker
+ * threads own the msmtp subprocesses or SMTP connections, so slow or hung
+ * delivery does not block the caller. Results are posted back over inproc
+ * socket returned by results (), which is meant to be polled by the owning
+ * actor, so all the bookkeeping happens in the actor thread.
+ */
+class DeliveryPool
+{
+    public:
+        /**
+         * \brief Creates the pool and starts the workers
+         *
+         * \param workers   number of worker threads
+         * \param capacity  maximum number of jobs waiting in the queue
+         */
+        explicit DeliveryPool (size_t workers = 1, size_t capacity = 1024);
+
+        /** \brief stops the workers, jobs still in the queue are dropped */
+        ~DeliveryPool ();
+
+        /**
+         * \brief set number of worker threads
+         *
+         * Pool can only grow, decreasing the number takes effect after restart.
+         */
+        void workers (size_t workers);
+        size_t workers () const { return _threads.size (); }
+
+        /** \brief set maximum number of jobs waiting in the queue */
+        void capacity (size_t capacity);
+
+        /**
+         * \brief put the email to the queue
+         *
+         * \param smtp  configured transport, shared with the worker
+         * \param data  email DATA, \see Smtp::sendmail (const std::string&)
+         *
+         * \return id of the job or 0 if the queue is full
+         */
+        uint64_t submit (
+                std::shared_ptr <const Smtp> smtp,
+                const std::string& data);
+
+        /**
+         * \brief put the email to the queue, it is encoded by the worker
+         *
+         * \param mime  email, \see Smtp::sendmail (const MimeWriter&)
+         */
+        uint64_t submit (
+                std::shared_ptr <const Smtp> smtp,
+                std::shared_ptr <const MimeWriter> mime);
+
+        /**
+         * \brief put a task to the queue, e.g. writing email into MailSpool
+         *
+         * \param task  run by the worker, result is Succeeded if it returns
+         *              0, Unknown otherwise
+         */
+        uint64_t submit (std::function <int ()> task);
+
+        /** \brief number of jobs waiting in the queue */
+        size_t queued () const;
+
+        /** \brief socket delivering results, owned by the pool */
+        zsock_t *results () const { return _results; }
+
+        /**
+         * \brief receive one result from the results () socket
+         *
+         * \return false if the message is malformed or interrupted
+         */
+        static bool recv (zsock_t *results, DeliveryResult& result);
+
+    protected:
+
+        struct Job {
+            uint64_t id;
+            std::shared_ptr <const Smtp> smtp;
+            std::string data;
+            // data is empty if set
+            std::shared_ptr <const MimeWriter> mime;
+            // nothing is sent if set
+            std::function <int ()> task;
+        };
+
+        uint64_t submit (Job&& job);
+
+        void worker ();
+
+        std::string _endpoint;
+        zsock_t *_results;
+        size_t _capacity;
+        uint64_t _last_id;
+        bool _stop;
+        std::deque <Job> _queue;
+        std::vector <std::thread> _threads;
+        mutable std::mutex _mutex;
+        std::condition_variable _cond;
+
+        DeliveryPool (const DeliveryPool&) = delete;
+        DeliveryPool& operator= (const DeliveryPool&) = delete;
+};
+
+void deliverypool_test (bool verbose);
+
+#endif
@@ -0,0 +1,159 @@
+/*  =========================================================================
+    digestqueue - Notifications buffered per recipient
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    digestqueue - Notifications buffered per recipient
+@discuss
+    During an alert storm one contact may get notifications about dozens
+    of alerts in a minute. They are collected for a while and sent as one
+    email.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <algorithm>
+
+bool DigestQueue::add (const std::string& to, const AlertKey& alert, uint64_t now)
+{
+    auto it = _digests.find (to);
+    if (it == _digests.end ()) {
+        Digest digest {now + _window, {alert}};
+        _order.insert (std::make_pair (digest.due, to));
+        _digests.emplace (to, digest);
+        return true;
+    }
+    std::vector <AlertKey>& alerts = it->second.alerts;
+    if (std::find (alerts.begin (), alerts.end (), alert) != alerts.end ())
+        return false;
+    alerts.push_back (alert);
+    return true;
+}
+
+void DigestQueue::defer (const std::string& to, const std::vector <AlertKey>& alerts, uint64_t due)
+{
+    auto it = _digests.find (to);
+    if (it == _digests.end ()) {
+        _order.insert (std::make_pair (due, to));
+        _digests.emplace (to, Digest {due, alerts});
+        return;
+    }
+    Digest& digest = it->second;
+    if (due < digest.due) {
+        _order.erase (std::make_pair (digest.due, to));
+        _order.insert (std::make_pair (due, to));
+        digest.due = due;
+    }
+    for (const auto& alert : alerts) {
+        if (std::find (digest.alerts.begin (), digest.alerts.end (), alert) == digest.alerts.end ())
+            digest.alerts.push_back (alert);
+    }
+}
+
+uint64_t DigestQueue::next () const
+{
+    if (_order.empty ())
+        return 0;
+    return _order.begin ()->first;
+}
+
+std::vector <std::pair <std::string, std::vector <AlertKey>>> DigestQueue::due (uint64_t now)
+{
+    std::vector <std::pair <std::string, std::vector <AlertKey>>> ret;
+    while (!_order.empty () && _order.begin ()->first <= now) {
+        auto it = _digests.find (_order.begin ()->second);
+        ret.push_back (std::make_pair (it->first, std::move (it->second.alerts)));
+        _digests.erase (it);
+        _order.erase (_order.begin ());
+    }
+    return ret;
+}
+
+void DigestQueue::clear ()
+{
+    _digests.clear ();
+    _order.clear ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+digestqueue_test (bool verbose)
+{
+    printf (" * digestqueue: ");
+
+    //  @selftest
+    DigestQueue digests;
+    digests.window (30);
+    AlertKey a {"rule1", "ups"};
+    AlertKey b {"rule2", "ups"};
+    AlertKey c {"rule1", "epdu"};
+    assert (digests.next () == 0);
+    assert (digests.due (1000).empty ());
+
+    assert (digests.add ("joe@example.com", a, 100));
+    assert (digests.add ("joe@example.com", b, 110));
+    assert (!digests.add ("joe@example.com", a, 120));
+    assert (digests.add ("jane@example.com", c, 105));
+    assert (digests.add ("jane@example.com", a, 106));
+    assert (digests.size () == 2);
+    assert (digests.next () == 130);
+    assert (digests.due (129).empty ());
+
+    // later alerts do not postpone the digest
+    std::vector <std::pair <std::string, std::vector <AlertKey>>> due = digests.due (130);
+    assert (due.size () == 1);
+    assert (due [0].first == "joe@example.com");
+    assert (due [0].second.size () == 2);
+    assert (due [0].second [0] == a);
+    assert (due [0].second [1] == b);
+    assert (digests.next () == 135);
+
+    // recipient gets a new digest once the previous one is due
+    assert (digests.add ("joe@example.com", a, 131));
+    due = digests.due (1000);
+    assert (due.size () == 2);
+    assert (due [0].first == "jane@example.com");
+    assert (due [0].second.size () == 2);
+    assert (due [1].first == "joe@example.com");
+    assert (due [1].second.size () == 1);
+    assert (digests.size () == 0);
+    assert (digests.next () == 0);
+
+    // deferred alerts join the open digest
+    digests.defer ("joe@example.com", {a, b}, 500);
+    assert (digests.next () == 500);
+    digests.add ("joe@example.com", c, 400);
+    digests.defer ("joe@example.com", {b}, 450);
+    assert (digests.next () == 450);
+    due = digests.due (450);
+    assert (due.size () == 1);
+    assert (due [0].second.size () == 3);
+    assert (due [0].second [2] == c);
+
+    digests.add ("joe@example.com", a, 0);
+    digests.clear ();
+    assert (digests.size () == 0);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,91 @@
+/*  =========================================================================
+    digestqueue - Notifications buffered per recipient
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef DIGESTQUEUE_H_INCLUDED
+#define DIGESTQUEUE_H_INCLUDED
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "alert.h"
+
+/**
+ * \class DigestQueue
+ *
+ * \brief Alerts waiting to be sent to the recipient in one email
+ *
+ * The first alert added for the recipient opens the digest, which is
+ * due window seconds later. Alerts added until then go to the same
+ * digest, each alert at most once.
+ *
+ * Example:
+ *
+ *    digests.window (30);
+ *    digests.add (element.email, alert.key (), now);
+ *    ...
+ *    zpoller_wait (poller, (digests.next () - now) * 1000);
+ *    for (const auto& digest : digests.due (now))
+ *        send (digest.first, digest.second);
+ */
+class DigestQueue
+{
+ public:
+    DigestQueue () : _window (0) {};
+
+    // [s] how long alerts are collected, 0 turns digests off
+    void    window (uint64_t window) { _window = window; }
+    uint64_t window () const { return _window; }
+
+    // returns false if the alert is already in the digest of recipient
+    bool    add (const std::string& to, const AlertKey& alert, uint64_t now);
+    // puts alerts back to the queue due at 'due', joins the open digest of
+    // recipient (which is due then at the earlier of the times) if any
+    void    defer (const std::string& to, const std::vector <AlertKey>& alerts, uint64_t due);
+
+    // earliest due time, 0 if there is no digest
+    uint64_t next () const;
+    // removes and returns digests due at 'now', earliest first
+    std::vector <std::pair <std::string, std::vector <AlertKey>>> due (uint64_t now);
+
+    // number of recipients with open digest
+    size_t  size () const { return _digests.size (); }
+    void    clear ();
+
+ private:
+    struct Digest {
+        uint64_t due;
+        std::vector <AlertKey> alerts;
+    };
+
+    uint64_t _window;
+    std::map <std::string, Digest> _digests;
+    std::set <std::pair <uint64_t, std::string>> _order;
+};
+
+//  Self test of this class
+void
+    digestqueue_test (bool verbose);
+
+#endif
@@ -20,10 +20,10 @@
 #include "fty_email_classes.h"
 
 #include <utility>
+#include <map>
 #include <cstdint>
 #include <stdexcept>
 #include <fstream>
-#include <cxxtools/jsonserializer.h>
 #include <cxxtools/jsondeserializer.h>
 #include <czmq.h>
 #include "email.h"
@@ -32,6 +32,16 @@
 
 const std::string ElementList::DEFAULT_PATH_TO_FILE = "/var/lib/fty/fty-email/state";
 
+// fixed-width record of the snapshot, strings are indexes to string table
+// sms_email is not stored, it depends on sms gateway given to load ()
+struct ElementRecord {
+    uint32_t name;
+    uint32_t contactName;
+    uint32_t email;
+    uint32_t phone;
+    uint32_t priority;
+};
+
 void operator<<= (cxxtools::SerializationInfo& si, const Element& element)
 {
     si.addMember("name") <<= element.name;
@@ -62,73 +72,126 @@ void operator>>= (const cxxtools::SerializationInfo& si, Element& asset)
     si.getMember("contact_phone") >>= asset.phone;
 }
 
+const Element *ElementList::find (const std::string& asset_name) const
+{
+    auto search = _assets.find (asset_name);
+    if (search == _assets.cend ())
+        return NULL;
+    return &search->second;
+}
+
 bool ElementList::get (const std::string& asset_name, Element& element) const
 {
-    try {
-        element = _assets.at (asset_name);
-    }
-    catch (const std::out_of_range& e) {
+    const Element *found = find (asset_name);
+    if (!found)
         return false;
-    }
+    element = *found;
     return true;
 }
 unsigned int ElementList::size (void) const
 {
     return _assets.size();
 }
-void ElementList::add (const Element& element)
+bool ElementList::add (const Element& element)
 {
     auto search = _assets.find (element.name);
     if (search == _assets.cend ()) {
         _assets.emplace (std::make_pair (element.name, element));
+        changed ();
+        return true;
     }
-    else {
+    else if (search->second != element) {
         search->second = element;
+        changed ();
+        return true;
     }
+    return false;
 }
 
-void ElementList::remove (const char *asset_name) {
-    _assets.erase(asset_name);
+bool ElementList::remove (const char *asset_name) {
+    if (_assets.erase(asset_name) == 0)
+        return false;
+    changed ();
+    return true;
 }
 
-void ElementList::updateContactName (const std::string &elementName, const std::string &contactName)
+bool ElementList::updateContactName (const std::string &elementName, const std::string &contactName)
 {
     auto search = _assets.find (elementName);
-    if ( search != _assets.cend ()) {
+    if ( search != _assets.cend () && search->second.contactName != contactName) {
         search->second.contactName = contactName;
+        changed ();
+        return true;
     }
+    return false;
 }
 
-void ElementList::updateEmail (const std::string &elementName, const std::string &email)
+bool ElementList::updateEmail (const std::string &elementName, const std::string &email)
 {
     auto search = _assets.find (elementName);
-    if ( search != _assets.cend ()) {
+    if ( search != _assets.cend () && search->second.email != email) {
         search->second.email = email;
+        changed ();
+        return true;
     }
+    return false;
 }
 
-void ElementList::updatePhone (const std::string &elementName, const std::string &phone)
+bool ElementList::updatePhone (const std::string &elementName, const std::string &phone)
 {
     auto search = _assets.find (elementName);
-    if ( search != _assets.cend ()) {
+    if ( search != _assets.cend () && search->second.phone != phone) {
         search->second.phone = phone;
+        changed ();
+        return true;
     }
+    return false;
 }
 
-void ElementList::updateSMSEmail (const std::string &elementName, const std::string &email)
+bool ElementList::updateSMSEmail (const std::string &elementName, const std::string &email)
 {
     auto search = _assets.find (elementName);
-    if ( search != _assets.cend ()) {
+    if ( search != _assets.cend () && search->second.sms_email != email) {
         search->second.sms_email = email;
+        changed ();
+        return true;
     }
+    return false;
+}
+
+void ElementList::changed ()
+{
+    if (_changes == 0)
+        _first_change = zclock_mono ();
+    _changes ++;
+}
+
+void ElementList::setFlushPolicy (int64_t interval, size_t changes)
+{
+    _flush_interval = interval;
+    _flush_changes = changes;
+}
+
+int64_t ElementList::flushTimeout () const
+{
+    if (_changes == 0)
+        return -1;
+    if (_changes >= _flush_changes && !_save_failed)
+        return 0;
+    int64_t elapsed = zclock_mono () - _first_change;
+    return elapsed >= _flush_interval ? 0 : _flush_interval - elapsed;
+}
+
+int ElementList::flush ()
+{
+    if (flushTimeout () != 0)
+        return 1;
+    return save ();
 }
 
 bool ElementList::exists (const std::string& asset_name) const
 {
-    auto search =_assets.find (asset_name);
-    if (search != _assets.cend ())
-        return true;
-    return false;
+    return find (asset_name) != NULL;
 }
 
 bool ElementList::empty () const
@@ -154,65 +217,129 @@ void ElementList::setFile ()
 
 int ElementList::save () {
     setFile ();
-    std::ofstream ofs (_path + ".new", std::ofstream::out);
-    if ( !ofs.good() ) {
-        zsys_error ("Cannot open file '%s' for write", (_path + ".new").c_str());
-        ofs.close();
+    SnapshotWriter writer (SNAPSHOT_ASSETS, sizeof (ElementRecord));
+    for (const auto& it : _assets) {
+        const Element& element = it.second;
+        ElementRecord record;
+        record.name = writer.intern (element.name);
+        record.contactName = writer.intern (element.contactName);
+        record.email = writer.intern (element.email);
+        record.phone = writer.intern (element.phone);
+        record.priority = element.priority;
+        writer.append (&record);
+    }
+    if (writer.save (_path) != 0) {
+        // not to try it again on every flush ()
+        _first_change = zclock_mono ();
+        _save_failed = true;
         return -1;
     }
-    int r = std::rename (std::string ( _path).append(".new").c_str (),
-        std::string (_path.c_str ()).c_str());
-    if ( r != 0 ) {
-        zsys_error ("Cannot rename file '%s' to '%s'", _path.c_str(), _path.c_str());
-        return -2;
+    _changes = 0;
+    _save_failed = false;
+    return 0;
+}
+
+int ElementList::exportJson (const std::string& path) const
+{
+    // same layout as cxxtools serialization of std::map
+    JsonWriter json;
+    if (json.open (path) != 0)
+        return -1;
+    json.beginArray ();
+    for (const auto& it : _assets) {
+        const Element& element = it.second;
+        json.beginObject ();
+        json.member ("key", it.first);
+        json.key ("value").beginObject ()
+            .member ("name", element.name)
+            .member ("priority", std::to_string (element.priority)) // ARM workaround
+            .member ("contact_name", element.contactName)
+            .member ("contact_email", element.email)
+            .member ("contact_phone", element.phone)
+            .endObject ();
+        json.endObject ();
+    }
+    json.endArray ();
+    return json.commit ();
+}
+
+int ElementList::loadSnapshot (SnapshotReader& reader)
+{
+    _assets.clear ();
+    for (uint32_t i = 0; i != reader.size (); i++) {
+        const ElementRecord *record = static_cast <const ElementRecord *> (reader.record (i));
+        SnapshotString name, contactName, email, phone;
+        if (!reader.string (record->name, name)
+        ||  !reader.string (record->contactName, contactName)
+        ||  !reader.string (record->email, email)
+        ||  !reader.string (record->phone, phone)
+        ||  record->priority > UINT8_MAX) {
+            zsys_error ("Starting without initial state. Snapshot '%s' is damaged: record %u is invalid", _path.c_str(), i);
+            _assets.clear ();
+            return -1;
+        }
+        Element& element = _assets [name.str ()];
+        element.name.assign (name.data, name.size);
+        element.contactName.assign (contactName.data, contactName.size);
+        element.email.assign (email.data, email.size);
+        element.phone.assign (phone.data, phone.size);
+        element.priority = record->priority;
     }
-    ofs << serialize_to_json();
-    ofs.close();
     return 0;
 }
 
 int ElementList::load (const std::string &sms_gateway) {
-    // TODO if !is file
-    std::ifstream ifs (_path, std::ios::in | std::ios::binary);
-    if ( !ifs.good() ) {
-        zsys_error ("Cannot open file '%s' for read", _path.c_str());
-        ifs.close();
-        return -1;
+    SnapshotReader reader;
+    int r = reader.open (_path, SNAPSHOT_ASSETS, sizeof (ElementRecord));
+    if (r == 0) {
+        if (loadSnapshot (reader) != 0)
+            return -1;
     }
-    try {
-        cxxtools::SerializationInfo si;
-        std::string json_string(std::istreambuf_iterator<char>(ifs), {});
-        std::stringstream s(json_string);
-    // TODO try
-        cxxtools::JsonDeserializer json(s);
-        json.deserialize(si);
-        si >>= _assets;
-        ifs.close();
-
-        for ( auto &it : _assets ) {
-            try {
-                it.second.sms_email = sms_email_address (sms_gateway, it.second.phone);
-            }
-            catch ( const std::exception &e ) {
-                zsys_error (e.what());
-            }
+    else
+    if (r == 1) {
+        // import of JSON state file
+        std::ifstream ifs (_path, std::ios::in | std::ios::binary);
+        try {
+            cxxtools::JsonDeserializer json(ifs);
+            cxxtools::SerializationInfo si;
+            json.deserialize(si);
+            std::map <std::string, Element> assets;
+            si >>= assets;
+            _assets.clear ();
+            _assets.insert (assets.begin (), assets.end ());
+            ifs.close();
+        }
+        catch ( const std::exception &e) {
+            zsys_error ("Starting without initial state. Cannot deserialize the file '%s'. Error: '%s'", _path.c_str(), e.what());
+            ifs.close();
+            return -1;
         }
-        return 0;
     }
-    catch ( const std::exception &e) {
-        zsys_error ("Starting without initial state. Cannot deserialize the file '%s'. Error: '%s'", _path.c_str(), e.what());
-        ifs.close();
+    else {
+        zsys_error ("Starting without initial state. Cannot load the file '%s'", _path.c_str());
         return -1;
     }
+    _changes = 0;
+
+    for ( auto &it : _assets ) {
+        try {
+            it.second.sms_email = sms_email_address (sms_gateway, it.second.phone);
+        }
+        catch ( const std::exception &e ) {
+            zsys_error (e.what());
+        }
+    }
+    return 0;
 }
 
-std::string ElementList::serialize_to_json () const
+bool Element::operator== (const Element& other) const
 {
-    std::stringstream s;
-    cxxtools::JsonSerializer js (s);
-    js.beautify (true);
-    js.serialize (_assets).finish();
-    return s.str();
+    return name == other.name
+        && priority == other.priority
+        && contactName == other.contactName
+        && email == other.email
+        && sms_email == other.sms_email
+        && phone == other.phone;
 }
 
 void Element::debug_print () const
@@ -230,7 +357,91 @@ elementlist_test (bool verbose)
     printf (" * elementlist: ");
 
     //  @selftest
-    //  Simple create/destroy test
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string path = std::string (SELFTEST_DIR_RW) + "/elementlist-state";
+    std::remove (path.c_str ());
+
+    ElementList elements {path};
+    elements.setFlushPolicy (100, 3);
+    assert (!elements.dirty ());
+    assert (elements.flushTimeout () == -1);
+
+    Element element;
+    element.name = "ups";
+    element.priority = 1;
+    element.email = "joe@example.com";
+    elements.add (element);
+    assert (elements.dirty ());
+    assert (elements.flushTimeout () > 0);
+    assert (elements.flush () == 1);
+
+    // no-op updates are not changes
+    elements.add (element);
+    elements.updateEmail ("ups", "joe@example.com");
+    elements.updateEmail ("nobody", "joe@example.com");
+    elements.remove ("nobody");
+    elements.flush ();
+    assert (elements.dirty ());
+
+    // flush after N changes
+    elements.updateEmail ("ups", "jane@example.com");
+    elements.updatePhone ("ups", "123456");
+    assert (elements.flushTimeout () == 0);
+    assert (elements.flush () == 0);
+    assert (!elements.dirty ());
+
+    // flush after interval
+    elements.updateContactName ("ups", "Jane");
+    zclock_sleep (150);
+    assert (elements.flushTimeout () == 0);
+    assert (elements.flush () == 0);
+
+    // failed save is retried after the interval
+    {
+    ElementList unwritable {std::string (SELFTEST_DIR_RW) + "/none/elementlist-state"};
+    unwritable.setFlushPolicy (100, 1);
+    unwritable.add (element);
+    assert (unwritable.flushTimeout () == 0);
+    assert (unwritable.flush () == -1);
+    assert (unwritable.dirty ());
+    assert (unwritable.flushTimeout () > 0);
+    assert (unwritable.flush () == 1);
+    unwritable.updatePhone ("ups", "654321");
+    assert (unwritable.flushTimeout () > 0);
+    zclock_sleep (150);
+    assert (unwritable.flushTimeout () == 0);
+    }
+
+    ElementList loaded {path};
+    assert (loaded.load ("") == 0);
+    assert (loaded.size () == 1);
+    Element ups;
+    assert (loaded.get ("ups", ups));
+    assert (ups.email == "jane@example.com");
+    assert (ups.contactName == "Jane");
+
+    // find returns the stored element, not a copy
+    const Element *found = loaded.find ("ups");
+    assert (found);
+    assert (found == loaded.find ("ups"));
+    assert (found->email == "jane@example.com");
+    assert (loaded.find ("nobody") == NULL);
+
+    // JSON is the export format and it is imported by load ()
+    assert (loaded.exportJson (path) == 0);
+    ElementList imported {path};
+    assert (imported.load ("") == 0);
+    assert (imported.get ("ups", ups));
+    assert (ups.email == "jane@example.com");
+    assert (ups.priority == 1);
+    std::remove (path.c_str ());
     //  @end
     printf ("OK\n");
 }
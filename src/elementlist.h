@@ -21,7 +21,9 @@
 #define ELEMENTLIST_H_INCLUDED
 
 #include <string>
-#include <map>
+#include <unordered_map>
+
+class SnapshotReader;
 
 class Element {
  public:
@@ -34,38 +36,71 @@ class Element {
     std::string phone;
 
     void debug_print () const;
+    bool operator== (const Element& other) const;
+    bool operator!= (const Element& other) const { return !(*this == other); }
 };
 
+// Changes are not saved immediately, but after flush interval elapsed
+// since the first unsaved change or after given number of changes,
+// see flush (). No-op updates do not count as a change. Failed save is
+// retried after flush interval, regardless of the number of changes.
 class ElementList
 {
  public:
-    ElementList () : _path(), _path_set(false) {};
-    ElementList (const std::string& path_to_file) : _path(path_to_file), _path_set(true) {};
+    ElementList () : _path(), _path_set(false), _changes(0), _first_change(0), _save_failed(false),
+        _flush_interval(DEFAULT_FLUSH_INTERVAL), _flush_changes(DEFAULT_FLUSH_CHANGES) {};
+    ElementList (const std::string& path_to_file) : _path(path_to_file), _path_set(true), _changes(0), _first_change(0), _save_failed(false),
+        _flush_interval(DEFAULT_FLUSH_INTERVAL), _flush_changes(DEFAULT_FLUSH_CHANGES) {};
 
+    // returns the element or NULL if 'asset_name' does not exist, nothing is copied;
+    // pointer is valid until the element is removed or the list is loaded
+    const Element *find (const std::string& asset_name) const;
     // returns
     //  * true - element with 'asset_name' exists and is assigned to 'element'
     //  * false - element with 'asset_name' does not exist and 'element' is not changed
     bool    get (const std::string& asset_name, Element& element) const;
-    void    add (const Element& element);
-    void    remove (const char *asset_name);
+    // mutators return true if the list has changed
+    bool    add (const Element& element);
+    bool    remove (const char *asset_name);
     bool    exists (const std::string& asset_name) const;
     bool    empty () const;
     void    setFile (const std::string& path_to_file);
     void    setFile ();
     int     save (); // TODO prepsat, tohle je strasny
     int     load (const std::string &sms_gateway); // TODO prepsat, tohle je strasny
-    std::string serialize_to_json () const;
-    void    updateContactName (const std::string &elementName, const std::string &contactName);
-    void    updateEmail (const std::string &elementName, const std::string &email);
-    void    updateSMSEmail (const std::string &elementName, const std::string &email);
-    void    updatePhone (const std::string &elementName, const std::string &phone);
+    // write assets in JSON format accepted by load (), returns 0 on success
+    int     exportJson (const std::string& path) const;
+
+    // interval [ms] since the first unsaved change, number of changes
+    void    setFlushPolicy (int64_t interval, size_t changes);
+    bool    dirty () const { return _changes > 0; }
+    // time [ms] until flush () saves, -1 if there is nothing to save
+    int64_t flushTimeout () const;
+    // save if there are unsaved changes and the policy says so
+    // returns 1 if nothing was saved, otherwise result of save ()
+    int     flush ();
+    bool    updateContactName (const std::string &elementName, const std::string &contactName);
+    bool    updateEmail (const std::string &elementName, const std::string &email);
+    bool    updateSMSEmail (const std::string &elementName, const std::string &email);
+    bool    updatePhone (const std::string &elementName, const std::string &phone);
     unsigned int size(void) const;
  private:
-    std::map <std::string, Element> _assets;
+    void    changed ();
+    int     loadSnapshot (SnapshotReader& reader);
+
+    std::unordered_map <std::string, Element> _assets;
     std::string _path;
     bool _path_set;
+    size_t _changes;
+    int64_t _first_change;
+    // last save failed, _first_change is the time of the failure
+    bool _save_failed;
+    int64_t _flush_interval;
+    size_t _flush_changes;
 
     static const std::string DEFAULT_PATH_TO_FILE;
+    static const int64_t DEFAULT_FLUSH_INTERVAL = 5000;
+    static const size_t DEFAULT_FLUSH_CHANGES = 1000;
 };
 
 //  Self test of this class
@@ -32,13 +32,15 @@
 #include <fstream>
 #include <ctime>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 // to ensure POSIX basename!!!
 // DO NOT REMOVE otherwise GNU basename can be used
 #include <libgen.h>
 
 #include <cxxtools/regex.h>
-#include <cxxtools/mime.h>
 
 Smtp::Smtp():
     _host {},
@@ -49,22 +51,15 @@ Smtp::Smtp():
     _password {},
     _msmtp { "/usr/bin/msmtp" },
     _has_fn {false},
-    _verify_ca {false}
+    _verify_ca {false},
+    _transport {Transport::MSMTP},
+    _client {std::make_shared <SmtpClient> ()},
+    _types {std::make_shared <MimeTypes> ()}
 {
-    _magic = magic_open (MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
-    if (!_magic)
-        throw std::runtime_error ("Cannot open magic_cookie");
-
-    int r = magic_load (_magic, NULL);
-    if (r == -1) {
-        magic_close (_magic);
-        throw std::runtime_error ("Cannot load magic database");
-    }
 }
 
 Smtp::~Smtp ()
 {
-    magic_close (_magic);
 }
 
 std::string Smtp::createConfigFile() const
@@ -120,36 +115,87 @@ void Smtp::deleteConfigFile(std::string &filename) const
 void Smtp::encryption(std::string enc)
 {
     if( strcasecmp ("starttls", enc.c_str()) == 0) encryption (Enctryption::STARTTLS);
+    else
     if( strcasecmp ("tls", enc.c_str()) == 0) encryption (Enctryption::TLS);
+    else
     encryption (Enctryption::NONE);
 }
 
-void Smtp::sendmail(
+void Smtp::transport (const std::string& transport)
+{
+    if (strcasecmp ("native", transport.c_str ()) == 0) this->transport (Transport::NATIVE);
+    else
+    this->transport (Transport::MSMTP);
+}
+
+SmtpSettings Smtp::settings () const
+{
+    SmtpSettings settings;
+    settings.host = _host;
+    settings.port = _port;
+    settings.encryption = _encryption;
+    settings.verify_ca = _verify_ca;
+    settings.username = _username;
+    settings.password = _password;
+    return settings;
+}
+
+void Smtp::pool_size (size_t size)
+{
+    _client->pool_size (size);
+}
+
+void Smtp::keepalive (uint32_t keepalive)
+{
+    _client->keepalive (keepalive * 1000LL);
+}
+
+void Smtp::expire () const
+{
+    _client->expire ();
+}
+
+SmtpPoolStats Smtp::pool_stats () const
+{
+    return _client->stats ();
+}
+
+// Source of email DATA already in memory, data must outlive the source
+static SmtpSource
+s_source (const std::string& data)
+{
+    return [&data] (const SmtpSink& sink) { sink (data.data (), data.size ()); };
+}
+
+std::vector <SmtpRecipientStatus> Smtp::sendmail(
         const std::vector<std::string> &to,
         const std::string& subject,
         const std::string& body) const
 {
+    std::vector <SmtpRecipientStatus> ret;
+    if (to.empty ())
+        return ret;
 
-    for (const auto& it : to)
-    {
-        zuuid_t *uuid = zuuid_new ();
-        zmsg_t *msg = fty_email_encode (
-            zuuid_str_canonical (uuid),
-            it.c_str (),
-            subject.c_str (),
-            NULL,
-            body.c_str (),
-            NULL
-        );
-        zuuid_destroy (&uuid);
-
-        // MVY: this is weird, horrible, ugly and hard to use.
-        //      Need to rething API for smtp_encode
-        //      BUT .. NEVER pass message with first uuid frame to msg2email
-        //      or BAD things will happen
-        char* cuuid = zmsg_popstr (msg); zstr_free (&cuuid);
-        sendmail (msg2email (&msg));
+    // render the email only once, recipients do not see each other,
+    // they are given in the envelope only
+    std::string data = compose (to.size () == 1 ? to [0] : "undisclosed-recipients:;", subject, body);
+
+    try {
+        if (_has_fn || _host.empty ())
+            sendmail (data);
+        else
+        if (_transport == Transport::NATIVE)
+            return _client->deliver (settings (), _from, to, data);
+        else
+            msmtp_sendmail (s_source (data), to);
+        for (const auto& it : to)
+            ret.push_back (SmtpRecipientStatus {it, SmtpError::Succeeded, "OK"});
     }
+    catch (const std::runtime_error &e) {
+        for (const auto& it : to)
+            ret.push_back (SmtpRecipientStatus {it, smtp_error_code (e), e.what ()});
+    }
+    return ret;
 }
 
 void Smtp::sendmail(
@@ -159,7 +205,9 @@ void Smtp::sendmail(
 {
     std::vector<std::string> recip;
     recip.push_back(to);
-    return sendmail(recip, subject, body);
+    std::vector <SmtpRecipientStatus> status = sendmail(recip, subject, body);
+    if (status [0].code != SmtpError::Succeeded)
+        throw SmtpException (status [0].code, status [0].message);
 }
 
 
@@ -173,24 +221,127 @@ void Smtp::sendmail(
         return;
     }
 
+    if (_transport == Transport::NATIVE) {
+        if (_host.empty ())
+            return;
+        std::string stripped;
+        std::vector <std::string> to = mime_recipients (data, stripped);
+        _client->sendmail (settings (), _from, to, stripped);
+        return;
+    }
+
+    msmtp_sendmail (s_source (data), {});
+}
+
+void Smtp::sendmail(
+        const MimeWriter& mime) const
+{
+    // for testing
+    if (_has_fn) {
+        _fn (mime.str ());
+        return;
+    }
+
+    if (_host.empty ())
+        return;
+
+    // Bcc header is not written, recipients are passed explicitly
+    if (_transport == Transport::NATIVE) {
+        // DATA is dot-stuffed and usually encrypted, it goes through userspace
+        SmtpSource source = [&mime] (const SmtpSink& sink) { mime.write (sink); };
+        _client->sendmail (settings (), _from, mime.recipients (), source);
+    }
+    else {
+        SmtpFileSource source = [&mime] (const SmtpSink& sink, const SmtpFileSink& files) {
+            mime.write (sink, files);
+        };
+        msmtp_sendmail (source, mime.recipients ());
+    }
+}
+
+void Smtp::msmtp_sendmail (
+        const SmtpSource& data,
+        const std::vector<std::string> &recipients) const
+{
+    SmtpFileSource source = [&data] (const SmtpSink& sink, const SmtpFileSink&) { data (sink); };
+    msmtp_sendmail (source, recipients);
+}
+
+void Smtp::msmtp_sendmail (
+        const SmtpFileSource& data,
+        const std::vector<std::string> &recipients) const
+{
     std::string cfg = createConfigFile();
     if (_host.empty()) {
+        deleteConfigFile (cfg);
         return;
     }
-    Argv argv = { _msmtp, "-t", "-C", cfg };
+    Argv argv = { _msmtp, "-C", cfg };
+    if (recipients.empty ())
+        argv.push_back ("-t");
+    else {
+        argv.push_back ("--");
+        argv.insert (argv.end (), recipients.begin (), recipients.end ());
+    }
     SubProcess proc{argv, SubProcess::STDIN_PIPE | SubProcess::STDOUT_PIPE | SubProcess::STDERR_PIPE};
 
     bool bret = proc.run();
     if (!bret) {
+        deleteConfigFile (cfg);
         throw std::runtime_error( \
                 _msmtp + " failed with exit code '" + \
                 std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
                 read_all(proc.getStderr()));
     }
 
-    ssize_t wr = ::write(proc.getStdin(), data.c_str(), data.size());
-    if (wr != static_cast<ssize_t>(data.size())) {
-        zsys_warning("Email truncated, exp '%zu', piped '%zd'", data.size(), wr);
+    // email is piped in pieces, e.g. attachments are encoded on the fly,
+    // files which need no encoding are spliced from the page cache
+    size_t piped = 0;
+    bool broken = false;
+    SmtpSink sink = [&proc, &piped, &broken] (const char *buf, size_t size) {
+        while (size > 0) {
+            ssize_t wr = ::write (proc.getStdin (), buf, size);
+            if (wr == -1 && errno == EINTR)
+                continue;
+            if (wr <= 0) {
+                broken = true;
+                throw std::runtime_error (std::string ("cannot pipe email to msmtp: ") + strerror (errno));
+            }
+            buf += wr;
+            size -= wr;
+            piped += wr;
+        }
+    };
+    SmtpFileSink files = [&proc, &piped, &broken] (int fd, uint64_t offset, uint64_t size) {
+        while (size > 0) {
+            ssize_t wr = mime_sendfile (proc.getStdin (), fd, offset, std::min <uint64_t> (size, 1 << 30));
+            if (wr == -1 && errno == EINTR)
+                continue;
+            if (wr == -1 && errno == EPIPE) {
+                broken = true;
+                throw std::runtime_error (std::string ("cannot pipe email to msmtp: ") + strerror (errno));
+            }
+            if (wr <= 0)
+                throw std::runtime_error (std::string ("cannot read attachment: ") + (wr == 0 ? "file is truncated" : strerror (errno)));
+            offset += wr;
+            size -= wr;
+            piped += wr;
+        }
+    };
+    try {
+        data (sink, files);
+    }
+    catch (const std::runtime_error &e) {
+        if (broken)
+            zsys_warning ("Email truncated, piped '%zu': %s", piped, e.what ());
+        else {
+            // incomplete email must not be sent
+            proc.kill (SIGKILL);
+            ::close (proc.getStdin ());
+            proc.wait ();
+            deleteConfigFile (cfg);
+            throw;
+        }
     }
     ::close(proc.getStdin()); //EOF
 
@@ -213,35 +364,200 @@ void Smtp::sendmail(
 
 }
 
-static bool
-s_is_text (const char* mime)
+std::string
+Smtp::compose (
+        const std::vector<std::string> &to,
+        const std::string& subject,
+        const std::string& body) const
+{
+    std::string rcpt;
+    for (const auto& it : to) {
+        if (!rcpt.empty ())
+            rcpt.append (", ");
+        rcpt.append (it);
+    }
+    return compose (rcpt, subject, body);
+}
+
+std::string
+Smtp::compose (
+        const std::string& to,
+        const std::string& subject,
+        const std::string& body) const
+{
+    zuuid_t *uuid = zuuid_new ();
+    zmsg_t *msg = fty_email_encode (
+        zuuid_str_canonical (uuid),
+        to.c_str (),
+        subject.c_str (),
+        NULL,
+        body.c_str (),
+        NULL
+    );
+    zuuid_destroy (&uuid);
+
+    // MVY: this is weird, horrible, ugly and hard to use.
+    //      Need to rething API for smtp_encode
+    //      BUT .. NEVER pass message with first uuid frame to msg2email
+    //      or BAD things will happen
+    char* cuuid = zmsg_popstr (msg); zstr_free (&cuuid);
+    return msg2email (&msg);
+}
+
+// Value of Date: header (RFC 5322) for now
+static std::string
+s_date ()
+{
+    //NOTE: setLocale(LC_DATE, "C") should be called in outer scope
+    time_t t = ::time(NULL);
+    struct tm* tmp = ::localtime(&t);
+    char buf[256];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z", tmp);
+    return buf;
+}
+
+std::string
+Smtp::compose_sms (
+        const std::string& to,
+        const std::string& text) const
 {
-    assert (mime);
-    return !strncmp (mime, "text", 4);
+    static const char HEADERS [] =
+        "MIME-Version: 1.0\r\n"
+        "Content-Type: text/plain; charset=UTF-8\r\n"
+        "Content-Transfer-Encoding: 8bit\r\n"
+        "\r\n";
+    // From and Date are required (RFC 5322), gateways drop email without them
+    std::string data;
+    data.reserve (6 + _from.size () + 40 + 4 + to.size () + 2 + sizeof (HEADERS) + text.size () + 2);
+    data.append ("From: ").append (_from).append ("\r\n");
+    data.append ("Date: ").append (s_date ()).append ("\r\n");
+    data.append ("To: ").append (to).append ("\r\n");
+    data.append (HEADERS);
+    data.append (text).append ("\r\n");
+    return data;
 }
 
 std::string
 Smtp::msg2email (zmsg_t **msg_p) const
+{
+    return msg2mime (msg_p).str ();
+}
+
+static std::string
+s_type (const std::string& what, const std::string& type)
+{
+    if (!type.empty ())
+        return type;
+    zsys_warning ("Can't guess type for %s, using application/octet-stream", what.c_str ());
+    return "application/octet-stream; charset=binary";
+}
+
+// Open descriptor fd of local process pid when SENDMAIL is accepted, the
+// process must run as the same user as the agent, so nothing it could not
+// read itself is sent, descriptor must be a regular file, e.g. memfd
+static int
+s_open_fd (unsigned long pid, unsigned long fd)
+{
+    std::string what = "descriptor " + std::to_string (fd) + " of process " + std::to_string (pid);
+    // process is pinned by its directory, reused pid is not followed
+    int proc = ::open (("/proc/" + std::to_string (pid)).c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc == -1)
+        throw std::runtime_error ("Cannot open " + what + ": " + strerror (errno));
+    struct stat st;
+    if (fstat (proc, &st) != 0 || st.st_uid != geteuid ()) {
+        ::close (proc);
+        throw std::runtime_error ("Cannot open " + what + ": process runs as another user");
+    }
+    int ret = openat (proc, ("fd/" + std::to_string (fd)).c_str (), O_RDONLY | O_CLOEXEC);
+    int err = errno;
+    ::close (proc);
+    if (ret == -1)
+        throw std::runtime_error ("Cannot open " + what + ": " + strerror (err));
+    if (fstat (ret, &st) != 0 || !S_ISREG (st.st_mode)) {
+        ::close (ret);
+        throw std::runtime_error ("Cannot open " + what + ": not a regular file");
+    }
+    return ret;
+}
+
+// Add attachment given by frame of SENDMAIL, inline content is popped from msg
+static void
+s_attach (MimeWriter& mime, MimeTypes& types, const char *frame, zmsg_t *msg)
+{
+    static const size_t INLINE = strlen (FTY_EMAIL_ATTACH_INLINE);
+    static const size_t FD = strlen (FTY_EMAIL_ATTACH_FD);
+
+    if (strncmp (frame, FTY_EMAIL_ATTACH_INLINE, INLINE) == 0) {
+        std::string name = frame + INLINE;
+        zframe_t *content = zmsg_pop (msg);
+        if (!content)
+            throw std::runtime_error ("Content of attachment " + name + " is missing");
+        std::shared_ptr <const std::string> data = std::make_shared <const std::string> (
+            reinterpret_cast <const char *> (zframe_data (content)), zframe_size (content));
+        zframe_destroy (&content);
+        std::string type = types.type (name, data->data (), data->size ());
+        mime.attachData (name, s_type (name, type), data);
+        return;
+    }
+
+    if (strncmp (frame, FTY_EMAIL_ATTACH_FD, FD) == 0) {
+        // fd:$pid:$fd:$name
+        char *end;
+        unsigned long pid = strtoul (frame + FD, &end, 10);
+        unsigned long fd = 0;
+        bool valid = end != frame + FD && *end == ':';
+        if (valid) {
+            const char *begin = end + 1;
+            fd = strtoul (begin, &end, 10);
+            valid = end != begin && *end == ':' && end [1] != '\0';
+        }
+        if (!valid)
+            throw std::runtime_error (std::string ("Invalid attachment ") + frame);
+        std::string name = end + 1;
+        int opened = s_open_fd (pid, fd);
+        const char *known = MimeTypes::byExtension (name);
+        std::string type;
+        if (known)
+            type = known;
+        else {
+            char head [4096];
+            ssize_t size = pread (opened, head, sizeof (head), 0);
+            type = types.type (name, head, size > 0 ? size : 0);
+        }
+        mime.attachFd (opened, name, s_type (name, type));
+        return;
+    }
+
+    // POSIX basename can modify its argument
+    char *name = strdup (frame);
+    mime.attach (frame, basename (name), s_type (frame, types.type (frame)));
+    free (name);
+}
+
+MimeWriter
+Smtp::msg2mime (zmsg_t **msg_p) const
 {
     assert (msg_p && *msg_p);
     zmsg_t *msg = *msg_p;
 
-    std::stringstream buff;
-    cxxtools::MimeMultipart mime;
+    MimeWriter mime;
 
     char *to = zmsg_popstr (msg);
     char *subject = zmsg_popstr (msg);
     char *body = zmsg_popstr (msg);
 
-    mime.setHeader ("To", to);
-    mime.setHeader ("Subject", subject);
-    mime.addObject (body);
+    // new protocol have more frames
+    if (zmsg_size (msg) != 0) {
+        mime.header ("Date", s_date ());
+    }
+    mime.header ("To", to);
+    mime.header ("Subject", subject);
+    mime.body (body);
 
     zstr_free (&to);
     zstr_free (&subject);
     zstr_free (&body);
 
-    // new protocol have more frames
     if (zmsg_size (msg) != 0) {
         zframe_t *frame = zmsg_pop (msg);
         zhash_t *headers = zhash_unpack (frame);
@@ -253,43 +569,29 @@ Smtp::msg2email (zmsg_t **msg_p) const
                    value = (char*) zhash_next (headers))
         {
             const char* key = zhash_cursor (headers);
-            mime.setHeader (key, value);
+            mime.header (key, value);
         }
         zhash_destroy (&headers);
 
-
-        //NOTE: setLocale(LC_DATE, "C") should be called in outer scope
-        time_t t = ::time(NULL);
-        struct tm* tmp = ::localtime(&t);
-        char buf[256];
-        strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z\n", tmp);
-        mime.setHeader ("Date", buf);
-
         while (zmsg_size (msg) != 0)
         {
-            char* path = zmsg_popstr (msg);
-            const char* mime_type = magic_file (_magic, path);
-            if (!mime_type) {
-                zsys_warning ("Can't guess type for %s, using application/octet-stream", path);
-                mime_type = "application/octet-stream; charset=binary";
+            char* frame = zmsg_popstr (msg);
+            try {
+                s_attach (mime, *_types, frame, msg);
             }
-
-            std::ifstream ipath {path};
-
-            if (s_is_text (mime_type))
-                mime.attachTextFile (ipath, basename (path), mime_type);
-            else
-                mime.attachBinaryFile (ipath, basename (path), mime_type);
-
-            ipath.close ();
-            zstr_free (&path);
+            catch (...) {
+                zstr_free (&frame);
+                zmsg_destroy (&msg);
+                *msg_p = NULL;
+                throw;
+            }
+            zstr_free (&frame);
         }
     }
     zmsg_destroy (&msg);
     *msg_p = NULL;
 
-    buff << mime;
-    return buff.str ();
+    return mime;
 }
 
 std::string
@@ -354,6 +656,16 @@ SmtpError
 }
 
 
+SmtpError
+    smtp_error_code (
+        const std::runtime_error &e)
+{
+    const SmtpException *se = dynamic_cast <const SmtpException *> (&e);
+    if (se)
+        return se->code ();
+    return msmtp_stderr2code (e.what ());
+}
+
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
@@ -411,6 +723,78 @@ email_test (bool verbose)
     // test case 3 DNSFailed
     assert (msmtp_stderr2code ("msmtp: cannot locate host NOTmail.etn.com: Name or service not known\nmsmtp: could not send mail (account default from config)") == SmtpError::DNSFailed);
 
+    // test of smtp_error_code
+    assert (smtp_error_code (SmtpException (SmtpError::AuthFailed, "535 5.7.8 Error")) == SmtpError::AuthFailed);
+    assert (smtp_error_code (std::runtime_error ("msmtp: cannot connect to mail.example.com, port 25")) == SmtpError::ServerUnreachable);
+
+    // test of sms, no Subject: and one text/plain part
+    {
+        Smtp smtp;
+        smtp.from ("alerts@example.com");
+        std::string data = smtp.compose_sms ("023456@hyper.mobile", "CRITICAL P1 ups: on battery");
+        assert (data.compare (0, 32, "From: alerts@example.com\r\nDate: ") == 0);
+        size_t date = data.find ("\r\n", 32);
+        assert (date != std::string::npos);
+        data.erase (0, date + 2);
+        assert (data ==
+            "To: 023456@hyper.mobile\r\n"
+            "MIME-Version: 1.0\r\n"
+            "Content-Type: text/plain; charset=UTF-8\r\n"
+            "Content-Transfer-Encoding: 8bit\r\n"
+            "\r\n"
+            "CRITICAL P1 ups: on battery\r\n");
+        std::string stripped;
+        std::vector <std::string> rcpts = mime_recipients (data, stripped);
+        assert (rcpts.size () == 1);
+        assert (rcpts [0] == "023456@hyper.mobile");
+    }
+
+    // test of encryption
+    {
+        Smtp smtp;
+        smtp.encryption ("StartTLS");
+        assert (smtp.settings ().encryption == Enctryption::STARTTLS);
+        smtp.encryption ("tls");
+        assert (smtp.settings ().encryption == Enctryption::TLS);
+        smtp.encryption ("none");
+        assert (smtp.settings ().encryption == Enctryption::NONE);
+    }
+
+    // test of recipient coalescing, email is rendered and sent once
+    {
+        Smtp smtp;
+        std::vector <std::string> sent;
+        smtp.sendmail_set_test_fn (
+            [&sent] (const std::string &data) {
+                if (data.find ("fail") != std::string::npos)
+                    throw std::runtime_error ("msmtp: cannot connect to mail.example.com, port 25");
+                sent.push_back (data);
+            });
+        std::vector <std::string> to {"joe@example.com", "jane@example.com"};
+        std::vector <SmtpRecipientStatus> status = smtp.sendmail (to, "subject", "body");
+        assert (sent.size () == 1);
+        assert (sent [0].find ("To: undisclosed-recipients:;") != std::string::npos);
+        assert (sent [0].find ("joe@example.com") == std::string::npos);
+        assert (sent [0].find ("jane@example.com") == std::string::npos);
+        assert (status.size () == 2);
+        assert (status [0].address == "joe@example.com");
+        assert (status [0].code == SmtpError::Succeeded);
+        assert (status [1].address == "jane@example.com");
+        assert (status [1].code == SmtpError::Succeeded);
+
+        status = smtp.sendmail (to, "fail", "body");
+        assert (status.size () == 2);
+        assert (status [1].code == SmtpError::ServerUnreachable);
+
+        try {
+            smtp.sendmail ("joe@example.com", "fail", "body");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (smtp_error_code (e) == SmtpError::ServerUnreachable);
+        }
+    }
+
     zhash_t *headers = zhash_new ();
     zhash_update (headers, "Foo", (void*) "bar");
     zmsg_t *email_msg = fty_email_encode (
@@ -438,6 +822,86 @@ email_test (bool verbose)
     char* uuid = zmsg_popstr (email_msg); zstr_free (&uuid);
     std::string email = smtp.msg2email (&email_msg);
     zsys_debug ("E M A I L:=\n%s\n", email.c_str ());
+    assert (email.find ("Foo: bar\r\n") != std::string::npos);
+    assert (email.find ("filename=\"file1\"") != std::string::npos);
+
+    // attachments are read once the email is sent
+    headers = zhash_new ();
+    email_msg = fty_email_encode (
+            "uuid",
+            "to",
+            "subject",
+            headers,
+            "body",
+            (str_SELFTEST_DIR_RW + "/file2.txt").c_str(),
+            NULL);
+    zhash_destroy (&headers);
+    uuid = zmsg_popstr (email_msg); zstr_free (&uuid);
+    MimeWriter mime = smtp.msg2mime (&email_msg);
+    assert (!email_msg);
+    assert (mime.attachments () == 1);
+    assert (mime.header ("To") == "to");
+    std::string streamed;
+    smtp.sendmail_set_test_fn ([&streamed] (const std::string &data) { streamed = data; });
+    smtp.sendmail (mime);
+    assert (streamed.find ("filename=\"file2.txt\"") != std::string::npos);
+    assert (streamed.find ("Content-Transfer-Encoding: quoted-printable") != std::string::npos);
+
+    // attachments in the message and passed as descriptor
+    {
+        int fd = open ((str_SELFTEST_DIR_RW + "/file2.txt").c_str (), O_RDONLY);
+        assert (fd != -1);
+        fty_email_attachment_t attachments [] = {
+            {"report.csv", "a,b\n1,2\n", 8, -1},
+            {"descriptor.txt", NULL, 0, fd},
+            {(str_SELFTEST_DIR_RW + "/file1").c_str (), NULL, 0, -1}
+        };
+        email_msg = fty_email_encode_attachments ("uuid", "to", "subject", NULL, "body", attachments, 3);
+        assert (zmsg_size (email_msg) == 9);
+        uuid = zmsg_popstr (email_msg); zstr_free (&uuid);
+        mime = smtp.msg2mime (&email_msg);
+        assert (mime.attachments () == 3);
+        // descriptor is opened when the request is accepted
+        ::close (fd);
+        smtp.sendmail (mime);
+        assert (streamed.find (
+            "Content-Type: text/csv; charset=utf-8\r\n"
+            "Content-Transfer-Encoding: quoted-printable\r\n"
+            "Content-Disposition: attachment; filename=\"report.csv\"\r\n"
+            "\r\n"
+            "a,b\r\n"
+            "1,2\r\n") != std::string::npos);
+        assert (streamed.find ("filename=\"descriptor.txt\"\r\n\r\n" + str_SELFTEST_DIR_RW + "/file2.txt") != std::string::npos);
+        assert (streamed.find ("filename=\"file1\"") != std::string::npos);
+
+        // descriptor which is not open or not a regular file is refused
+        int dir = open (str_SELFTEST_DIR_RW.c_str (), O_RDONLY | O_DIRECTORY);
+        assert (dir != -1);
+        for (int bad : {fd, dir}) {
+            fty_email_attachment_t descriptor [] = {{"descriptor.txt", NULL, 0, bad}};
+            email_msg = fty_email_encode_attachments ("uuid", "to", "subject", NULL, "body", descriptor, 1);
+            uuid = zmsg_popstr (email_msg); zstr_free (&uuid);
+            try {
+                smtp.msg2mime (&email_msg);
+                assert (false);
+            }
+            catch (const std::runtime_error &e) {
+                assert (!email_msg);
+            }
+        }
+        ::close (dir);
+
+        // content frame is missing
+        email_msg = fty_email_encode ("uuid", "to", "subject", NULL, "body", FTY_EMAIL_ATTACH_INLINE "report.csv", NULL);
+        uuid = zmsg_popstr (email_msg); zstr_free (&uuid);
+        try {
+            smtp.msg2mime (&email_msg);
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (!email_msg);
+        }
+    }
 
     //  @end
     printf ("OK\n");
@@ -42,12 +42,21 @@ Example:
 #define EMAIL_H_INCLUDED
 
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <stdexcept>
 
 #include "subprocess.h"
 
+class SmtpClient;
+class MimeWriter;
+class MimeTypes;
+struct SmtpSettings;
+struct SmtpPoolStats;
+
 /**
  * \class security
  *
@@ -89,6 +98,65 @@ enum class SmtpError {
     Unknown = 10
 };
 
+/**
+ * \class SmtpException
+ *
+ * Error of native SMTP transport with SmtpError code attached
+ */
+class SmtpException : public std::runtime_error
+{
+    public:
+        SmtpException (SmtpError code, const std::string& what) :
+            std::runtime_error (what),
+            _code (code)
+        {}
+
+        SmtpError code () const { return _code; }
+
+    protected:
+        SmtpError _code;
+};
+
+/**
+ * \class SmtpRecipientStatus
+ *
+ * Outcome of delivery to one recipient
+ */
+struct SmtpRecipientStatus {
+    std::string address;
+    SmtpError code;
+    std::string message;
+};
+
+/**
+ * \class SmtpSource
+ *
+ * Email DATA written to the sink in pieces, so it does not need to be
+ * in memory at once. It must give the same data each time it is called.
+ */
+typedef std::function <void (const char *data, size_t size)> SmtpSink;
+typedef std::function <void (const SmtpSink& sink)> SmtpSource;
+
+/**
+ * \class SmtpFileSource
+ *
+ * SmtpSource which passes parts of files that need no encoding to files
+ * sink, the transport copies them without userspace buffers if it can.
+ * See MimeWriter::FileSink.
+ */
+typedef std::function <void (int fd, uint64_t offset, uint64_t size)> SmtpFileSink;
+typedef std::function <void (const SmtpSink& sink, const SmtpFileSink& files)> SmtpFileSource;
+
+/**
+ * \class Transport
+ *
+ * How emails are sent
+ */
+enum class Transport {
+    MSMTP,
+    NATIVE
+};
+
 /**
  * \class Smtp
  *
@@ -96,8 +164,14 @@ enum class SmtpError {
  *
  * This class contain some basic configuration for
  * msmtp (host/from) + provide sendmail methods.
+ * Alternatively emails can be sent by built-in SmtpClient,
+ * see transport ().
  * It *DOES NOT* perform any additional transofmation
  * like uuencode or mime. IOW garbage-in, garbage-out.
+ *
+ * Instances are cheap to copy, copies share the cache of attachment
+ * types (see MimeTypes) and the connection of native transport. This is
+ * how configuration is handed over to DeliveryPool workers.
  */
 class Smtp
 {
@@ -132,6 +206,29 @@ class Smtp
         /** \brief turn on or of the CA verification */
         void verify_ca (bool verify) { _verify_ca = verify; }
 
+        /** \brief set the transport (MSMTP|NATIVE), default is msmtp */
+        void transport (const std::string& transport);
+        void transport (Transport transport) { _transport = transport; };
+
+        /** \brief settings of native SMTP transport */
+        SmtpSettings settings () const;
+
+        /**
+         * \brief set number of idle connections kept by native transport
+         *
+         * Pool is shared by all copies of this instance.
+         */
+        void pool_size (size_t size);
+
+        /** \brief set how long [s] the idle connection is kept open */
+        void keepalive (uint32_t keepalive);
+
+        /** \brief close connections idle longer than keepalive */
+        void expire () const;
+
+        /** \brief counters of connection pool of native transport */
+        SmtpPoolStats pool_stats () const;
+
         /**
          * \brief set alternative path for msmtp
          *
@@ -152,16 +249,22 @@ class Smtp
         }
 
         /**
-         * \brief send the email
+         * \brief send one email to many recipients
          *
-         * Technically this put email to msmtp's outgoing queue
-         * \param to        email header To: multiple recipient in vector
+         * Email is rendered only once, recipients are not listed in it
+         * (To: undisclosed-recipients:;) if there are more of them.
+         * Native transport delivers it in one transaction with RCPT TO
+         * for each recipient, rejected recipient does not prevent
+         * delivery to the others. msmtp is called once for all of them,
+         * its failure is the status of each recipient.
+         *
+         * \param to        envelope recipients
          * \param subject   email header Subject:
          * \param body      email body
          *
-         * \throws std::runtime_error for msmtp invocation errors
+         * \return status of each recipient, in order of to
          */
-        void sendmail(
+        std::vector <SmtpRecipientStatus> sendmail(
                 const std::vector<std::string> &to,
                 const std::string& subject,
                 const std::string& body) const;
@@ -174,7 +277,8 @@ class Smtp
          * \param subject   email header Subject:
          * \param body      email body
          *
-         * \throws std::runtime_error for msmtp invocation errors
+         * \throws std::runtime_error for msmtp invocation errors,
+         *         SmtpException for native transport errors
          */
         void sendmail(
                 const std::string& to,
@@ -189,11 +293,60 @@ class Smtp
          *              from the fields in body, so body must be properly
          *              formatted email message).
          *
-         * \throws std::runtime_error for msmtp invocation errors
+         * \throws std::runtime_error for msmtp invocation errors,
+         *         SmtpException for native transport errors
          */
         void sendmail(
                 const std::string& data) const;
 
+        /**
+         * \brief send the email written by MimeWriter
+         *
+         * Attachments are read and encoded while the email is passed
+         * to msmtp or to SMTP server. Envelope recipients are taken
+         * from To/Cc/Bcc headers.
+         *
+         * \throws std::runtime_error for msmtp invocation errors or if
+         *         attachment cannot be read, SmtpException for native
+         *         transport errors
+         */
+        void sendmail(
+                const MimeWriter& mime) const;
+
+        /**
+         * \brief compose the email
+         *
+         * \param to        email header To:
+         * \param subject   email header Subject:
+         * \param body      email body
+         *
+         * \return email DATA suitable for sendmail (const std::string& data)
+         */
+        std::string compose (
+                const std::string& to,
+                const std::string& subject,
+                const std::string& body) const;
+        std::string compose (
+                const std::vector<std::string> &to,
+                const std::string& subject,
+                const std::string& body) const;
+
+        /**
+         * \brief compose the short message for email to sms gateway
+         *
+         * Plain text with minimal set of headers and no Subject:, so
+         * gateway does not prepend it to the text. Text should be one
+         * line, see EmailTemplates::sms ().
+         *
+         * \param to        email header To:
+         * \param text      text of sms
+         *
+         * \return email DATA suitable for sendmail (const std::string& data)
+         */
+        std::string compose_sms (
+                const std::string& to,
+                const std::string& text) const;
+
         /**
          * \brief convert zmq message to email string
          *
@@ -204,8 +357,31 @@ class Smtp
         std::string
             msg2email (zmsg_t **msg_p) const;
 
+        /**
+         * \brief convert zmq message to MimeWriter
+         *
+         * Same as msg2email, but attachments are not read until the email
+         * is written, see sendmail (const MimeWriter&).
+         */
+        MimeWriter
+            msg2mime (zmsg_t **msg_p) const;
+
     protected:
 
+        /**
+         * \brief run msmtp
+         *
+         * \param recipients    envelope recipients, if empty, they're read
+         *                      from the email headers (-t)
+         */
+        void msmtp_sendmail (
+                const SmtpSource& data,
+                const std::vector<std::string> &recipients) const;
+        // file parts are spliced into the stdin pipe of msmtp
+        void msmtp_sendmail (
+                const SmtpFileSource& data,
+                const std::vector<std::string> &recipients) const;
+
         /**
          * \brief create msmtp config file
          */
@@ -224,8 +400,10 @@ class Smtp
         std::string _msmtp;
         bool _has_fn;
         bool _verify_ca;
+        Transport _transport;
+        std::shared_ptr <SmtpClient> _client;
         std::function <void(const std::string&)> _fn;
-        magic_t _magic;
+        std::shared_ptr <MimeTypes> _types;
 };
 
 /**
@@ -265,6 +443,13 @@ SmtpError
     msmtp_stderr2code (
         const std::string &inp);
 
+/**
+ * Get error code of exception thrown by Smtp::sendmail
+ */
+SmtpError
+    smtp_error_code (
+        const std::runtime_error &e);
+
 void email_test (bool verbose);
 
 #endif
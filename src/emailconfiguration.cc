@@ -28,7 +28,15 @@
 
 #include "fty_email_classes.h"
 
-#define BODY_ACTIVE \
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define BODY_ACTIVE_TEXT \
 "In the system an alert was detected.\n\
 Source rule: ${rulename}\n\
 Asset: ${assetname}\n\
@@ -37,103 +45,383 @@ Alert severity: ${severity}\n\
 Alert description: ${description}\n\
 Alert state: ${state}"
 
-#define SUBJECT_ACTIVE \
+#define SUBJECT_ACTIVE_TEXT \
 "${severity} alert on ${assetname}\n\
 from the rule ${rulename} is active!"
 
-#define BODY_RESOLVED \
+#define BODY_RESOLVED_TEXT \
 "In the system an alert was resolved.\n\
 Source rule: ${rulename}\n\
 Asset: ${assetname}\n\
 Alert description: ${description}"
 
-#define SUBJECT_RESOLVED \
+#define SUBJECT_RESOLVED_TEXT \
 "Alert on ${assetname} \n\
 from the rule ${rulename} was resolved"
 
+#define SMS_ACTIVE_TEXT \
+"${severity} P${priority} ${assetname}: ${description} (${rulename}, ${state})"
+
+#define SMS_RESOLVED_TEXT \
+"RESOLVED ${assetname}: ${description} (${rulename})"
+
 
 // ----------------------------------------------------------------------------
 // static helper functions
 
-static std::string
-replace_tokens (
-        const std::string& text,
-        const std::string& pattern,
-        const std::string& replacement)
+// placeholders, index is the field of the segment
+static const char *FIELDS [] = {
+    "rulename",
+    "assetname",
+    "description",
+    "priority",
+    "severity",
+    "state"
+};
+static const int FIELDS_COUNT = sizeof (FIELDS) / sizeof (FIELDS [0]);
+
+static int
+s_field (const std::string& text, size_t pos, size_t size)
+{
+    for (int i = 0; i != FIELDS_COUNT; i++) {
+        if (text.compare (pos, size, FIELDS [i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// ----------------------------------------------------------------------------
+// EmailTemplate
+
+void
+EmailTemplate::compile (const std::string& text)
 {
-    std::string result = text;
+    _text = text;
+    _segments.clear ();
+    _literal_size = 0;
+
+    size_t literal = 0;
     size_t pos = 0;
-    while( ( pos = result.find(pattern, pos) ) != std::string::npos){
-        result.replace(pos, pattern.length(), replacement);
-        pos += replacement.length();
+    while ((pos = _text.find ("${", pos)) != std::string::npos) {
+        size_t end = _text.find ('}', pos + 2);
+        if (end == std::string::npos)
+            break;
+        int field = s_field (_text, pos + 2, end - pos - 2);
+        if (field < 0) {
+            // unknown placeholder stays in the text
+            pos += 2;
+            continue;
+        }
+        if (pos > literal) {
+            _segments.push_back (Segment {(uint32_t) literal, (uint32_t) (pos - literal), -1});
+            _literal_size += pos - literal;
+        }
+        _segments.push_back (Segment {0, 0, field});
+        literal = pos = end + 1;
+    }
+    if (_text.size () > literal) {
+        _segments.push_back (Segment {(uint32_t) literal, (uint32_t) (_text.size () - literal), -1});
+        _literal_size += _text.size () - literal;
     }
-    return result;
 }
 
-static std::string
-s_generateEmailBodyResolved (const Alert& alert, const Element& asset)
+int
+EmailTemplate::load (const std::string& path)
 {
-    std::string result (BODY_RESOLVED);
-    result = replace_tokens (result, "${rulename}", alert.rule);
-    result = replace_tokens (result, "${assetname}", asset.name);
-    result = replace_tokens (result, "${description}", alert.description);
-    return result;
+    std::ifstream ifs (path, std::ios::in | std::ios::binary);
+    if (!ifs)
+        return -1;
+    std::stringstream text;
+    text << ifs.rdbuf ();
+    if (ifs.bad ())
+        return -1;
+    compile (text.str ());
+    return 0;
 }
 
-static std::string
-s_generateEmailBodyActive (const Alert& alert, const Element& asset)
-{
-    std::string result = BODY_ACTIVE;
-    result = replace_tokens (result, "${rulename}", alert.rule);
-    result = replace_tokens (result, "${assetname}", asset.name);
-    result = replace_tokens (result, "${description}", alert.description);
-    result = replace_tokens (result, "${priority}", std::to_string (asset.priority));
-    result = replace_tokens (result, "${severity}", alert.severity);
-    result = replace_tokens (result, "${state}", alert.state);
-    return result;
+void
+EmailTemplate::render (const Alert& alert, const Element& asset, std::string& out) const
+{
+    char priority [4];
+    snprintf (priority, sizeof (priority), "%u", (unsigned) asset.priority);
+    const char *severity = alert_severity_str (alert.severity);
+    const char *state = alert_state_str (alert.state);
+
+    // same order as FIELDS
+    const char *values [FIELDS_COUNT] = {
+        alert.rule.c_str (),
+        asset.name.c_str (),
+        alert.description.c_str (),
+        priority,
+        severity,
+        state
+    };
+    size_t sizes [FIELDS_COUNT] = {
+        alert.rule.str ().size (),
+        asset.name.size (),
+        alert.description.size (),
+        strlen (priority),
+        strlen (severity),
+        strlen (state)
+    };
+
+    size_t size = _literal_size;
+    for (const auto& segment : _segments) {
+        if (segment.field >= 0)
+            size += sizes [segment.field];
+    }
+    out.reserve (out.size () + size);
+    for (const auto& segment : _segments) {
+        if (segment.field < 0)
+            out.append (_text, segment.offset, segment.size);
+        else
+            out.append (values [segment.field], sizes [segment.field]);
+    }
 }
 
-static std::string
-s_generateEmailSubjectResolved (const Alert& alert, const Element& asset)
+std::string
+EmailTemplate::render (const Alert& alert, const Element& asset) const
 {
-    std::string result = SUBJECT_RESOLVED;
-    result = replace_tokens (result, "${rulename}", alert.rule);
-    result = replace_tokens (result, "${assetname}", asset.name);
+    std::string result;
+    render (alert, asset, result);
     return result;
 }
 
+// ----------------------------------------------------------------------------
+// EmailTemplates
+
 static std::string
-s_generateEmailSubjectActive (const Alert& alert, const Element& asset)
-{
-    std::string result = SUBJECT_ACTIVE;
-    result = replace_tokens (result, "${rulename}", alert.rule);
-    result = replace_tokens (result, "${assetname}", asset.name);
-    result = replace_tokens (result, "${description}", alert.description);
-    result = replace_tokens (result, "${priority}", std::to_string(asset.priority));
-    result = replace_tokens (result, "${severity}", alert.severity);
-    result = replace_tokens (result, "${state}", alert.state);
+s_lower (const char *s)
+{
+    std::string result (s);
+    for (auto& c : result)
+        c = tolower (c);
     return result;
 }
 
+EmailTemplates::EmailTemplates ()
+{
+    reset ();
+}
+
+std::shared_ptr <const EmailTemplate>
+EmailTemplates::compile (const std::string& path, const EmailTemplates *previous)
+{
+    struct stat st;
+    if (stat (path.c_str (), &st) != 0 || !S_ISREG (st.st_mode))
+        return NULL;
+    File file;
+    file.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    file.size = st.st_size;
+
+    if (previous) {
+        auto search = previous->_files.find (path);
+        if (search != previous->_files.cend ()
+        &&  search->second.mtime == file.mtime
+        &&  search->second.size == file.size) {
+            _files [path] = search->second;
+            return search->second.compiled;
+        }
+    }
+
+    std::shared_ptr <EmailTemplate> compiled = std::make_shared <EmailTemplate> ();
+    if (compiled->load (path) != 0)
+        return NULL;
+    file.compiled = compiled;
+    _files [path] = file;
+    return compiled;
+}
+
+int
+EmailTemplates::load (Kind kind, const std::string& path, const EmailTemplates *previous)
+{
+    std::shared_ptr <const EmailTemplate> compiled = compile (path, previous);
+    if (!compiled)
+        return -1;
+    _templates [kind] = compiled;
+    return 0;
+}
+
+int
+EmailTemplates::loadDirectory (const std::string& path, const EmailTemplates *previous)
+{
+    DIR *dir = opendir (path.c_str ());
+    if (!dir)
+        return -1;
+    _named.clear ();
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL) {
+        std::string name = s_lower (entry->d_name);
+        if (name.compare (0, 6, "email.") != 0 && name.compare (0, 4, "sms.") != 0)
+            continue;
+        std::shared_ptr <const EmailTemplate> compiled = compile (path + "/" + entry->d_name, previous);
+        if (!compiled) {
+            zsys_warning ("Cannot read template '%s/%s'", path.c_str (), entry->d_name);
+            continue;
+        }
+        _named [name] = compiled;
+    }
+    closedir (dir);
+    return _named.size ();
+}
+
+void
+EmailTemplates::reset ()
+{
+    _templates [SUBJECT_ACTIVE] = std::make_shared <EmailTemplate> (SUBJECT_ACTIVE_TEXT);
+    _templates [BODY_ACTIVE] = std::make_shared <EmailTemplate> (BODY_ACTIVE_TEXT);
+    _templates [SUBJECT_RESOLVED] = std::make_shared <EmailTemplate> (SUBJECT_RESOLVED_TEXT);
+    _templates [BODY_RESOLVED] = std::make_shared <EmailTemplate> (BODY_RESOLVED_TEXT);
+    _templates [SMS_ACTIVE] = std::make_shared <EmailTemplate> (SMS_ACTIVE_TEXT);
+    _templates [SMS_RESOLVED] = std::make_shared <EmailTemplate> (SMS_RESOLVED_TEXT);
+    _named.clear ();
+    _files.clear ();
+}
+
+const EmailTemplate&
+EmailTemplates::select (const std::string& name, const Alert& alert) const
+{
+    if (!_named.empty ()) {
+        std::string state = s_lower (alert_state_str (alert.state));
+        std::string severity = s_lower (alert_severity_str (alert.severity));
+        const std::string candidates [] = {
+            name + "." + state + "." + severity,
+            name + "." + state,
+            name + "." + severity,
+            name
+        };
+        for (const auto& candidate : candidates) {
+            auto search = _named.find (candidate);
+            if (search != _named.cend ())
+                return *search->second;
+        }
+    }
+    bool resolved = alert.state == AlertState::RESOLVED;
+    if (name == "sms.body")
+        return *_templates [resolved ? SMS_RESOLVED : SMS_ACTIVE];
+    if (name == "email.body")
+        return *_templates [resolved ? BODY_RESOLVED : BODY_ACTIVE];
+    return *_templates [resolved ? SUBJECT_RESOLVED : SUBJECT_ACTIVE];
+}
+
+std::string
+EmailTemplates::subject (const Alert& alert, const Element& asset) const
+{
+    return select ("email.subject", alert).render (alert, asset);
+}
+
+std::string
+EmailTemplates::body (const Alert& alert, const Element& asset) const
+{
+    return select ("email.body", alert).render (alert, asset);
+}
+
+std::string
+EmailTemplates::sms (const Alert& alert, const Element& asset, size_t max_size) const
+{
+    std::string text;
+    select ("sms.body", alert).render (alert, asset, text);
+
+    // collapse whitespace in place
+    size_t size = 0;
+    bool space = true;
+    for (char c : text) {
+        if (isspace ((unsigned char) c)) {
+            if (!space)
+                text [size++] = ' ';
+            space = true;
+        }
+        else {
+            text [size++] = c;
+            space = false;
+        }
+    }
+    if (size > 0 && text [size - 1] == ' ')
+        size--;
+    text.resize (size);
+
+    if (text.size () <= max_size)
+        return text;
+    static const char ELLIPSIS [] = "...";
+    static const size_t ELLIPSIS_SIZE = sizeof (ELLIPSIS) - 1;
+    if (max_size < ELLIPSIS_SIZE) {
+        text.clear ();
+        return text;
+    }
+    size = max_size - ELLIPSIS_SIZE;
+    // do not split UTF-8 sequence, continuation bytes are 10xxxxxx
+    while (size > 0 && (text [size] & 0xC0) == 0x80)
+        size--;
+    while (size > 0 && text [size - 1] == ' ')
+        size--;
+    text.resize (size);
+    text.append (ELLIPSIS);
+    return text;
+}
+
+// ----------------------------------------------------------------------------
+// EmailTemplatesLoader
+
+EmailTemplatesLoader::EmailTemplatesLoader () :
+    _current (std::make_shared <EmailTemplates> ())
+{
+}
+
+EmailTemplatesLoader::~EmailTemplatesLoader ()
+{
+    wait ();
+}
+
+void
+EmailTemplatesLoader::load (const EmailTemplatesConfig& config)
+{
+    wait ();
+    _thread = std::thread (&EmailTemplatesLoader::run, this, config);
+}
+
+void
+EmailTemplatesLoader::wait ()
+{
+    if (_thread.joinable ())
+        _thread.join ();
+}
+
+void
+EmailTemplatesLoader::run (EmailTemplatesConfig config)
+{
+    std::shared_ptr <const EmailTemplates> previous = get ();
+    std::shared_ptr <EmailTemplates> templates = std::make_shared <EmailTemplates> ();
+    for (int kind = 0; kind != EmailTemplates::KINDS; kind++) {
+        const std::string& path = config.files [kind];
+        if (!path.empty () && templates->load ((EmailTemplates::Kind) kind, path, previous.get ()) != 0)
+            zsys_error ("Cannot read template '%s', using the built-in one", path.c_str ());
+    }
+    if (!config.directory.empty ()
+    &&  templates->loadDirectory (config.directory, previous.get ()) < 0)
+        zsys_error ("Cannot read templates directory '%s'", config.directory.c_str ());
+    std::atomic_store (&_current, std::shared_ptr <const EmailTemplates> (templates));
+}
+
 // ----------------------------------------------------------------------------
 // header functions
 
+static const EmailTemplates&
+s_builtin ()
+{
+    static const EmailTemplates templates;
+    return templates;
+}
+
 std::string
 generate_body (const Alert& alert, const Element& asset)
 {
-    if (alert.state == "RESOLVED") {
-        return s_generateEmailBodyResolved (alert, asset);
-    }
-    return s_generateEmailBodyActive (alert, asset);
+    return s_builtin ().body (alert, asset);
 }
 
 std::string
 generate_subject (const Alert& alert, const Element& asset)
 {
-    if (alert.state == "RESOLVED") {
-        return s_generateEmailSubjectResolved (alert, asset);
-    }
-    return s_generateEmailSubjectActive (alert, asset);
+    return s_builtin ().subject (alert, asset);
 }
 
 //  --------------------------------------------------------------------------
@@ -143,10 +431,134 @@ void
 emailconfiguration_test (bool verbose)
 {
     printf (" * emailconfiguration: ");
-    // TODO
-    //  * replace_tokens
-    //  * generate_subject
-    //  * generate_body
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+
+    Alert alert;
+    alert.rule = "rule";
+    alert.element = "ups";
+    alert.state = AlertState::ACTIVE;
+    alert.severity = AlertSeverity::CRITICAL;
+    alert.description = "on battery";
+    Element asset;
+    asset.name = "ups";
+    asset.priority = 2;
+
+    assert (generate_subject (alert, asset) == "CRITICAL alert on ups\nfrom the rule rule is active!");
+    assert (generate_body (alert, asset) ==
+        "In the system an alert was detected.\n"
+        "Source rule: rule\n"
+        "Asset: ups\n"
+        "Alert priority: P2\n"
+        "Alert severity: CRITICAL\n"
+        "Alert description: on battery\n"
+        "Alert state: ACTIVE");
+
+    // unknown and unterminated placeholders are kept, fields may repeat
+    EmailTemplate text ("${assetname}${unknown} ${assetname}/${priority} ${state");
+    assert (text.render (alert, asset) == "ups${unknown} ups/2 ${state");
+    assert (EmailTemplate ("").render (alert, asset).empty ());
+    std::string out = "> ";
+    EmailTemplate ("${description}").render (alert, asset, out);
+    assert (out == "> on battery");
+
+    // sms is one line under the byte budget
+    EmailTemplates sms;
+    assert (sms.sms (alert, asset, 160) == "CRITICAL P2 ups: on battery (rule, ACTIVE)");
+    assert (sms.sms (alert, asset, 20) == "CRITICAL P2 ups:...");
+    assert (sms.sms (alert, asset, 2) == "");
+    alert.description = "  line\n\t one \r\n\u010dty\u0159i  ";
+    assert (sms.sms (alert, asset, 160) == "CRITICAL P2 ups: line one \u010dty\u0159i (rule, ACTIVE)");
+    // 'č' is 2 bytes and it is not split
+    assert (sms.sms (alert, asset, 30) == "CRITICAL P2 ups: line one...");
+    assert (sms.sms (alert, asset, 31) == "CRITICAL P2 ups: line one \u010d...");
+    alert.description = "on battery";
+    alert.state = AlertState::RESOLVED;
+    assert (sms.sms (alert, asset, 160) == "RESOLVED ups: on battery (rule)");
+    alert.state = AlertState::ACTIVE;
+
+    // templates from files
+    std::string path = std::string (SELFTEST_DIR_RW) + "/emailconfiguration-subject";
+    FILE *f = fopen (path.c_str (), "w");
+    assert (f);
+    fputs ("[${severity}] ${rulename}", f);
+    fclose (f);
+    EmailTemplates templates;
+    assert (templates.load (EmailTemplates::SUBJECT_ACTIVE, path) == 0);
+    assert (templates.load (EmailTemplates::BODY_ACTIVE, path + ".none") == -1);
+    assert (templates.subject (alert, asset) == "[CRITICAL] rule");
+    assert (templates.body (alert, asset) == generate_body (alert, asset));
+    alert.state = AlertState::RESOLVED;
+    assert (templates.subject (alert, asset) == "Alert on ups \nfrom the rule rule was resolved");
+    templates.reset ();
+    alert.state = AlertState::ACTIVE;
+    assert (templates.subject (alert, asset) == generate_subject (alert, asset));
+    std::remove (path.c_str ());
+
+    // directory, the most specific template wins
+    std::string dir = std::string (SELFTEST_DIR_RW) + "/emailconfiguration-templates";
+    zsys_dir_create (dir.c_str ());
+    const char *files [][2] = {
+        {"email.subject", "email ${rulename}"},
+        {"email.subject.resolved", "resolved ${rulename}"},
+        {"email.subject.critical", "critical ${rulename}"},
+        {"sms.body.active.critical", "sms ${rulename}"},
+        {"readme", "ignored"}
+    };
+    for (const auto& file : files) {
+        f = fopen ((dir + "/" + file [0]).c_str (), "w");
+        assert (f);
+        fputs (file [1], f);
+        fclose (f);
+    }
+    assert (templates.loadDirectory (dir + "/none") == -1);
+    assert (templates.loadDirectory (dir) == 4);
+    assert (templates.subject (alert, asset) == "critical rule");
+    assert (templates.sms (alert, asset, 160) == "sms rule");
+    assert (templates.body (alert, asset) == generate_body (alert, asset));
+    alert.severity = AlertSeverity::WARNING;
+    assert (templates.subject (alert, asset) == "email rule");
+    assert (templates.sms (alert, asset, 160) == "WARNING P2 ups: on battery (rule, ACTIVE)");
+    alert.state = AlertState::RESOLVED;
+    assert (templates.subject (alert, asset) == "resolved rule");
+    alert.state = AlertState::ACTIVE;
+    alert.severity = AlertSeverity::CRITICAL;
+
+    // loader swaps templates, unchanged files are not compiled again
+    EmailTemplatesLoader loader;
+    std::shared_ptr <const EmailTemplates> builtin = loader.get ();
+    assert (builtin->subject (alert, asset) == generate_subject (alert, asset));
+    EmailTemplatesConfig config;
+    config.directory = dir;
+    loader.load (config);
+    loader.wait ();
+    std::shared_ptr <const EmailTemplates> loaded = loader.get ();
+    assert (loaded != builtin);
+    assert (loaded->subject (alert, asset) == "critical rule");
+    assert (builtin->subject (alert, asset) == generate_subject (alert, asset));
+    const EmailTemplate *compiled = &loaded->select ("email.subject", alert);
+    f = fopen ((dir + "/email.subject").c_str (), "w");
+    assert (f);
+    fputs ("changed ${rulename}", f);
+    fclose (f);
+    loader.load (config);
+    loader.wait ();
+    assert (&loader.get ()->select ("email.subject", alert) == compiled);
+    alert.severity = AlertSeverity::WARNING;
+    assert (loader.get ()->subject (alert, asset) == "changed rule");
+
+    for (const auto& file : files)
+        std::remove ((dir + "/" + file [0]).c_str ());
+    zsys_dir_delete (dir.c_str ());
+    //  @end
     printf ("OK\n");
 }
 
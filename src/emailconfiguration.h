@@ -22,11 +22,166 @@
 #ifndef EMAILCONFIGURATION_H_INCLUDED
 #define EMAILCONFIGURATION_H_INCLUDED
 
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 
 #include "alert.h"
 #include "elementlist.h"
 
+/**
+ * \class EmailTemplate
+ *
+ * \brief Text with ${field} placeholders parsed into segments
+ *
+ * Known fields are rulename, assetname, description, priority, severity
+ * and state. Unknown placeholders are kept as they are. The text is parsed
+ * once by compile (), render () then fills the fields in one pass.
+ */
+class EmailTemplate
+{
+ public:
+    EmailTemplate () : _literal_size (0) {};
+    explicit EmailTemplate (const std::string& text) { compile (text); }
+
+    void    compile (const std::string& text);
+    // reads and compiles the file, returns 0 on success, -1 if it cannot
+    // be read, template is not changed then
+    int     load (const std::string& path);
+
+    // appends rendered text to out
+    void    render (const Alert& alert, const Element& asset, std::string& out) const;
+    std::string render (const Alert& alert, const Element& asset) const;
+
+ private:
+    struct Segment {
+        uint32_t offset;    // literal text in _text
+        uint32_t size;
+        int field;          // -1 for literal
+    };
+
+    std::string _text;
+    std::vector <Segment> _segments;
+    size_t _literal_size;
+};
+
+/**
+ * \class EmailTemplates
+ *
+ * \brief Subjects and bodies of notifications about alerts
+ *
+ * Built-in templates are used unless they are replaced by load () or
+ * by a more specific template from the directory, see loadDirectory ().
+ * Once loaded, the object is not changed, EmailTemplatesLoader replaces
+ * it as a whole.
+ */
+class EmailTemplates
+{
+ public:
+    enum Kind {
+        SUBJECT_ACTIVE,
+        BODY_ACTIVE,
+        SUBJECT_RESOLVED,
+        BODY_RESOLVED,
+        SMS_ACTIVE,
+        SMS_RESOLVED,
+        KINDS
+    };
+
+    EmailTemplates ();
+
+    // Files whose mtime and size did not change since 'previous' was loaded
+    // are not read again, compiled template is shared with 'previous'.
+
+    // returns 0 on success, -1 if the file cannot be read
+    int     load (Kind kind, const std::string& path, const EmailTemplates *previous = NULL);
+
+    // Loads files named <name>[.<state>][.<severity>], e.g. email.subject,
+    // sms.body.resolved or email.body.active.critical, where name is
+    // email.subject, email.body or sms.body (the whole SMS) and state and
+    // severity are lowercase names used in ALERTS. The most specific file
+    // wins, then load ()ed or built-in template is used. Other files are
+    // ignored.
+    // returns number of templates, -1 if the directory cannot be read
+    int     loadDirectory (const std::string& path, const EmailTemplates *previous = NULL);
+
+    // back to built-in templates
+    void    reset ();
+
+    // name is email.subject, email.body or sms.body
+    const EmailTemplate& select (const std::string& name, const Alert& alert) const;
+    std::string subject (const Alert& alert, const Element& asset) const;
+    std::string body (const Alert& alert, const Element& asset) const;
+
+    // one line text of at most max_size bytes, whitespace is collapsed,
+    // longer text is cut on UTF-8 character boundary and ends with "..."
+    std::string sms (const Alert& alert, const Element& asset, size_t max_size) const;
+
+ private:
+    struct File {
+        int64_t mtime;      // ns
+        int64_t size;
+        std::shared_ptr <const EmailTemplate> compiled;
+    };
+
+    std::shared_ptr <const EmailTemplate> compile (const std::string& path, const EmailTemplates *previous);
+
+    std::shared_ptr <const EmailTemplate> _templates [KINDS];
+    // templates from the directory by file name
+    std::unordered_map <std::string, std::shared_ptr <const EmailTemplate>> _named;
+    // every file read, by path
+    std::unordered_map <std::string, File> _files;
+};
+
+// where templates are read from, empty strings for built-in ones
+struct EmailTemplatesConfig {
+    std::string files [EmailTemplates::KINDS];
+    std::string directory;
+};
+
+/**
+ * \class EmailTemplatesLoader
+ *
+ * \brief Loads templates in the background and swaps them atomically
+ *
+ * get () keeps returning the current templates while the new ones are
+ * being loaded, so notifications are not blocked by reading the files.
+ *
+ * Example:
+ *
+ *    EmailTemplatesLoader loader;
+ *    loader.load (config);   // on LOAD
+ *    ...
+ *    std::shared_ptr <const EmailTemplates> templates = loader.get ();
+ *    std::string subject = templates->subject (alert, asset);
+ */
+class EmailTemplatesLoader
+{
+ public:
+    EmailTemplatesLoader ();
+    ~EmailTemplatesLoader ();
+
+    // starts loading, waits for the previous load to finish first
+    void    load (const EmailTemplatesConfig& config);
+    // waits until loading is done
+    void    wait ();
+
+    std::shared_ptr <const EmailTemplates> get () const { return std::atomic_load (&_current); }
+
+ private:
+    void    run (EmailTemplatesConfig config);
+
+    std::shared_ptr <const EmailTemplates> _current;
+    std::thread _thread;
+
+    EmailTemplatesLoader (const EmailTemplatesLoader&) = delete;
+    EmailTemplatesLoader& operator= (const EmailTemplatesLoader&) = delete;
+};
+
+// render built-in templates
 std::string
 generate_body (const Alert& alert, const Element& asset);
 
@@ -54,14 +54,6 @@ void usage ()
 static int
 s_timer_event (zloop_t *loop, int timer_id, void *output)
 {
-    static uint64_t last_check = zclock_mono ();
-    uint64_t now = zclock_mono ();
-
-    if ((now - last_check) > 5*60*1000) {
-        zstr_send (output, "CHECK_NOW");
-        last_check = zclock_mono ();
-    }
-
     if (zconfig_has_changed (config)) {
         zsys_info ("Content of %s have changed, reload it", config_file);
         zconfig_reload (&config);
@@ -221,7 +213,7 @@ int main (int argc, char** argv)
     zstr_sendx (send_mail_only_server, "LOAD", config_file, NULL);
 
     zloop_t *send_alert_trigger = zloop_new();
-    // as 5 minutes is the smallest possible reaction time
+    // notifications are scheduled by the server itself, only watch the config
     zloop_timer (send_alert_trigger, 1000, 0, s_timer_event, smtp_server);
     zloop_start (send_alert_trigger);
 
@@ -55,13 +55,78 @@ typedef struct _elementlist_t elementlist_t;
 typedef struct _subprocess_t subprocess_t;
 #define SUBPROCESS_T_DEFINED
 #endif
+#ifndef DELIVERYPOOL_T_DEFINED
+typedef struct _deliverypool_t deliverypool_t;
+#define DELIVERYPOOL_T_DEFINED
+#endif
+#ifndef SMTPCLIENT_T_DEFINED
+typedef struct _smtpclient_t smtpclient_t;
+#define SMTPCLIENT_T_DEFINED
+#endif
+#ifndef ALERTJOURNAL_T_DEFINED
+typedef struct _alertjournal_t alertjournal_t;
+#define ALERTJOURNAL_T_DEFINED
+#endif
+#ifndef SNAPSHOT_T_DEFINED
+typedef struct _snapshot_t snapshot_t;
+#define SNAPSHOT_T_DEFINED
+#endif
+#ifndef JSONWRITER_T_DEFINED
+typedef struct _jsonwriter_t jsonwriter_t;
+#define JSONWRITER_T_DEFINED
+#endif
+#ifndef ALERTSCHEDULER_T_DEFINED
+typedef struct _alertscheduler_t alertscheduler_t;
+#define ALERTSCHEDULER_T_DEFINED
+#endif
+#ifndef ALERTTABLE_T_DEFINED
+typedef struct _alerttable_t alerttable_t;
+#define ALERTTABLE_T_DEFINED
+#endif
+#ifndef DIGESTQUEUE_T_DEFINED
+typedef struct _digestqueue_t digestqueue_t;
+#define DIGESTQUEUE_T_DEFINED
+#endif
+#ifndef RATELIMITER_T_DEFINED
+typedef struct _ratelimiter_t ratelimiter_t;
+#define RATELIMITER_T_DEFINED
+#endif
+#ifndef MAILSPOOL_T_DEFINED
+typedef struct _mailspool_t mailspool_t;
+#define MAILSPOOL_T_DEFINED
+#endif
+#ifndef MIMEWRITER_T_DEFINED
+typedef struct _mimewriter_t mimewriter_t;
+#define MIMEWRITER_T_DEFINED
+#endif
+#ifndef MIMEENCODER_T_DEFINED
+typedef struct _mimeencoder_t mimeencoder_t;
+#define MIMEENCODER_T_DEFINED
+#endif
+#ifndef MIMETYPES_T_DEFINED
+typedef struct _mimetypes_t mimetypes_t;
+#define MIMETYPES_T_DEFINED
+#endif
 
 //  Internal API
 #include "alert.h"
+#include "alerttable.h"
 #include "emailconfiguration.h"
 #include "email.h"
 #include "elementlist.h"
 #include "subprocess.h"
+#include "deliverypool.h"
+#include "smtpclient.h"
+#include "alertjournal.h"
+#include "snapshot.h"
+#include "jsonwriter.h"
+#include "alertscheduler.h"
+#include "digestqueue.h"
+#include "ratelimiter.h"
+#include "mailspool.h"
+#include "mimewriter.h"
+#include "mimeencoder.h"
+#include "mimetypes.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef FTY_EMAIL_BUILD_DRAFT_API
@@ -91,6 +156,71 @@ FTY_EMAIL_PRIVATE void
 FTY_EMAIL_PRIVATE void
     subprocess_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    deliverypool_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    smtpclient_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    alertjournal_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    snapshot_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    jsonwriter_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    alertscheduler_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    alerttable_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    digestqueue_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    ratelimiter_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    mailspool_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    mimewriter_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    mimeencoder_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    mimetypes_test (bool verbose);
+
 //  Self test for private classes
 FTY_EMAIL_PRIVATE void
     fty_email_private_selftest (bool verbose);
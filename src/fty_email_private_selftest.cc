@@ -43,6 +43,19 @@ fty_email_private_selftest (bool verbose)
     email_test (verbose);
     elementlist_test (verbose);
     subprocess_test (verbose);
+    deliverypool_test (verbose);
+    smtpclient_test (verbose);
+    alertjournal_test (verbose);
+    snapshot_test (verbose);
+    jsonwriter_test (verbose);
+    alertscheduler_test (verbose);
+    alerttable_test (verbose);
+    digestqueue_test (verbose);
+    ratelimiter_test (verbose);
+    mailspool_test (verbose);
+    mimewriter_test (verbose);
+    mimeencoder_test (verbose);
+    mimetypes_test (verbose);
 }
 /*
 ################################################################################
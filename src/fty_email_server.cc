@@ -52,13 +52,70 @@ int agent_smtp_verbose = true;
 #include <stdlib.h>
 #include <unistd.h>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <cxxtools/split.h>
 
 #include "email.h"
 #include "emailconfiguration.h"
 
-typedef std::map <std::pair<std::string, std::string>, Alert> alerts_map;
-typedef alerts_map::iterator alerts_map_iterator;
+// how often are idle SMTP connections checked for expiration [ms]
+static const int SMTP_EXPIRE_INTERVAL = 5000;
+// [s] before notification, which could not be sent, is tried again
+static const uint64_t NOTIFY_RETRY_INTERVAL = 5 * 60;
+// [B] of sms text, one message of the gateway
+static const size_t DEFAULT_SMS_MAX_SIZE = 160;
+
+// Email handed over to DeliveryPool, waiting for the result
+struct PendingDelivery {
+    enum Kind {
+        SENDMAIL,
+        ALERT_EMAIL,
+        ALERT_SMS,
+        ALERT_DIGEST
+    };
+
+    Kind kind;
+    AlertKey alert; // ALERT_EMAIL, ALERT_SMS: [rule, element]
+    uint64_t timestamp; // ALERT_*: time of notification, stored on success
+    std::string sender; // SENDMAIL: mailbox to reply to
+    std::string uuid; // SENDMAIL: uuid of the request
+    std::vector <AlertKey> alerts; // ALERT_DIGEST: alerts in the email
+    uint64_t spooled; // sequence number in MailSpool, 0 if not spooled
+    bool async; // SENDMAIL: SENDMAIL-ASYNC, sender waits for the final reply
+};
+
+// Email being written into MailSpool by DeliveryPool worker
+struct SpoolingDelivery {
+    PendingDelivery pending;
+    // kept to be sent without the spool if it cannot be written
+    std::shared_ptr <const std::string> data;
+    std::shared_ptr <const MimeWriter> mime; // data is not set if mime is
+};
+
+// Outgoing emails are rendered in the actor and sent by DeliveryPool workers
+struct Delivery {
+    std::shared_ptr <const Smtp> smtp; // configuration used by workers, refreshed on LOAD
+    EmailTemplatesLoader templates; // reloaded on LOAD
+    size_t sms_max_size = DEFAULT_SMS_MAX_SIZE;
+    DeliveryPool pool;
+    std::map <uint64_t, PendingDelivery> pending;
+    // [rule, element, kind] of alert notifications in the pool,
+    // to not notify again before the previous one was delivered
+    std::set <std::tuple <InternedString, InternedString, int>> in_flight;
+    // emails about alerts waiting to be sent together, see s_send_digests
+    DigestQueue digests;
+    RateLimiter limiter;
+    // sms over the rate limit, see s_send_deferred_sms
+    DigestQueue deferred_sms;
+    MailSpool spool;
+    // spooled emails not handed over to the pool, by sequence number
+    std::map <uint64_t, PendingDelivery> spooled;
+    // emails being written into the spool, by pool job id
+    std::map <uint64_t, SpoolingDelivery> spooling;
+    // the oldest spooled email is being sent after relay outage
+    bool probing = false;
+};
 
 
 static bool isNew(const char* operation) {
@@ -90,54 +147,46 @@ static bool isDelete(const char* operation) {
         return false;
 }
 
-// TODO: make it configurable without recompiling
 // If time is less 5 minutes, then email in some cases would be sent aproximatly every 5 minutes,
 // as some metrics are generated only once per 5 minute -> alert in 5 minuts -> email in 5 minuts
+//
+// According Aplha document (severity, priority)
+// is mapped onto the time interval [s], 0 means not known,
+// priorities are 1 to 5, P0 is not known either
+static constexpr uint32_t NOTIFICATION_INTERVALS [4][6] = {
+    //              P0  P1           P2            P3            P4            P5
+    /* UNKNOWN  */ {0,  0,           0,            0,            0,            0},
+    /* CRITICAL */ {0,  5 * 60,      15 * 60,      15 * 60,      15 * 60,      15 * 60},
+    /* WARNING  */ {0,  1 * 60 * 60, 4 * 60 * 60,  4 * 60 * 60,  4 * 60 * 60,  4 * 60 * 60},
+    /* INFO     */ {0,  8 * 60 * 60, 24 * 60 * 60, 24 * 60 * 60, 24 * 60 * 60, 24 * 60 * 60}
+};
+
 static uint64_t
 s_getNotificationInterval(
-        const std::string &severity,
+        AlertSeverity severity,
         uint8_t priority)
 {
-    // According Aplha document (severity, priority)
-    // is mapped onto the time interval [s]
-    static const std::map <std::pair <std::string, uint8_t>, uint32_t> times = {
-        { {"CRITICAL", 1}, 5  * 60},
-        { {"CRITICAL", 2}, 15 * 60},
-        { {"CRITICAL", 3}, 15 * 60},
-        { {"CRITICAL", 4}, 15 * 60},
-        { {"CRITICAL", 5}, 15 * 60},
-        { {"WARNING", 1}, 1 * 60 * 60},
-        { {"WARNING", 2}, 4 * 60 * 60},
-        { {"WARNING", 3}, 4 * 60 * 60},
-        { {"WARNING", 4}, 4 * 60 * 60},
-        { {"WARNING", 5}, 4 * 60 * 60},
-        { {"INFO", 1}, 8 * 60 * 60},
-        { {"INFO", 2}, 24 * 60 * 60},
-        { {"INFO", 3}, 24 * 60 * 60},
-        { {"INFO", 4}, 24 * 60 * 60},
-        { {"INFO", 5}, 24 * 60 * 60}
-    };
-    auto it = times.find (std::make_pair (severity, priority));
-    if (it == times.end ()) {
-        zsys_error ("Not known interval for severity = '%s', priority '%d'", severity.c_str (), priority);
+    uint32_t interval = priority < 6 ? NOTIFICATION_INTERVALS [static_cast <size_t> (severity)][priority] : 0;
+    if (interval == 0) {
+        zsys_error ("Not known interval for severity = '%s', priority '%d'", alert_severity_str (severity), priority);
         return 0;
     }
 
-    zsys_debug1 ("in %d [s]", it->second);
-    return it->second - 60;
+    zsys_debug1 ("in %d [s]", interval);
+    return interval - 60;
     // BIOS-1802: time conflict with assumption:
     // if metric is computed it is send approximatly every 5 minutes +- X sec
 }
 
 static bool
-s_need_to_notify (alerts_map_iterator it,
+s_need_to_notify (Alert& alert,
           const Element& element,
           uint64_t &last_notification,
           uint64_t nowTimestamp
           )
 {
-    zsys_debug1 ("last_update = '%ld'\tlast_notification = '%ld'", it->second.last_update, last_notification);
-    if (it->second.last_update > last_notification) {
+    zsys_debug1 ("last_update = '%ld'\tlast_notification = '%ld'", alert.last_update, last_notification);
+    if (alert.last_update > last_notification) {
         // Last notification was sent BEFORE last
         // important change take place -> need to notify
         zsys_debug1 ("important change -> notify");
@@ -145,18 +194,15 @@ s_need_to_notify (alerts_map_iterator it,
     }
     // so, no important changes, but may be we need to
     // notify according the schedule
-    if ( it->second.state == "RESOLVED" ) {
+    if ( alert.state == AlertState::RESOLVED ) {
         // but only for resolved alerts
         return false;
     }
-    if ((nowTimestamp - last_notification) > s_getNotificationInterval (it->second.severity, element.priority))
+    if ((nowTimestamp - last_notification) > s_getNotificationInterval (alert.severity, element.priority))
         // If  lastNotification + interval < NOW
     {
         // so, we found out that we need to notify according the schedule
-        if (    it->second.state == "ACK-PAUSE"
-             || it->second.state == "ACK-IGNORE"
-             || it->second.state == "ACK-SILENCE"
-             || it->second.state == "RESOLVED")
+        if (alert.silenced ())
         {
             zsys_debug1 ("in this status we do not send emails");
             return false;
@@ -168,16 +214,182 @@ s_need_to_notify (alerts_map_iterator it,
 }
 
 
+// meta data of spooled email, so the result can be handled after restart
+static std::string
+s_spool_meta (const PendingDelivery& pending)
+{
+    std::string meta = std::to_string (pending.kind) + "\n"
+        + std::to_string (pending.timestamp) + "\n"
+        // synchronous SENDMAIL is not replied after restart, the caller
+        // got SENDMAIL-QUEUED on relay outage or gave up waiting
+        + (pending.async ? pending.sender : "") + "\n"
+        + pending.uuid + "\n";
+    if (pending.kind == PendingDelivery::ALERT_EMAIL || pending.kind == PendingDelivery::ALERT_SMS)
+        meta.append (pending.alert.first).append ("\t").append (pending.alert.second).append ("\n");
+    for (const auto& key : pending.alerts)
+        meta.append (key.first).append ("\t").append (key.second).append ("\n");
+    return meta;
+}
+
+static bool
+s_spool_parse (const std::string& meta, PendingDelivery& pending)
+{
+    std::istringstream input (meta);
+    std::string kind, timestamp, line;
+    if (!std::getline (input, kind)
+    ||  !std::getline (input, timestamp)
+    ||  !std::getline (input, pending.sender)
+    ||  !std::getline (input, pending.uuid))
+        return false;
+    pending.async = !pending.sender.empty ();
+    try {
+        pending.kind = static_cast <PendingDelivery::Kind> (std::stoi (kind));
+        pending.timestamp = std::stoull (timestamp);
+    }
+    catch (const std::exception& e) {
+        return false;
+    }
+    pending.alerts.clear ();
+    while (std::getline (input, line)) {
+        size_t tab = line.find ('\t');
+        if (tab == std::string::npos)
+            return false;
+        pending.alerts.push_back (AlertKey (line.substr (0, tab), line.substr (tab + 1)));
+    }
+    if (pending.kind == PendingDelivery::ALERT_EMAIL || pending.kind == PendingDelivery::ALERT_SMS) {
+        if (pending.alerts.size () != 1)
+            return false;
+        pending.alert = pending.alerts [0];
+        pending.alerts.clear ();
+    }
+    return pending.kind <= PendingDelivery::ALERT_DIGEST;
+}
+
+// [rule, element, kind] of alert notifications in the email
+static std::vector <std::tuple <InternedString, InternedString, int>>
+s_in_flight_keys (const PendingDelivery& pending)
+{
+    std::vector <std::tuple <InternedString, InternedString, int>> keys;
+    if (pending.kind == PendingDelivery::ALERT_EMAIL || pending.kind == PendingDelivery::ALERT_SMS)
+        keys.push_back (std::make_tuple (pending.alert.first, pending.alert.second, static_cast <int> (pending.kind)));
+    for (const auto& key : pending.alerts)
+        keys.push_back (std::make_tuple (key.first, key.second, static_cast <int> (PendingDelivery::ALERT_EMAIL)));
+    return keys;
+}
+
+// hand spooled emails over to the pool in order, only the oldest one
+// while the relay is not reachable
 static void
-s_notify_base (alerts_map_iterator it,
-          Smtp& smtp,
+s_pump_spool (Delivery& delivery)
+{
+    int64_t retry_at = delivery.spool.retryAt ();
+    if (retry_at != 0 && (delivery.probing || zclock_mono () < retry_at))
+        return;
+    while (!delivery.spooled.empty ()) {
+        auto it = delivery.spooled.begin ();
+        // email is read from the file by the worker
+        std::string path;
+        uint64_t offset;
+        if (delivery.spool.locate (it->first, path, offset) != 0) {
+            zsys_error ("Cannot read spooled email %" PRIu64 ", dropping it", it->first);
+            for (const auto& key : s_in_flight_keys (it->second))
+                delivery.in_flight.erase (key);
+            delivery.spool.remove (it->first);
+            delivery.spooled.erase (it);
+            continue;
+        }
+        uint64_t id = delivery.pool.submit (delivery.smtp, std::make_shared <MimeWriter> (MimeWriter::raw (path, offset)));
+        if (id == 0)
+            return;
+        delivery.pending.emplace (id, it->second);
+        delivery.spooled.erase (it);
+        if (retry_at != 0) {
+            delivery.probing = true;
+            return;
+        }
+    }
+}
+
+// submit the email itself, not through the spool
+static uint64_t
+s_submit_email (Delivery& delivery, const SpoolingDelivery& email)
+{
+    if (email.mime)
+        return delivery.pool.submit (delivery.smtp, email.mime);
+    return delivery.pool.submit (delivery.smtp, *email.data);
+}
+
+// hand the email over to the pool, through the spool if it is configured,
+// the spool file is written by the worker, so the actor does not wait for
+// encoding of attachments and fsync, see s_onDeliveryResult
+// returns false if the email was neither spooled nor put into the pool
+static bool
+s_deliver (Delivery& delivery, SpoolingDelivery email, PendingDelivery& pending)
+{
+    if (delivery.spool.isOpen ()) {
+        pending.spooled = delivery.spool.reserve ();
+        email.pending = pending;
+        std::string dir = delivery.spool.path ();
+        std::string meta = s_spool_meta (pending);
+        uint64_t seq = pending.spooled;
+        std::shared_ptr <const std::string> data = email.data;
+        std::shared_ptr <const MimeWriter> mime = email.mime;
+        uint64_t id = delivery.pool.submit ([dir, seq, meta, data, mime] {
+            return MailSpool::write (dir, seq, meta, [&data, &mime] (const SmtpSink& sink) {
+                if (mime)
+                    mime->write (sink);
+                else
+                    sink (data->data (), data->size ());
+            });
+        });
+        if (id == 0) {
+            delivery.spool.remove (pending.spooled);
+            pending.spooled = 0;
+            return false;
+        }
+        delivery.spooling.emplace (id, email);
+        return true;
+    }
+    uint64_t id = s_submit_email (delivery, email);
+    if (id == 0)
+        return false;
+    delivery.pending.emplace (id, pending);
+    return true;
+}
+
+static bool
+s_deliver (Delivery& delivery, const std::string& data, PendingDelivery& pending)
+{
+    return s_deliver (delivery, SpoolingDelivery {pending, std::make_shared <std::string> (data), nullptr}, pending);
+}
+
+// same for email with attachments, they are encoded by the worker
+static bool
+s_deliver (Delivery& delivery, std::shared_ptr <const MimeWriter> mime, PendingDelivery& pending)
+{
+    return s_deliver (delivery, SpoolingDelivery {pending, nullptr, mime}, pending);
+}
+
+static bool
+s_submit (Alert& alert,
+          Delivery& delivery,
           const Element& element,
           const std::string& to,
-          uint64_t &last_notification
+          PendingDelivery::Kind kind,
+          uint64_t nowTimestamp
+          );
+
+static void
+s_notify_base (Alert& alert,
+          Delivery& delivery,
+          const Element& element,
+          const std::string& to,
+          uint64_t &last_notification,
+          PendingDelivery::Kind kind
           )
 {
     uint64_t nowTimestamp = ::time (NULL);
-    if ( !s_need_to_notify (it, element, last_notification, nowTimestamp) ) {
+    if ( !s_need_to_notify (alert, element, last_notification, nowTimestamp) ) {
         // no notification is needed
         return;
     }
@@ -186,70 +398,425 @@ s_notify_base (alerts_map_iterator it,
         zsys_debug1 ("Can't send a notification. For the asset '%s' contact email or sms_email is unknown", element.name.c_str ());
         return;
     }
+    auto key = std::make_tuple (alert.rule, alert.element, static_cast <int> (kind));
+    if (delivery.in_flight.count (key) == 1) {
+        zsys_debug1 ("Notification is already being delivered");
+        return;
+    }
+    if (kind == PendingDelivery::ALERT_EMAIL && delivery.digests.window () > 0) {
+        delivery.digests.add (to, alert.key (), nowTimestamp);
+        delivery.in_flight.insert (key);
+        return;
+    }
+    int64_t wait = delivery.limiter.acquire (to, kind == PendingDelivery::ALERT_SMS, zclock_mono ());
+    if (wait > 0) {
+        zsys_debug1 ("Rate limit of '%s' reached, notification deferred by %" PRIi64 " ms", to.c_str (), wait);
+        // emails go to the digest of the recipient, sms are sent one by one later
+        DigestQueue& queue = kind == PendingDelivery::ALERT_SMS ? delivery.deferred_sms : delivery.digests;
+        queue.defer (to, {alert.key ()}, nowTimestamp + (wait + 999) / 1000);
+        delivery.in_flight.insert (key);
+        return;
+    }
+    s_submit (alert, delivery, element, to, kind, nowTimestamp);
+}
 
+// render the notification and hand it over to the pool, returns false on error
+static bool
+s_submit (Alert& alert,
+          Delivery& delivery,
+          const Element& element,
+          const std::string& to,
+          PendingDelivery::Kind kind,
+          uint64_t nowTimestamp
+          )
+{
+    auto key = std::make_tuple (alert.rule, alert.element, static_cast <int> (kind));
     try {
-        smtp.sendmail(
-                to,
-                generate_subject (it->second, element),
-                generate_body (it->second, element)
-                );
-        last_notification = nowTimestamp;
+        std::shared_ptr <const EmailTemplates> templates = delivery.templates.get ();
+        std::string data;
+        if (kind == PendingDelivery::ALERT_SMS)
+            // one short text, so it is one message for the gateway
+            data = delivery.smtp->compose_sms (
+                    to,
+                    templates->sms (alert, element, delivery.sms_max_size));
+        else
+            data = delivery.smtp->compose (
+                    to,
+                    templates->subject (alert, element),
+                    templates->body (alert, element)
+                    );
+        PendingDelivery pending {kind, alert.key (), nowTimestamp, "", "", {}, 0, false};
+        if (!s_deliver (delivery, data, pending)) {
+            zsys_warning ("Delivery queue is full, notification about '%s' on '%s' postponed",
+                    alert.rule.c_str (), alert.element.c_str ());
+            return false;
+        }
+        delivery.in_flight.insert (key);
+        return true;
     }
     catch (const std::runtime_error& e) {
         zsys_error ("Error: %s", e.what());
         // here we'll handle the error
     }
+    return false;
 }
 
 static void
-s_notify (alerts_map_iterator it,
-          Smtp& smtp,
-          const ElementList& elements)
+s_notify (Alert& alert,
+          Delivery& delivery,
+          const Element *element)
 {
-    Element element;
-    if (!elements.get (it->first.second, element)) {
+    if (!element) {
         zsys_error ("CAN'T NOTIFY unknown asset");
         return;
     }
-    if (it->second.action_email ())
+    if (alert.action_email ())
         s_notify_base (
-            it,
-            smtp,
-            element,
-            element.email,
-            it->second.last_email_notification
+            alert,
+            delivery,
+            *element,
+            element->email,
+            alert.last_email_notification,
+            PendingDelivery::ALERT_EMAIL
         );
-    if (it->second.action_sms ()) {
+    if (alert.action_sms ()) {
         s_notify_base (
-            it,
-            smtp,
-            element,
-            element.sms_email,
-            it->second.last_sms_notification
+            alert,
+            delivery,
+            *element,
+            element->sms_email,
+            alert.last_sms_notification,
+            PendingDelivery::ALERT_SMS
         );
     }
 
 }
 
+// when s_need_to_notify becomes true for the channel, 0 if never
+static uint64_t
+s_channel_due (const Alert& alert,
+          const Element& element,
+          uint64_t last_notification,
+          uint64_t nowTimestamp)
+{
+    if (alert.last_update > last_notification)
+        // notification was not sent (yet), delivery result reschedules it sooner
+        return nowTimestamp + NOTIFY_RETRY_INTERVAL;
+    if (alert.silenced ())
+        return 0;
+    uint64_t interval = s_getNotificationInterval (alert.severity, element.priority);
+    if (interval == 0)
+        interval = NOTIFY_RETRY_INTERVAL;
+    return last_notification + interval + 1;
+}
+
+// plan the next look at the alert, element is NULL if the asset is not known
+static void
+s_reschedule (Alert& alert,
+          const Element *element,
+          AlertScheduler& scheduler)
+{
+    uint64_t nowTimestamp = ::time (NULL);
+    uint64_t due = 0;
+    if (!element)
+        due = nowTimestamp + NOTIFY_RETRY_INTERVAL;
+    else {
+        if (alert.action_email ())
+            due = s_channel_due (alert, *element, alert.last_email_notification, nowTimestamp);
+        if (alert.action_sms ()) {
+            uint64_t sms = s_channel_due (alert, *element, alert.last_sms_notification, nowTimestamp);
+            if (sms != 0 && (due == 0 || sms < due))
+                due = sms;
+        }
+    }
+
+    if (due == 0)
+        scheduler.cancel (alert.key ());
+    else
+        scheduler.schedule (alert.key (), due);
+}
+
+static void
+    s_notify_due (
+        AlertTable &alerts,
+        AlertScheduler& scheduler,
+        Delivery& delivery,
+        const ElementList& elements
+    )
+{
+    for (const auto& key : scheduler.due (::time (NULL))) {
+        Alert *alert = alerts.find (key);
+        if (!alert)
+            continue;
+        const Element *element = elements.find (alert->element);
+        s_notify (*alert, delivery, element);
+        s_reschedule (*alert, element, scheduler);
+    }
+}
+
+// send one email per recipient about all alerts collected in the digest window
+static void
+    s_send_digests (
+        AlertTable &alerts,
+        AlertScheduler& scheduler,
+        Delivery& delivery,
+        const ElementList& elements
+    )
+{
+    uint64_t nowTimestamp = ::time (NULL);
+    for (const auto& digest : delivery.digests.due (nowTimestamp)) {
+        std::shared_ptr <const EmailTemplates> templates = delivery.templates.get ();
+        std::vector <AlertKey> sent;
+        std::vector <std::pair <std::string, std::string>> parts;
+        for (const auto& key : digest.second) {
+            Alert *alert = alerts.find (key);
+            const Element *element = alert ? elements.find (alert->element) : NULL;
+            if (!element) {
+                delivery.in_flight.erase (std::make_tuple (key.first, key.second, static_cast <int> (PendingDelivery::ALERT_EMAIL)));
+                continue;
+            }
+            parts.push_back (std::make_pair (templates->subject (*alert, *element), templates->body (*alert, *element)));
+            sent.push_back (key);
+        }
+        if (sent.empty ())
+            continue;
+
+        std::string subject;
+        std::string body;
+        if (parts.size () == 1) {
+            subject = parts [0].first;
+            body = parts [0].second;
+        }
+        else {
+            subject = std::to_string (parts.size ()) + " alerts were detected or changed";
+            for (const auto& part : parts) {
+                if (!body.empty ())
+                    body.append ("\n\n");
+                body.append (part.first).append ("\n\n").append (part.second);
+            }
+        }
+
+        int64_t wait = delivery.limiter.acquire (digest.first, false, zclock_mono ());
+        if (wait > 0) {
+            zsys_debug1 ("Rate limit of '%s' reached, digest deferred by %" PRIi64 " ms", digest.first.c_str (), wait);
+            delivery.digests.defer (digest.first, sent, nowTimestamp + (wait + 999) / 1000);
+            continue;
+        }
+
+        PendingDelivery pending {PendingDelivery::ALERT_DIGEST, AlertKey (), nowTimestamp, "", "", sent, 0, false};
+        bool delivered = false;
+        try {
+            delivered = s_deliver (delivery, delivery.smtp->compose (digest.first, subject, body), pending);
+            if (!delivered)
+                zsys_warning ("Delivery queue is full, digest for '%s' postponed", digest.first.c_str ());
+        }
+        catch (const std::runtime_error& e) {
+            zsys_error ("Error: %s", e.what ());
+        }
+        if (!delivered) {
+            for (const auto& key : sent) {
+                delivery.in_flight.erase (std::make_tuple (key.first, key.second, static_cast <int> (PendingDelivery::ALERT_EMAIL)));
+                Alert *alert = alerts.find (key);
+                s_reschedule (*alert, elements.find (alert->element), scheduler);
+            }
+            continue;
+        }
+    }
+}
+
+// send sms deferred by the rate limit, as long as the limit allows
 static void
-    s_notify_all (
-        alerts_map &alerts,
-        Smtp& smtp,
+    s_send_deferred_sms (
+        AlertTable &alerts,
+        AlertScheduler& scheduler,
+        Delivery& delivery,
         const ElementList& elements
     )
 {
-    for ( auto it = alerts.begin(); it!= alerts.end(); it++ ) {
-        s_notify (it, smtp, elements);
+    uint64_t nowTimestamp = ::time (NULL);
+    for (const auto& deferred : delivery.deferred_sms.due (nowTimestamp)) {
+        const std::string& to = deferred.first;
+        for (size_t i = 0; i != deferred.second.size (); i++) {
+            const AlertKey& key = deferred.second [i];
+            Alert *alert = alerts.find (key);
+            const Element *element = alert ? elements.find (alert->element) : NULL;
+            if (!element || element->sms_email != to) {
+                delivery.in_flight.erase (std::make_tuple (key.first, key.second, static_cast <int> (PendingDelivery::ALERT_SMS)));
+                if (alert)
+                    s_reschedule (*alert, element, scheduler);
+                continue;
+            }
+            int64_t wait = delivery.limiter.acquire (to, true, zclock_mono ());
+            if (wait > 0) {
+                std::vector <AlertKey> rest (deferred.second.begin () + i, deferred.second.end ());
+                delivery.deferred_sms.defer (to, rest, nowTimestamp + (wait + 999) / 1000);
+                break;
+            }
+            delivery.in_flight.erase (std::make_tuple (key.first, key.second, static_cast <int> (PendingDelivery::ALERT_SMS)));
+            if (!s_submit (*alert, delivery, *element, to, PendingDelivery::ALERT_SMS, nowTimestamp))
+                s_reschedule (*alert, element, scheduler);
+        }
     }
 }
 
+static void
+    s_sendmail_send (
+        mlm_client_t *client,
+        const std::string& sender,
+        const char *subject,
+        const std::string& uuid,
+        SmtpError code,
+        const std::string& message)
+{
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, uuid.c_str ());
+    zmsg_addstrf (reply, "%" PRIu32, static_cast <uint32_t> (code));
+    zmsg_addstr (reply, message.c_str ());
+
+    int r = mlm_client_sendto (client, sender.c_str (), subject, NULL, 1000, &reply);
+    if (r == -1)
+        zsys_error ("Can't send %s for %s to %s", subject, uuid.c_str (), sender.c_str ());
+    zmsg_destroy (&reply);
+}
+
+// final reply to SENDMAIL or SENDMAIL-ASYNC
+static void
+    s_sendmail_reply (
+        mlm_client_t *client,
+        const std::string& sender,
+        const std::string& uuid,
+        SmtpError code,
+        const std::string& message)
+{
+    s_sendmail_send (client, sender,
+        code == SmtpError::Succeeded ? "SENDMAIL-OK" : "SENDMAIL-ERR",
+        uuid, code, message);
+}
+
+static void
+    s_onDeliveryResult (
+        const DeliveryResult& result,
+        Delivery& delivery,
+        AlertTable& alerts,
+        AlertJournal& journal,
+        AlertScheduler& scheduler,
+        const ElementList& elements,
+        mlm_client_t *client)
+{
+    auto spooling = delivery.spooling.find (result.id);
+    if (spooling != delivery.spooling.end ()) {
+        SpoolingDelivery email = spooling->second;
+        delivery.spooling.erase (spooling);
+        PendingDelivery& pending = email.pending;
+        bool async = pending.kind == PendingDelivery::SENDMAIL && pending.async;
+        if (result.code == SmtpError::Succeeded) {
+            if (async)
+                s_sendmail_send (client, pending.sender, "SENDMAIL-QUEUED", pending.uuid, SmtpError::Succeeded, "SPOOLED");
+            // older spooled emails go first
+            delivery.spooled.emplace (pending.spooled, pending);
+            s_pump_spool (delivery);
+            return;
+        }
+        zsys_error ("Cannot spool the email, sending it without the spool");
+        delivery.spool.remove (pending.spooled);
+        pending.spooled = 0;
+        uint64_t id = s_submit_email (delivery, email);
+        if (id != 0) {
+            if (async)
+                s_sendmail_send (client, pending.sender, "SENDMAIL-QUEUED", pending.uuid, SmtpError::Succeeded, "QUEUED");
+            delivery.pending.emplace (id, pending);
+            return;
+        }
+        // handled as failed delivery
+        delivery.pending.emplace (result.id, pending);
+        s_onDeliveryResult (DeliveryResult {result.id, SmtpError::Unknown, "Delivery queue is full"},
+            delivery, alerts, journal, scheduler, elements, client);
+        return;
+    }
+
+    auto search = delivery.pending.find (result.id);
+    if (search == delivery.pending.end ()) {
+        zsys_error ("Result of unknown delivery %" PRIu64, result.id);
+        return;
+    }
+    PendingDelivery pending = search->second;
+    delivery.pending.erase (search);
+
+    if (pending.spooled != 0) {
+        delivery.probing = false;
+        if (MailSpool::retryable (result.code)) {
+            // stays in the spool, sent again once the relay is reachable
+            zsys_warning ("Delivery of spooled email %" PRIu64 " failed, will retry: %s",
+                pending.spooled, result.message.c_str ());
+            delivery.spool.failed (zclock_mono ());
+            // synchronous caller is not kept waiting for the relay, the
+            // email is not lost, so it is not an error
+            if (pending.kind == PendingDelivery::SENDMAIL && !pending.async && !pending.sender.empty ()) {
+                s_sendmail_send (client, pending.sender, "SENDMAIL-QUEUED", pending.uuid, SmtpError::Succeeded, "SPOOLED");
+                pending.sender.clear ();
+            }
+            delivery.spooled.emplace (pending.spooled, pending);
+            return;
+        }
+        delivery.spool.remove (pending.spooled);
+        if (result.code == SmtpError::Succeeded)
+            delivery.spool.succeeded ();
+    }
+
+    if (pending.kind == PendingDelivery::SENDMAIL) {
+        if (result.code != SmtpError::Succeeded)
+            zsys_debug1 ("SENDMAIL %s failed: %s", pending.uuid.c_str (), result.message.c_str ());
+        if (!pending.sender.empty ())
+            s_sendmail_reply (client, pending.sender, pending.uuid, result.code, result.message);
+        return;
+    }
+
+    if (pending.kind == PendingDelivery::ALERT_DIGEST) {
+        // all alerts of the digest are notified or none of them
+        if (result.code != SmtpError::Succeeded)
+            zsys_error ("Error: %s", result.message.c_str ());
+        for (const auto& key : pending.alerts) {
+            delivery.in_flight.erase (std::make_tuple (key.first, key.second, static_cast <int> (PendingDelivery::ALERT_EMAIL)));
+            Alert *alert = alerts.find (key);
+            if (!alert)
+                continue;
+            if (result.code == SmtpError::Succeeded) {
+                alert->last_email_notification = pending.timestamp;
+                journal.update (*alert);
+            }
+            s_reschedule (*alert, elements.find (alert->element), scheduler);
+        }
+        return;
+    }
+
+    delivery.in_flight.erase (std::make_tuple (pending.alert.first, pending.alert.second, static_cast <int> (pending.kind)));
+    Alert *alert = alerts.find (pending.alert);
+    if (result.code != SmtpError::Succeeded) {
+        zsys_error ("Error: %s", result.message.c_str ());
+        if (alert)
+            s_reschedule (*alert, elements.find (alert->element), scheduler);
+        return;
+    }
+
+    if (!alert)
+        return;
+    if (pending.kind == PendingDelivery::ALERT_EMAIL)
+        alert->last_email_notification = pending.timestamp;
+    else
+        alert->last_sms_notification = pending.timestamp;
+    journal.update (*alert);
+    s_reschedule (*alert, elements.find (alert->element), scheduler);
+}
+
 
 static void
 s_onAlertReceive (
     fty_proto_t **p_message,
-    alerts_map& alerts,
+    AlertTable& alerts,
+    AlertJournal& journal,
+    AlertScheduler& scheduler,
     ElementList& elements,
-    Smtp& smtp)
+    Delivery& delivery)
 {
     if (p_message == NULL) return;
     fty_proto_t *message = *p_message;
@@ -259,11 +826,9 @@ s_onAlertReceive (
         return;
     }
     // decode alert message
-    const char *rule = fty_proto_rule (message);
-    std::string rule_name (rule);
-    std::transform (rule_name.begin(), rule_name.end(), rule_name.begin(), ::tolower);
-    const char *state = fty_proto_state (message);
-    const char *severity = fty_proto_severity (message);
+    std::string rule_name = alert_rule_name (fty_proto_rule (message));
+    AlertState state = alert_state (fty_proto_state (message));
+    AlertSeverity severity = alert_severity (fty_proto_severity (message));
     const char *asset = fty_proto_name (message);
     const char *description = fty_proto_description (message);
     int64_t timestamp = fty_proto_time (message);
@@ -273,14 +838,15 @@ s_onAlertReceive (
     const char *actions = fty_proto_action (message);
 
     // do we know this alert from past?
-    alerts_map_iterator search = alerts.find (std::make_pair (rule_name, asset));
-    if ( (strcasestr (actions, "EMAIL") == NULL)
-         && (strcasestr (actions, "SMS") == NULL )) {
+    Alert *search = alerts.find (rule_name, asset);
+    if (alert_action (actions) == 0) {
         // this means, that for this alert no "SMS/EMAIL" action
         // -> we are not interested in it;
-        if (search != alerts.end ()) {
+        if (search) {
             // alert is in list but action is not email/sms anymore
-            alerts.erase (search);
+            scheduler.cancel (search->key ());
+            alerts.erase (search->key ());
+            journal.erase (rule_name, asset);
         }
         // this is alert not in list now
         zsys_debug1 ("Email action (%s) is not specified -> smtp agent is not interested in this alert", actions);
@@ -289,41 +855,75 @@ s_onAlertReceive (
     }
     // add alert to the list of alerts
     // so, EMAIL is (or was) in action -> add to the list of alerts
-    if ( search == alerts.end () ) {
+    if ( !search ) {
         // such alert is not known -> insert
-        bool inserted = false;
-        // we need an iterator to the right element
-        std::tie (search, inserted) = alerts.emplace (std::make_pair (std::make_pair (rule_name, asset),
-                    Alert (message)));
+        search = alerts.insert (Alert (message)).first;
+        journal.update (*search);
         zsys_debug1 ("Not known alert->add");
     }
-    else if (search->second.state != state ||
-            search->second.severity != severity ||
-            search->second.description != description)
+    else if (search->state != state ||
+            search->severity != severity ||
+            search->description != description)
     {
         // such alert is already known, update info about it
-        search->second.state = state;
-        search->second.severity = severity;
-        search->second.description = description;
-        search->second.time = (uint64_t) timestamp;
-        search->second.last_update = ::time (NULL);
+        search->state = state;
+        search->severity = severity;
+        search->description = description;
+        search->time = (uint64_t) timestamp;
+        search->last_update = ::time (NULL);
+        journal.update (*search);
         zsys_debug1 ("Known alert->update");
     }
     // Find out information about the element
-    if (!elements.exists (asset)) {
+    const Element *element = elements.find (search->element);
+    if (!element) {
         zsys_error ("The asset '%s' is not known", asset);
         // TODO: find information about the asset REQ-REP
+        s_reschedule (*search, element, scheduler);
         fty_proto_destroy (p_message);
         return;
     }
     // So, asset is known, try to notify about it
-    s_notify (search, smtp, elements);
+    s_notify (*search, delivery, element);
+    s_reschedule (*search, element, scheduler);
     fty_proto_destroy (p_message);
 }
 
+// re-evaluate alerts on the asset after it has changed, forget them once it is deleted
+static void
+s_onAssetChange (
+    const std::string& asset,
+    bool deleted,
+    AlertTable& alerts,
+    AlertJournal& journal,
+    AlertScheduler& scheduler,
+    const ElementList& elements,
+    Delivery& delivery)
+{
+    const Element *element = elements.find (asset);
+    for (Alert *alert : alerts.ofAsset (asset)) {
+        if (deleted) {
+            AlertKey key = alert->key ();
+            zsys_debug1 ("Asset '%s' deleted, forget alert '%s'", asset.c_str (), key.first.c_str ());
+            scheduler.cancel (key);
+            journal.erase (key.first, key.second);
+            alerts.erase (key);
+        }
+        else {
+            // priority changes the schedule, new contact may allow postponed notification
+            s_notify (*alert, delivery, element);
+            s_reschedule (*alert, element, scheduler);
+        }
+    }
+}
+
 void onAssetReceive (
     fty_proto_t **p_message,
     ElementList& elements,
+    AlertTable& alerts,
+    AlertJournal& journal,
+    AlertScheduler& scheduler,
+    Delivery& delivery,
     const char* sms_gateway,
     bool verbose)
 {
@@ -355,6 +955,7 @@ void onAssetReceive (
     }
 
     const char *operation = fty_proto_operation (message);
+    bool changed = false;
     if ( isNew (operation) || isUpdate(operation) ) {
         zhash_t *aux = fty_proto_aux (message);
         const char *default_priority = "5";
@@ -381,25 +982,25 @@ void onAssetReceive (
                 zsys_error (e.what());
             }
         }
-        elements.add (newAsset);
+        changed = elements.add (newAsset);
         if (verbose)
             newAsset.debug_print();
     } else if ( isPartialUpdate(operation) ) {
         zsys_debug1 ("asset name = %s", name);
         if ( contact_name ) {
             zsys_debug1 ("to update: contact_name = %s", contact_name);
-            elements.updateContactName (name, contact_name);
+            changed |= elements.updateContactName (name, contact_name);
         }
         if ( contact_email ) {
             zsys_debug1 ("to update: contact_email = %s", contact_email);
-            elements.updateEmail (name, contact_email);
+            changed |= elements.updateEmail (name, contact_email);
         }
         if ( contact_phone ) {
             zsys_debug1 ("to update: contact_phone = %s", contact_email);
-            elements.updatePhone (name, contact_phone);
+            changed |= elements.updatePhone (name, contact_phone);
             if (sms_gateway) {
                 try {
-                    elements.updateSMSEmail (name, sms_email_address (sms_gateway, contact_phone));
+                    changed |= elements.updateSMSEmail (name, sms_email_address (sms_gateway, contact_phone));
                 }
                 catch ( const std::exception &e ) {
                    zsys_error (e.what());
@@ -408,80 +1009,19 @@ void onAssetReceive (
         }
     } else if ( isDelete(operation) ) {
         zsys_debug1 ("Asset:delete: '%s'", name);
-        elements.remove (name);
+        changed = elements.remove (name);
     }
     else {
         zsys_error ("unsupported operation '%s' on the asset, ignore it", operation);
     }
 
-    elements.save();
+    if (changed)
+        s_onAssetChange (name, isDelete (operation), alerts, journal, scheduler, elements, delivery);
+
     // destroy the message
     fty_proto_destroy (p_message);
 }
 
-static int
-    load_alerts_state (
-        alerts_map &alerts,
-        const char *file)
-{
-    if ( file == NULL ) {
-        zsys_warning ("state file for alerts is not set up, no state is persist");
-        return 0;
-    }
-    std::ifstream ifs (file, std::ios::in);
-    if ( !ifs.good() ) {
-        zsys_error ("load_alerts: Cannot open file '%s' for read", file);
-        ifs.close();
-        return -1;
-    }
-    try {
-        cxxtools::SerializationInfo si;
-        std::string json_string(std::istreambuf_iterator<char>(ifs), {});
-        std::stringstream s(json_string);
-        cxxtools::JsonDeserializer json(s);
-        json.deserialize(si);
-        si >>= alerts;
-        ifs.close();
-        return 0;
-    }
-    catch ( const std::exception &e) {
-        zsys_error ("Cannot deserialize the file '%s'. Error: '%s'", file, e.what());
-        ifs.close();
-        return -1;
-    }
-}
-
-static int
-    save_alerts_state (
-        const alerts_map &alerts,
-        const char* file)
-{
-    if ( file == NULL ) {
-        zsys_warning ("state file for alerts is not set up, no state is persist");
-        return 0;
-    }
-
-    std::ofstream ofs (std::string(file) + ".new", std::ofstream::out);
-    if ( !ofs.good() ) {
-        zsys_error ("Cannot open file '%s'.new for write", file);
-        ofs.close();
-        return -1;
-    }
-    std::stringstream s;
-    cxxtools::JsonSerializer js (s);
-    js.beautify (true);
-    js.serialize (alerts).finish ();
-    ofs << s.str();
-    ofs.close();
-    int r = std::rename (std::string (file).append(".new").c_str (),
-        std::string (file).c_str());
-    if ( r != 0 ) {
-        zsys_error ("Cannot rename file '%s'.new to '%s'", file, file);
-        return -2;
-    }
-    return 0;
-}
-
 // return dfl is item is NULL or empty string!!
 // smtp
 //  user
@@ -498,16 +1038,15 @@ s_get (zconfig_t *config, const char* key, const char* dfl) {
     return ret;
 }
 
-zmsg_t *
-fty_email_encode (
+// encode frames before attachments
+static zmsg_t *
+s_encode (
         const char *uuid,
         const char *to,
         const char *subject,
         zhash_t *headers,
-        const char *body,
-        ...)
+        const char *body)
 {
-
     assert (uuid);
     assert (to);
     assert (subject);
@@ -532,6 +1071,21 @@ fty_email_encode (
         zframe_t *frame = zhash_pack(headers);
         zmsg_append (msg, &frame);
     }
+    return msg;
+}
+
+zmsg_t *
+fty_email_encode (
+        const char *uuid,
+        const char *to,
+        const char *subject,
+        zhash_t *headers,
+        const char *body,
+        ...)
+{
+    zmsg_t *msg = s_encode (uuid, to, subject, headers, body);
+    if (!msg)
+        return NULL;
 
     va_list args;
     va_start (args, body);
@@ -547,6 +1101,38 @@ fty_email_encode (
     return msg;
 }
 
+zmsg_t *
+fty_email_encode_attachments (
+        const char *uuid,
+        const char *to,
+        const char *subject,
+        zhash_t *headers,
+        const char *body,
+        const fty_email_attachment_t *attachments,
+        size_t count)
+{
+    assert (attachments || count == 0);
+
+    zmsg_t *msg = s_encode (uuid, to, subject, headers, body);
+    if (!msg)
+        return NULL;
+
+    for (size_t i = 0; i != count; i++) {
+        const fty_email_attachment_t *attachment = &attachments [i];
+        assert (attachment->name);
+        if (attachment->fd != -1)
+            zmsg_addstrf (msg, FTY_EMAIL_ATTACH_FD "%d:%d:%s", getpid (), attachment->fd, attachment->name);
+        else
+        if (attachment->data) {
+            zmsg_addstrf (msg, FTY_EMAIL_ATTACH_INLINE "%s", attachment->name);
+            zmsg_addmem (msg, attachment->data, attachment->size);
+        }
+        else
+            zmsg_addstr (msg, attachment->name);
+    }
+    return msg;
+}
+
 
 void
 fty_email_server (zsock_t *pipe, void* args)
@@ -562,20 +1148,71 @@ fty_email_server (zsock_t *pipe, void* args)
     mlm_client_t *client = mlm_client_new ();
     bool client_connected = false;
 
-    zpoller_t *poller = zpoller_new (pipe, mlm_client_msgpipe (client), NULL);
-
-    char *alerts_state_file = NULL;
-    alerts_map alerts;
+    AlertJournal journal;
+    AlertTable alerts;
+    AlertScheduler scheduler;
     ElementList elements;
     Smtp smtp;
+    Delivery delivery;
+    delivery.smtp = std::make_shared <Smtp> (smtp);
+
+    zpoller_t *poller = zpoller_new (pipe, mlm_client_msgpipe (client), delivery.pool.results (), NULL);
 
     std::set <std::tuple <std::string, std::string>> streams;
     bool producer = false;
+    int64_t last_expire = zclock_mono ();
 
     zsock_signal (pipe, 0);
     while ( !zsys_interrupted ) {
 
-        void *which = zpoller_wait (poller, -1);
+        int64_t timeout = elements.flushTimeout ();
+        if (timeout < 0 || timeout > SMTP_EXPIRE_INTERVAL)
+            timeout = SMTP_EXPIRE_INTERVAL;
+        uint64_t next = scheduler.next ();
+        for (uint64_t queued : {delivery.digests.next (), delivery.deferred_sms.next ()}) {
+            if (queued != 0 && (next == 0 || queued < next))
+                next = queued;
+        }
+        if (next != 0) {
+            uint64_t now = ::time (NULL);
+            int64_t due = next > now ? (int64_t) (next - now) * 1000 : 0;
+            if (due < timeout)
+                timeout = due;
+        }
+        if (!delivery.spooled.empty () && delivery.spool.retryAt () != 0 && !delivery.probing) {
+            int64_t retry = delivery.spool.retryAt () - zclock_mono ();
+            if (retry < timeout)
+                timeout = retry > 0 ? retry : 0;
+        }
+        void *which = zpoller_wait (poller, (int) timeout);
+
+        if (zclock_mono () - last_expire >= SMTP_EXPIRE_INTERVAL) {
+            smtp.expire ();
+            delivery.limiter.expire (zclock_mono ());
+            last_expire = zclock_mono ();
+        }
+        if (!sendmail_only)
+            elements.flush ();
+        s_pump_spool (delivery);
+        s_notify_due (alerts, scheduler, delivery, elements);
+        s_send_digests (alerts, scheduler, delivery, elements);
+        s_send_deferred_sms (alerts, scheduler, delivery, elements);
+
+        if (!which) {
+            if (zpoller_terminated (poller))
+                break;
+            continue;
+        }
+
+        if (which == delivery.pool.results ()) {
+            DeliveryResult result;
+            if (!DeliveryPool::recv (delivery.pool.results (), result))
+                continue;
+            s_onDeliveryResult (result, delivery, alerts, journal, scheduler, elements, client);
+            if (journal.needsCompaction (alerts.size ()))
+                journal.save (alerts);
+            continue;
+        }
 
         if (which == pipe) {
             zsys_debug1 ("%s:\twhich == pipe", name);
@@ -627,6 +1264,9 @@ fty_email_server (zsock_t *pipe, void* args)
                 }
                 //STATE_FILE_PATH_ASSETS
                 if (!sendmail_only) {
+                    elements.setFlushPolicy (
+                        strtoll (s_get (config, "server/flush_interval", "5000"), NULL, 10),
+                        strtoul (s_get (config, "server/flush_changes", "1000"), NULL, 10));
                     if (s_get (config, "server/assets", NULL)) {
                         const char *path = s_get (config, "server/assets", NULL);
                         elements.setFile (path);
@@ -636,14 +1276,62 @@ fty_email_server (zsock_t *pipe, void* args)
                 }
                 //STATE_FILE_PATH_ALERTS
                 if (s_get (config, "server/alerts", NULL)) {
-                    alerts_state_file = strdup (s_get (config, "server/alerts", NULL));
-                    int r = load_alerts_state (alerts, alerts_state_file);
+                    journal.setFile (s_get (config, "server/alerts", NULL));
+                    int r = journal.load (alerts);
                     if ( r == 0 ) {
                         zsys_debug1 ("State(alerts) loaded successfully");
                     }
                     else {
                         zsys_warning ("State(alerts) is not loaded successfully. Starting with empty set");
                     }
+                    for (Alert& alert : alerts)
+                        s_reschedule (alert, elements.find (alert.element), scheduler);
+                }
+
+                // emails spooled before restart are sent once smtp is configured
+                delivery.spool.setBackoff (
+                    strtoll (s_get (config, "server/spool_retry", "5000"), NULL, 10),
+                    strtoll (s_get (config, "server/spool_retry_max", "600000"), NULL, 10));
+                // both actors share the configuration, each one has its own spool
+                std::string spool_dir = s_get (config, "server/spool", "");
+                if (!spool_dir.empty () && sendmail_only)
+                    spool_dir += "/sendmail-only";
+                if (!spool_dir.empty () && !delivery.spool.isOpen ()
+                &&  delivery.spool.open (spool_dir) == 0) {
+                    for (uint64_t seq : delivery.spool.list ()) {
+                        std::string meta;
+                        PendingDelivery pending {PendingDelivery::SENDMAIL, {}, 0, "", "", {}, seq, false};
+                        if (delivery.spool.readMeta (seq, meta) != 0 || !s_spool_parse (meta, pending)) {
+                            zsys_error ("Spooled email %" PRIu64 " is damaged, it is not sent", seq);
+                            continue;
+                        }
+                        for (const auto& key : s_in_flight_keys (pending))
+                            delivery.in_flight.insert (key);
+                        delivery.spooled.emplace (seq, pending);
+                    }
+                    if (!delivery.spooled.empty ())
+                        zsys_info ("%zu spooled emails to be sent", delivery.spooled.size ());
+                }
+
+                // templates are compiled in the background, current ones
+                // are used until the new ones are ready
+                {
+                    static const struct {
+                        const char *key;
+                        EmailTemplates::Kind kind;
+                    } TEMPLATES [] = {
+                        {"templates/subject_active", EmailTemplates::SUBJECT_ACTIVE},
+                        {"templates/body_active", EmailTemplates::BODY_ACTIVE},
+                        {"templates/subject_resolved", EmailTemplates::SUBJECT_RESOLVED},
+                        {"templates/body_resolved", EmailTemplates::BODY_RESOLVED},
+                        {"templates/sms_active", EmailTemplates::SMS_ACTIVE},
+                        {"templates/sms_resolved", EmailTemplates::SMS_RESOLVED}
+                    };
+                    EmailTemplatesConfig templates;
+                    for (const auto& it : TEMPLATES)
+                        templates.files [it.kind] = s_get (config, it.key, "");
+                    templates.directory = s_get (config, "templates/directory", "");
+                    delivery.templates.load (templates);
                 }
 
                 // smtp
@@ -675,9 +1363,39 @@ fty_email_server (zsock_t *pipe, void* args)
                     smtp.from (s_get (config, "smtp/from", NULL));
                 }
 
+                if (s_get (config, "smtp/transport", NULL)) {
+                    smtp.transport (s_get (config, "smtp/transport", NULL));
+                }
+                delivery.digests.window (strtoull (s_get (config, "server/digest_window", "0"), NULL, 10));
+                {
+                    static const struct {
+                        const char *key;
+                        RateLimiter::Scope scope;
+                        const char *burst;
+                    } LIMITS [] = {
+                        {"smtp/rate_limit/global", RateLimiter::GLOBAL, "10"},
+                        {"smtp/rate_limit/recipient", RateLimiter::RECIPIENT, "5"},
+                        {"smtp/rate_limit/sms_domain", RateLimiter::SMS_DOMAIN, "5"}
+                    };
+                    for (const auto& it : LIMITS) {
+                        std::string burst = std::string (it.key) + "_burst";
+                        delivery.limiter.limit (it.scope,
+                            strtod (s_get (config, it.key, "0"), NULL),
+                            strtod (s_get (config, burst.c_str (), it.burst), NULL));
+                    }
+                }
+                delivery.sms_max_size = strtoul (s_get (config, "smtp/sms_max_size", "160"), NULL, 10);
+                smtp.pool_size (strtoul (s_get (config, "smtp/pool_size", "4"), NULL, 10));
+                smtp.keepalive (strtoul (s_get (config, "smtp/keepalive", "60"), NULL, 10));
+
                 // turn on verify_ca only if smtp/verify_ca is true
                 smtp.verify_ca (streq (zconfig_get (config, "smtp/verify_ca", "false"), "true"));
 
+                // delivery
+                delivery.pool.workers (strtoul (s_get (config, "smtp/workers", "1"), NULL, 10));
+                delivery.pool.capacity (strtoul (s_get (config, "smtp/queue_size", "1024"), NULL, 10));
+                delivery.smtp = std::make_shared <Smtp> (smtp);
+
                 // malamute
                 if (zconfig_get (config, "malamute/verbose", NULL)) {
                     const char* foo = zconfig_get (config, "malamute/verbose", "false");
@@ -764,7 +1482,39 @@ fty_email_server (zsock_t *pipe, void* args)
             }
             else
             if (streq (cmd, "CHECK_NOW")) {
-                s_notify_all (alerts, smtp, elements);
+                // notifications are scheduled, it just does what is due now
+                s_notify_due (alerts, scheduler, delivery, elements);
+                s_send_digests (alerts, scheduler, delivery, elements);
+                s_send_deferred_sms (alerts, scheduler, delivery, elements);
+            }
+            else
+            if (streq (cmd, "STATS")) {
+                SmtpPoolStats stats = smtp.pool_stats ();
+                zmsg_t *reply = zmsg_new ();
+                zmsg_addstr (reply, "smtp/pool_hits");
+                zmsg_addstrf (reply, "%" PRIu64, stats.hits);
+                zmsg_addstr (reply, "smtp/pool_misses");
+                zmsg_addstrf (reply, "%" PRIu64, stats.misses);
+                zmsg_addstr (reply, "smtp/pool_expired");
+                zmsg_addstrf (reply, "%" PRIu64, stats.expired);
+                zmsg_addstr (reply, "smtp/pool_idle");
+                zmsg_addstrf (reply, "%zu", stats.idle);
+                RateLimiterStats limiter = delivery.limiter.stats ();
+                zmsg_addstr (reply, "ratelimit/allowed");
+                zmsg_addstrf (reply, "%" PRIu64, limiter.allowed);
+                zmsg_addstr (reply, "ratelimit/deferred");
+                zmsg_addstrf (reply, "%" PRIu64, limiter.deferred);
+                zmsg_addstr (reply, "ratelimit/global_tokens");
+                zmsg_addstrf (reply, "%.2f", limiter.global_tokens);
+                zmsg_addstr (reply, "ratelimit/recipients");
+                zmsg_addstrf (reply, "%zu", limiter.recipients);
+                zmsg_addstr (reply, "ratelimit/domains");
+                zmsg_addstrf (reply, "%zu", limiter.domains);
+                zmsg_addstr (reply, "ratelimit/queued_digests");
+                zmsg_addstrf (reply, "%zu", delivery.digests.size ());
+                zmsg_addstr (reply, "ratelimit/queued_sms");
+                zmsg_addstrf (reply, "%zu", delivery.deferred_sms.size ());
+                zmsg_send (&reply, pipe);
             }
             else
             if (streq (cmd, "_MSMTP_TEST")) {
@@ -776,11 +1526,15 @@ fty_email_server (zsock_t *pipe, void* args)
                 if (rv == -1) {
                     zsys_error ("%s\t:can't connect on test_client, endpoint=%s", name, endpoint);
                 }
+                // called from DeliveryPool workers
+                std::shared_ptr <std::mutex> test_mutex = std::make_shared <std::mutex> ();
                 std::function <void (const std::string &)> cb = \
-                    [test_client, test_reader_name] (const std::string &data) {
+                    [test_client, test_reader_name, test_mutex] (const std::string &data) {
+                        std::lock_guard <std::mutex> lock (*test_mutex);
                         mlm_client_sendtox (test_client, test_reader_name, "btest", data.c_str (), NULL);
                     };
                 smtp.sendmail_set_test_fn (cb);
+                delivery.smtp = std::make_shared <Smtp> (smtp);
             }
             else
             {
@@ -811,53 +1565,43 @@ fty_email_server (zsock_t *pipe, void* args)
                 continue;
             }
 
-            zmsg_t *reply = zmsg_new ();
-            zmsg_addstr (reply, uuid);
-            zstr_free (&uuid);
-
-            if (topic == "SENDMAIL") {
-                bool sent_ok = false;
+            if (topic == "SENDMAIL" || topic == "SENDMAIL-ASYNC") {
+                // SENDMAIL-ASYNC is acknowledged as soon as the email is
+                // accepted, final reply comes once it is delivered
+                bool async = topic == "SENDMAIL-ASYNC";
+                std::string sender = mlm_client_sender (client);
                 try {
+                    PendingDelivery pending {PendingDelivery::SENDMAIL, {}, 0, sender, uuid, {}, 0, async};
+                    bool accepted;
                     if (zmsg_size (zmessage) == 1) {
                         char *body = zmsg_popstr (zmessage);
                         zsys_debug1 ("%s:\tsmtp.sendmail (%s)", name, body);
-                        smtp.sendmail (body);
+                        std::string mail = body;
                         zstr_free (&body);
+                        accepted = s_deliver (delivery, mail, pending);
                     }
                     else {
                         if (verbose)
                             zmsg_print (zmessage);
-                        auto mail = smtp.msg2email (&zmessage);
-                        if (verbose)
-                            zsys_debug (mail.c_str ());
-                        smtp.sendmail (mail);
+                        // attachments are not read into memory
+                        std::shared_ptr <const MimeWriter> mime = std::make_shared <MimeWriter> (smtp.msg2mime (&zmessage));
+                        accepted = s_deliver (delivery, mime, pending);
                     }
-                    zmsg_addstr (reply, "0");
-                    zmsg_addstr (reply, "OK");
-                    sent_ok = true;
+                    if (!accepted)
+                        s_sendmail_reply (client, sender, uuid, SmtpError::Unknown, "Delivery queue is full");
+                    else if (async && pending.spooled == 0)
+                        // spooled email is acknowledged once it is written
+                        s_sendmail_send (client, sender, "SENDMAIL-QUEUED", uuid, SmtpError::Succeeded, "QUEUED");
                 }
                 catch (const std::runtime_error &re) {
                     zsys_debug1 ("%s:\tgot std::runtime_error, e.what ()=%s", name, re.what ());
-                    sent_ok = false;
-                    uint32_t code = static_cast <uint32_t> (msmtp_stderr2code (re.what ()));
-                    zmsg_addstrf (reply, "%" PRIu32, code);
-                    zmsg_addstr (reply, re.what ());
+                    s_sendmail_reply (client, sender, uuid, smtp_error_code (re), re.what ());
                 }
-
-                int r = mlm_client_sendto (
-                        client,
-                        mlm_client_sender (client),
-                        sent_ok ? "SENDMAIL-OK" : "SENDMAIL-ERR",
-                        NULL,
-                        1000,
-                        &reply);
-                if (r == -1)
-                    zsys_error ("Can't send a reply for SENDMAIL to %s", mlm_client_sender (client));
             }
             else
                 zsys_warning ("%s:\tUnknown subject %s", name, topic.c_str ());
 
-            zmsg_destroy (&reply);
+            zstr_free (&uuid);
             zmsg_destroy (&zmessage);
             continue;
         }
@@ -873,11 +1617,14 @@ fty_email_server (zsock_t *pipe, void* args)
                 continue;
             }
             if (fty_proto_id (bmessage) == FTY_PROTO_ALERT)  {
-                s_onAlertReceive (&bmessage, alerts, elements, smtp);
-                save_alerts_state (alerts, alerts_state_file);
+                s_onAlertReceive (&bmessage, alerts, journal, scheduler, elements, delivery);
+                if (journal.needsCompaction (alerts.size ()))
+                    journal.save (alerts);
             }
             else if (fty_proto_id (bmessage) == FTY_PROTO_ASSET)  {
-                onAssetReceive (&bmessage, elements, sms_gateway, verbose);
+                onAssetReceive (&bmessage, elements, alerts, journal, scheduler, delivery, sms_gateway, verbose);
+                if (journal.needsCompaction (alerts.size ()))
+                    journal.save (alerts);
             }
             else {
                 zsys_error ("it is not an alert message, ignore it");
@@ -890,11 +1637,10 @@ fty_email_server (zsock_t *pipe, void* args)
     // save info to persistence before I die
     if (!sendmail_only)
         elements.save();
-    save_alerts_state (alerts, alerts_state_file);
+    journal.save (alerts);
     zstr_free (&name);
     zstr_free (&endpoint);
     zstr_free (&test_reader_name);
-    zstr_free (&alerts_state_file);
     zstr_free (&sms_gateway);
     zpoller_destroy (&poller);
     mlm_client_destroy (&client);
@@ -943,13 +1689,16 @@ static zactor_t* create_test_smtp_server (
 
     if ( clear_assets )
         std::remove (assets_file);
-    if ( clear_alerts )
+    if ( clear_alerts ) {
         std::remove (alerts_file);
+        std::remove ((std::string (alerts_file) + ".journal").c_str ());
+    }
     zactor_t *smtp_server = zactor_new (fty_email_server, NULL);
     assert ( smtp_server != NULL );
     zconfig_t *config = zconfig_new ("root", NULL);
     zconfig_put (config, "server/alerts", alerts_file);
     zconfig_put (config, "server/assets", assets_file);
+    zconfig_put (config, "server/flush_interval", "100");
     zconfig_put (config, "malamute/endpoint", endpoint);
     zconfig_put (config, "malamute/address", agent_name);
     zconfig_put (config, "malamute/consumers/ASSETS", ".*");
@@ -1080,26 +1829,44 @@ test9 (bool verbose, const char *endpoint)
     assert ( rv != -1 );
 
     zclock_sleep (1000); // let smtp process messages
-    alerts_map alerts;
-    int r = load_alerts_state (alerts, alerts_file);
+    AlertTable alerts;
+    AlertJournal journal;
+    journal.setFile (alerts_file);
+    int r = journal.load (alerts);
     assert ( r == 0 );
     assert ( alerts.size() == 1 );
     // rule name is internally changed to lowercase
-    Alert a = alerts.at(std::make_pair("some_rule","SOME_ASSET"));
+    Alert a = alerts.at("some_rule","SOME_ASSET");
     assert ( a.rule == "some_rule" );
     assert ( a.element == "SOME_ASSET" );
-    assert ( a.state == "ACTIVE" );
-    assert ( a.severity == "CRITICAL" );
+    assert ( a.state == AlertState::ACTIVE );
+    assert ( a.severity == AlertSeverity::CRITICAL );
     assert ( a.description == "ASDFKLHJH" );
     assert ( a.time == 123456 );
     assert ( a.last_email_notification == 0 );
     assert ( a.last_update > 0 );
 
+    // alerts of the deleted asset are forgotten
+    mlm_client_t *asset_producer = mlm_client_new ();
+    rv = mlm_client_connect (asset_producer, endpoint, 1000, "asset_producer_test9");
+    assert ( rv != -1 );
+    rv = mlm_client_set_producer (asset_producer, "ASSETS");
+    assert ( rv != -1 );
+    s_send_asset_message (verbose, asset_producer, "1", "scenario9@eaton.com", "eaton Support team", "create", "SOME_ASSET");
+    s_send_asset_message (verbose, asset_producer, NULL, NULL, NULL, "delete", "SOME_ASSET");
+    zclock_sleep (1000);
+    AlertTable alerts2;
+    r = journal.load (alerts2);
+    assert ( r == 0 );
+    assert ( alerts2.empty () );
+
     // clean up after
+    mlm_client_destroy (&asset_producer);
     mlm_client_destroy (&alert_producer);
     zactor_destroy (&smtp_server);
     zactor_destroy (&server);
     std::remove (alerts_file);
+    std::remove ((std::string (alerts_file) + ".journal").c_str ());
     std::remove (assets_file);
     zstr_free (&alerts_file);
     zstr_free (&assets_file);
@@ -1349,6 +2116,7 @@ fty_email_server_test (bool verbose)
     char *assets_file = zsys_sprintf ("%s/kkk_assets.xtx", SELFTEST_DIR_RW);
     assert (assets_file!=NULL);
     std::remove (alerts_file);
+    std::remove ((std::string (alerts_file) + ".journal").c_str ());
     std::remove (assets_file);
 
     char *pidfile = zsys_sprintf ("%s/btest.pid", SELFTEST_DIR_RW);
@@ -1451,6 +2219,7 @@ fty_email_server_test (bool verbose)
     zconfig_t *config = zconfig_new ("root", NULL);
     zconfig_put (config, "server/alerts", alerts_file);
     zconfig_put (config, "server/assets", assets_file);
+    zconfig_put (config, "server/flush_interval", "100");
     zconfig_put (config, "malamute/endpoint", endpoint);
     zconfig_put (config, "malamute/address", "agent-smtp");
     zconfig_put (config, "malamute/consumers/ASSETS", ".*");
@@ -1465,6 +2234,20 @@ fty_email_server_test (bool verbose)
     if ( verbose )
         zsys_info ("smtp server started");
 
+    // msmtp transport does not use the connection pool
+    zstr_send (smtp_server, "STATS");
+    {
+        zmsg_t *stats = zmsg_recv (smtp_server);
+        assert (zmsg_size (stats) == 22);
+        char *key = zmsg_popstr (stats);
+        char *value = zmsg_popstr (stats);
+        assert (streq (key, "smtp/pool_hits"));
+        assert (streq (value, "0"));
+        zstr_free (&key);
+        zstr_free (&value);
+        zmsg_destroy (&stats);
+    }
+
     mlm_client_t *alert_producer = mlm_client_new ();
     int rv = mlm_client_connect (alert_producer, endpoint, 1000, "alert_producer");
     assert( rv != -1 );
@@ -1942,6 +2725,42 @@ fty_email_server_test (bool verbose)
         zmsg_print (msg);
     zmsg_destroy (&msg);
 
+    //test SENDMAIL-ASYNC, both requests in flight, each one is acknowledged
+    //before its final reply
+    rv = mlm_client_sendtox (alert_producer, "agent-smtp", "SENDMAIL-ASYNC", "UUID-1", "foo@bar", "Subject", "body", NULL);
+    assert (rv != -1);
+    rv = mlm_client_sendtox (alert_producer, "agent-smtp", "SENDMAIL-ASYNC", "UUID-2", "foo@bar", "Subject", "body", NULL);
+    assert (rv != -1);
+    {
+        std::map <std::string, std::string> last;
+        for (int i = 0; i != 4; i++) {
+            msg = mlm_client_recv (alert_producer);
+            assert (msg);
+            assert (zmsg_size (msg) == 3);
+            uuid = zmsg_popstr (msg);
+            code = zmsg_popstr (msg);
+            assert (streq (code, "0"));
+            std::string subject = mlm_client_subject (alert_producer);
+            if (subject == "SENDMAIL-QUEUED")
+                assert (last [uuid].empty ());
+            else {
+                assert (subject == "SENDMAIL-OK");
+                assert (last [uuid] == "SENDMAIL-QUEUED");
+            }
+            last [uuid] = subject;
+            zstr_free (&code);
+            zstr_free (&uuid);
+            zmsg_destroy (&msg);
+        }
+        assert (last.size () == 2);
+        assert (last ["UUID-1"] == "SENDMAIL-OK");
+        assert (last ["UUID-2"] == "SENDMAIL-OK");
+    }
+    for (int i = 0; i != 2; i++) {
+        msg = mlm_client_recv (btest_reader);
+        zmsg_destroy (&msg);
+    }
+
     //MVY: this test leaks memory - in general it's a bad idea to publish
     //messages to broker without reading them :)
     //test9 (verbose, "ipc://bios-smtp-server-test9");
@@ -35,6 +35,8 @@
 #include "fty_email_classes.h"
 
 #include <getopt.h>
+#include <fcntl.h>
+#include <libgen.h>
 
 void usage ()
 {
@@ -42,6 +44,8 @@ void usage ()
           "  -c|--config           path to fty-email config file\n"
           "  -s|--subject          mail subject\n"
           "  -a|--attachment       path to file to be attached to email\n"
+          "  -q|--queued           do not wait for delivery, exit once email is queued\n"
+          "  -i|--inline           send attachments in the message, not their paths\n"
           "Send email through fty-email to given recipients in email body.\n"
           "Email body is read from stdin\n"
           "\n"
@@ -53,6 +57,8 @@ int main (int argc, char** argv)
 
     int help = 0;
     int verbose = 0;
+    int queued = 0;
+    int inline_ = 0;
     std::vector<std::string> attachments;
     const char *recipient = NULL;
     std::string subj;
@@ -64,11 +70,13 @@ int main (int argc, char** argv)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
 #endif
-    static const char *short_options = "vc:s:a:";
+    static const char *short_options = "vqic:s:a:";
     static struct option long_options[] =
     {
         {"help",       no_argument,       &help,    1},
         {"verbose",    no_argument,       &verbose, 1},
+        {"queued",     no_argument,       &queued,  1},
+        {"inline",     no_argument,       &inline_, 1},
         {"config",     required_argument, 0,'c'},
         {"subject",    required_argument, 0,'s'},
         {"attachment", required_argument, 0,'a'},
@@ -90,6 +98,12 @@ int main (int argc, char** argv)
         case 'v':
             verbose = 1;
             break;
+        case 'q':
+            queued = 1;
+            break;
+        case 'i':
+            inline_ = 1;
+            break;
         case 'c':
             config_file = optarg;
             break;
@@ -152,22 +166,43 @@ int main (int argc, char** argv)
     assert (r != -1);
 
     std::string body = read_all (STDIN_FILENO);
-    zmsg_t *mail = fty_email_encode (
+    // inline attachments do not need to be readable by fty-email
+    std::vector <std::string> names;
+    std::vector <std::string> contents;
+    std::vector <fty_email_attachment_t> files;
+    for (const auto& file : attachments) {
+        if (!inline_) {
+            files.push_back ({file.c_str (), NULL, 0, -1});
+            continue;
+        }
+        int fd = open (file.c_str (), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            zsys_error ("Can't read %s: %s", file.c_str (), strerror (errno));
+            exit (EXIT_FAILURE);
+        }
+        contents.push_back (read_all (fd));
+        close (fd);
+        // POSIX basename can modify its argument
+        std::vector <char> path (file.begin (), file.end ());
+        path.push_back ('\0');
+        names.push_back (basename (path.data ()));
+    }
+    for (size_t i = 0; i != contents.size (); i++)
+        files.push_back ({names [i].c_str (), contents [i].data (), contents [i].size (), -1});
+    zmsg_t *mail = fty_email_encode_attachments (
         "UUID",
         recipient,
         subj.c_str (),
         NULL,
         body.c_str (),
-        NULL
+        files.data (),
+        files.size ()
         );
 
-    for (const auto file : attachments) {
-        zmsg_addstr (mail, file.c_str());
-    }
-
     if (verbose)
         zmsg_print (mail);
-    r = mlm_client_sendto (client, smtp_address, "SENDMAIL", NULL, 2000, &mail);
+    // SENDMAIL-ASYNC is acknowledged by SENDMAIL-QUEUED before the delivery
+    r = mlm_client_sendto (client, smtp_address, queued ? "SENDMAIL-ASYNC" : "SENDMAIL", NULL, 2000, &mail);
     zstr_free (&smtp_address);
     if (r == -1) {
         zsys_error ("Failed to send the email (mlm_client_sendto returned -1).");
@@ -0,0 +1,331 @@
+/*  =========================================================================
+    jsonwriter - Streaming writer of compact JSON
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    jsonwriter - Streaming writer of compact JSON
+@discuss
+    No document tree is built, values are escaped straight into the buffer,
+    which is written to the file descriptor whenever it is full.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cinttypes>
+
+JsonWriter::JsonWriter () :
+    _fd (-1),
+    _own (true),
+    _errno (0),
+    _path (),
+    _first (true),
+    _after_key (false),
+    _len (0)
+{
+}
+
+JsonWriter::JsonWriter (int fd) :
+    _fd (fd),
+    _own (false),
+    _errno (0),
+    _path (),
+    _first (true),
+    _after_key (false),
+    _len (0)
+{
+}
+
+JsonWriter::~JsonWriter ()
+{
+    if (_own && _fd != -1) {
+        // not committed
+        ::close (_fd);
+        std::remove ((_path + ".new").c_str ());
+    }
+}
+
+int JsonWriter::open (const std::string& path)
+{
+    _path = path;
+    std::string tmp = path + ".new";
+    _fd = ::open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd == -1) {
+        zsys_error ("Cannot open file '%s' for write: %s", tmp.c_str (), strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+int JsonWriter::flush ()
+{
+    const char *p = _buffer;
+    size_t size = _len;
+    _len = 0;
+    while (size > 0 && _errno == 0) {
+        ssize_t r = ::write (_fd, p, size);
+        if (r == -1) {
+            if (errno != EINTR)
+                _errno = errno;
+            continue;
+        }
+        p += r;
+        size -= r;
+    }
+    return _errno == 0 ? 0 : -1;
+}
+
+int JsonWriter::commit ()
+{
+    std::string tmp = _path + ".new";
+    if (flush () != 0 || fsync (_fd) != 0) {
+        zsys_error ("Cannot write file '%s': %s", tmp.c_str (), strerror (_errno ? _errno : errno));
+        return -1;
+    }
+    ::close (_fd);
+    _fd = -1;
+    if (std::rename (tmp.c_str (), _path.c_str ()) != 0) {
+        zsys_error ("Cannot rename file '%s' to '%s': %s", tmp.c_str (), _path.c_str (), strerror (errno));
+        std::remove (tmp.c_str ());
+        return -1;
+    }
+    return 0;
+}
+
+void JsonWriter::put (const char *s, size_t size)
+{
+    while (size > 0) {
+        if (_len == sizeof (_buffer))
+            flush ();
+        size_t n = std::min (size, sizeof (_buffer) - _len);
+        memcpy (_buffer + _len, s, n);
+        _len += n;
+        s += n;
+        size -= n;
+    }
+}
+
+void JsonWriter::separator ()
+{
+    if (_after_key)
+        _after_key = false;
+    else
+    if (!_first)
+        put (',');
+    _first = false;
+}
+
+void JsonWriter::string (const char *s, size_t size)
+{
+    static const char hex [] = "0123456789abcdef";
+    put ('"');
+    const char *plain = s;
+    for (const char *end = s + size; s != end; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        put (plain, s - plain);
+        plain = s + 1;
+        put ('\\');
+        switch (c) {
+            case '"':  put ('"'); break;
+            case '\\': put ('\\'); break;
+            case '\n': put ('n'); break;
+            case '\r': put ('r'); break;
+            case '\t': put ('t'); break;
+            case '\b': put ('b'); break;
+            case '\f': put ('f'); break;
+            default:
+                put ("u00", 3);
+                put (hex [c >> 4]);
+                put (hex [c & 0xf]);
+        }
+    }
+    put (plain, s - plain);
+    put ('"');
+}
+
+JsonWriter& JsonWriter::beginObject ()
+{
+    separator ();
+    put ('{');
+    _first = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endObject ()
+{
+    put ('}');
+    _first = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::beginArray ()
+{
+    separator ();
+    put ('[');
+    _first = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::endArray ()
+{
+    put (']');
+    _first = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::key (const char *name)
+{
+    separator ();
+    string (name, strlen (name));
+    put (':');
+    _after_key = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value (const std::string& s)
+{
+    separator ();
+    string (s.data (), s.size ());
+    return *this;
+}
+
+JsonWriter& JsonWriter::value (const char *s)
+{
+    separator ();
+    string (s, strlen (s));
+    return *this;
+}
+
+JsonWriter& JsonWriter::value (uint64_t n)
+{
+    separator ();
+    char buf [24];
+    int size = snprintf (buf, sizeof (buf), "%" PRIu64, n);
+    put (buf, size);
+    return *this;
+}
+
+JsonWriter& JsonWriter::newline ()
+{
+    put ('\n');
+    _first = true;
+    return *this;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static std::string
+s_read (const std::string& path)
+{
+    std::string ret;
+    FILE *f = fopen (path.c_str (), "r");
+    assert (f);
+    int c;
+    while ((c = fgetc (f)) != EOF)
+        ret.push_back (c);
+    fclose (f);
+    return ret;
+}
+
+void
+jsonwriter_test (bool verbose)
+{
+    printf (" * jsonwriter: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string path = std::string (SELFTEST_DIR_RW) + "/jsonwriter.json";
+    std::remove (path.c_str ());
+
+    {
+    JsonWriter json;
+    assert (json.open (path) == 0);
+    json.beginArray ();
+    json.beginObject ()
+        .key ("key").beginObject ().member ("first", "rule").member ("second", "ups").endObject ()
+        .key ("value").beginObject ()
+            .member ("description", std::string ("\"quoted\"\\\n\t\x01"))
+            .member ("time", (uint64_t) 18446744073709551615ULL)
+            .key ("empty").beginArray ().endArray ()
+            .endObject ()
+        .endObject ();
+    json.beginObject ().endObject ();
+    json.value ("x");
+    json.endArray ();
+    // nothing is visible before commit
+    FILE *f = fopen (path.c_str (), "r");
+    assert (!f);
+    assert (json.commit () == 0);
+    }
+    assert (s_read (path) ==
+        "[{\"key\":{\"first\":\"rule\",\"second\":\"ups\"},"
+        "\"value\":{\"description\":\"\\\"quoted\\\"\\\\\\n\\t\\u0001\","
+        "\"time\":18446744073709551615,\"empty\":[]}},{},\"x\"]");
+
+    {
+    // document bigger than the buffer
+    JsonWriter json;
+    assert (json.open (path) == 0);
+    std::string big (10000, 'a');
+    json.beginArray ().value (big).value (big).endArray ();
+    assert (json.commit () == 0);
+    }
+    assert (s_read (path) == "[\"" + std::string (10000, 'a') + "\",\"" + std::string (10000, 'a') + "\"]");
+
+    {
+    // abandoned writer leaves the file alone
+    JsonWriter json;
+    assert (json.open (path) == 0);
+    json.beginArray ();
+    }
+    assert (s_read (path).size () == 20007);
+    FILE *f = fopen ((path + ".new").c_str (), "r");
+    assert (!f);
+
+    {
+    // JSON Lines to opened fd
+    int fd = ::open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    assert (fd != -1);
+    JsonWriter json (fd);
+    json.beginObject ().member ("op", "erase").endObject ().newline ();
+    json.beginObject ().member ("op", "update").endObject ().newline ();
+    assert (json.flush () == 0);
+    ::close (fd);
+    }
+    assert (s_read (path) == "{\"op\":\"erase\"}\n{\"op\":\"update\"}\n");
+
+    std::remove (path.c_str ());
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,100 @@
+/*  =========================================================================
+    jsonwriter - Streaming writer of compact JSON
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef JSONWRITER_H_INCLUDED
+#define JSONWRITER_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+/**
+ * \class JsonWriter
+ *
+ * \brief Writes compact JSON to file descriptor through fixed buffer
+ *
+ * Memory used does not depend on the size of the document. Errors are
+ * sticky, they are reported by flush () or commit () at the end.
+ *
+ * Example:
+ *
+ *    JsonWriter json;
+ *    if (json.open (path) != 0)
+ *        return -1;
+ *    json.beginArray ();
+ *    json.beginObject ().member ("name", name).member ("time", time).endObject ();
+ *    json.endArray ();
+ *    return json.commit ();
+ */
+class JsonWriter
+{
+ public:
+    // writer of '<path>.new', see commit ()
+    JsonWriter ();
+    // writer to already opened fd, which is not closed by the writer
+    JsonWriter (int fd);
+    ~JsonWriter ();
+
+    // opens '<path>.new' for write, returns 0 on success
+    int     open (const std::string& path);
+    // flushes, fsyncs and renames '<path>.new' to path, returns 0 on success
+    int     commit ();
+    // writes the buffer to fd, returns 0 on success
+    int     flush ();
+
+    JsonWriter& beginObject ();
+    JsonWriter& endObject ();
+    JsonWriter& beginArray ();
+    JsonWriter& endArray ();
+    JsonWriter& key (const char *name);
+    JsonWriter& value (const std::string& s);
+    JsonWriter& value (const char *s);
+    JsonWriter& value (uint64_t n);
+    // ends the top level value by LF, next one starts a new line (JSON Lines)
+    JsonWriter& newline ();
+
+    template <typename T>
+    JsonWriter& member (const char *name, const T& v) { return key (name).value (v); }
+
+ private:
+    void    separator ();
+    void    put (char c) { if (_len == sizeof (_buffer)) flush (); _buffer [_len++] = c; }
+    void    put (const char *s, size_t size);
+    void    string (const char *s, size_t size);
+
+    int _fd;
+    bool _own;
+    int _errno;
+    std::string _path;
+    bool _first;
+    bool _after_key;
+    size_t _len;
+    char _buffer [4096];
+
+    JsonWriter (const JsonWriter&) = delete;
+    JsonWriter& operator= (const JsonWriter&) = delete;
+};
+
+//  Self test of this class
+void
+    jsonwriter_test (bool verbose);
+
+#endif
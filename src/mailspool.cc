@@ -0,0 +1,430 @@
+/*  =========================================================================
+    mailspool - Durable spool of outgoing emails
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    mailspool - Durable spool of outgoing emails
+@discuss
+    Without the spool, notification which failed because of relay outage
+    was lost. Spooled emails survive restart and they are sent in order
+    once the relay is back.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <cinttypes>
+
+static const char SPOOL_MAGIC [] = "FTYSPOOL1\n";
+static const char SPOOL_SUFFIX [] = ".mail";
+
+static int
+s_write (int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t r = ::write (fd, data, size);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += r;
+        size -= r;
+    }
+    return 0;
+}
+
+// Read the header of spooled email, begin is the offset of meta data
+static int
+s_read_head (int fd, uint64_t& begin, uint64_t& size)
+{
+    // magic and the size of meta data
+    char head [sizeof (SPOOL_MAGIC) + 24];
+    ssize_t r = ::pread (fd, head, sizeof (head) - 1, 0);
+    size_t magic = sizeof (SPOOL_MAGIC) - 1;
+    if (r < (ssize_t) magic || memcmp (head, SPOOL_MAGIC, magic) != 0)
+        return -1;
+    head [r] = '\0';
+    char *eol = strchr (head + magic, '\n');
+    if (!eol)
+        return -1;
+    begin = eol + 1 - head;
+    size = strtoull (head + magic, NULL, 10);
+    return 0;
+}
+
+MailSpool::MailSpool () :
+    _lock (-1),
+    _last (0),
+    _retry_at (0),
+    _backoff (0),
+    _backoff_min (5000),
+    _backoff_max (10 * 60 * 1000)
+{
+}
+
+static std::string
+s_file (const std::string& dir, uint64_t seq)
+{
+    char name [32];
+    snprintf (name, sizeof (name), "/%016" PRIx64 "%s", seq, SPOOL_SUFFIX);
+    return dir + name;
+}
+
+std::string MailSpool::file (uint64_t seq) const
+{
+    return s_file (_path, seq);
+}
+
+MailSpool::~MailSpool ()
+{
+    close ();
+}
+
+void MailSpool::close ()
+{
+    if (_lock != -1)
+        ::close (_lock);
+    _lock = -1;
+    _path.clear ();
+    _seqs.clear ();
+    _last = 0;
+}
+
+int MailSpool::open (const std::string& path)
+{
+    close ();
+    if (zsys_dir_create (path.c_str ()) != 0) {
+        zsys_error ("Cannot create spool directory '%s'", path.c_str ());
+        return -1;
+    }
+    // sequence numbers and replay of emails are of one owner only
+    int lock = ::open (path.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lock == -1 || flock (lock, LOCK_EX | LOCK_NB) != 0) {
+        zsys_error ("Cannot lock spool directory '%s': %s", path.c_str (),
+            errno == EWOULDBLOCK ? "used by another spool" : strerror (errno));
+        if (lock != -1)
+            ::close (lock);
+        return -1;
+    }
+    DIR *dir = opendir (path.c_str ());
+    if (!dir) {
+        zsys_error ("Cannot read spool directory '%s': %s", path.c_str (), strerror (errno));
+        ::close (lock);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL) {
+        char *end;
+        uint64_t seq = strtoull (entry->d_name, &end, 16);
+        if (seq == 0 || end != entry->d_name + 16 || strcmp (end, SPOOL_SUFFIX) != 0)
+            continue;
+        _seqs.insert (seq);
+        if (seq > _last)
+            _last = seq;
+    }
+    closedir (dir);
+    _path = path;
+    _lock = lock;
+    return 0;
+}
+
+uint64_t MailSpool::add (const std::string& meta, const std::string& data)
+{
+    return add (meta, [&data] (const SmtpSink& sink) { sink (data.data (), data.size ()); });
+}
+
+uint64_t MailSpool::add (const std::string& meta, const SmtpSource& data)
+{
+    uint64_t seq = reserve ();
+    if (write (_path, seq, meta, data) != 0) {
+        remove (seq);
+        return 0;
+    }
+    return seq;
+}
+
+uint64_t MailSpool::reserve ()
+{
+    uint64_t seq = ++_last;
+    _seqs.insert (seq);
+    return seq;
+}
+
+int MailSpool::write (const std::string& dir, uint64_t seq, const std::string& meta, const SmtpSource& data)
+{
+    std::string path = s_file (dir, seq);
+    std::string tmp = path + ".new";
+    int fd = ::open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        zsys_error ("Cannot open file '%s' for write: %s", tmp.c_str (), strerror (errno));
+        return -1;
+    }
+    std::string size = std::to_string (meta.size ()) + "\n";
+    std::string error;
+    if (s_write (fd, SPOOL_MAGIC, sizeof (SPOOL_MAGIC) - 1) != 0
+    ||  s_write (fd, size.data (), size.size ()) != 0
+    ||  s_write (fd, meta.data (), meta.size ()) != 0)
+        error = strerror (errno);
+    if (error.empty ()) {
+        try {
+            data ([fd] (const char *buf, size_t size) {
+                if (s_write (fd, buf, size) != 0)
+                    throw std::runtime_error (strerror (errno));
+            });
+        }
+        catch (const std::runtime_error &e) {
+            error = e.what ();
+        }
+    }
+    if (error.empty () && fsync (fd) != 0)
+        error = strerror (errno);
+    if (!error.empty ()) {
+        zsys_error ("Cannot write file '%s': %s", tmp.c_str (), error.c_str ());
+        ::close (fd);
+        std::remove (tmp.c_str ());
+        return -1;
+    }
+    ::close (fd);
+    if (std::rename (tmp.c_str (), path.c_str ()) != 0) {
+        zsys_error ("Cannot rename file '%s' to '%s': %s", tmp.c_str (), path.c_str (), strerror (errno));
+        std::remove (tmp.c_str ());
+        return -1;
+    }
+    // make the rename durable
+    int dirfd = ::open (dir.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd != -1) {
+        fsync (dirfd);
+        ::close (dirfd);
+    }
+    return 0;
+}
+
+int MailSpool::readMeta (uint64_t seq, std::string& meta) const
+{
+    int fd = ::open (file (seq).c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    uint64_t begin, size;
+    int ret = s_read_head (fd, begin, size);
+    if (ret == 0) {
+        meta.resize (size);
+        size_t done = 0;
+        while (done < size) {
+            ssize_t r = ::pread (fd, &meta [done], size - done, begin + done);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                ret = -1;
+                break;
+            }
+            done += r;
+        }
+    }
+    ::close (fd);
+    return ret;
+}
+
+int MailSpool::locate (uint64_t seq, std::string& path, uint64_t& offset) const
+{
+    path = file (seq);
+    int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    uint64_t begin, size;
+    int ret = s_read_head (fd, begin, size);
+    ::close (fd);
+    if (ret != 0)
+        return -1;
+    offset = begin + size;
+    return 0;
+}
+
+void MailSpool::remove (uint64_t seq)
+{
+    if (_seqs.erase (seq) == 0)
+        return;
+    std::string path = file (seq);
+    // email which failed to be written is not there
+    if (std::remove (path.c_str ()) != 0 && errno != ENOENT)
+        zsys_error ("Cannot remove file '%s': %s", path.c_str (), strerror (errno));
+}
+
+bool MailSpool::retryable (SmtpError code)
+{
+    return code == SmtpError::ServerUnreachable
+        || code == SmtpError::DNSFailed;
+}
+
+void MailSpool::failed (int64_t now)
+{
+    // emails sent before the outage was noticed fail too
+    if (_retry_at != 0 && now < _retry_at)
+        return;
+    _backoff = _backoff == 0 ? _backoff_min : std::min (_backoff * 2, _backoff_max);
+    _retry_at = now + _backoff;
+}
+
+void MailSpool::succeeded ()
+{
+    _backoff = 0;
+    _retry_at = 0;
+}
+
+void MailSpool::setBackoff (int64_t min, int64_t max)
+{
+    _backoff_min = min > 0 ? min : 1;
+    _backoff_max = max > _backoff_min ? max : _backoff_min;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+mailspool_test (bool verbose)
+{
+    printf (" * mailspool: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string path = std::string (SELFTEST_DIR_RW) + "/mailspool";
+
+    {
+        MailSpool spool;
+        assert (!spool.isOpen ());
+        assert (spool.open (path) == 0);
+        for (uint64_t seq : std::set <uint64_t> (spool.list ()))
+            spool.remove (seq);
+        assert (spool.size () == 0);
+    }
+
+    MailSpool spool;
+    assert (spool.open (path) == 0);
+    uint64_t first = spool.add ("meta1", "To: joe@example.com\r\n\r\nfirst\r\n");
+    uint64_t second = spool.add ("", "second");
+    uint64_t third = spool.add ("meta\n3", "");
+    assert (first != 0 && first < second && second < third);
+
+    // directory has one owner
+    MailSpool restarted;
+    assert (restarted.open (path) == -1);
+    assert (!restarted.isOpen ());
+    spool.close ();
+    assert (!spool.isOpen ());
+
+    // emails survive restart, order is kept
+    assert (restarted.open (path) == 0);
+    assert (spool.open (path) == -1);
+    assert (restarted.size () == 3);
+    assert (*restarted.list ().begin () == first);
+    auto data = [&restarted] (uint64_t seq) {
+        std::string path;
+        uint64_t offset = 0;
+        assert (restarted.locate (seq, path, offset) == 0);
+        return MimeWriter::raw (path, offset).str ();
+    };
+    std::string meta;
+    assert (restarted.readMeta (first, meta) == 0);
+    assert (meta == "meta1");
+    assert (data (first) == "To: joe@example.com\r\n\r\nfirst\r\n");
+    assert (restarted.readMeta (second, meta) == 0);
+    assert (meta.empty ());
+    assert (data (second) == "second");
+    assert (restarted.readMeta (third, meta) == 0);
+    assert (meta == "meta\n3");
+    assert (data (third).empty ());
+    std::string path_first;
+    uint64_t offset = 0;
+    restarted.remove (first);
+    assert (restarted.readMeta (first, meta) == -1);
+    assert (restarted.locate (first, path_first, offset) == -1);
+    uint64_t fourth = restarted.add ("", "fourth");
+    assert (fourth > third);
+    // email written in pieces, incomplete one is not spooled
+    uint64_t fifth = restarted.add ("meta5", [] (const SmtpSink& sink) { sink ("fi", 2); sink ("fth", 3); });
+    assert (restarted.readMeta (fifth, meta) == 0);
+    assert (meta == "meta5");
+    assert (data (fifth) == "fifth");
+    assert (restarted.add ("", [] (const SmtpSink& sink) {
+        sink ("six", 3);
+        throw std::runtime_error ("Cannot read attachment");
+    }) == 0);
+    assert (restarted.size () == 4);
+    // written by another thread
+    uint64_t seventh = restarted.reserve ();
+    assert (seventh > fifth);
+    std::string dir = restarted.path ();
+    int written = -1;
+    std::thread writer ([&] {
+        written = MailSpool::write (dir, seventh, "meta7", [] (const SmtpSink& sink) { sink ("seventh", 7); });
+    });
+    writer.join ();
+    assert (written == 0);
+    assert (restarted.readMeta (seventh, meta) == 0);
+    assert (data (seventh) == "seventh");
+    restarted.remove (seventh);
+    // not written one is removed quietly
+    uint64_t eighth = restarted.reserve ();
+    assert (restarted.size () == 5);
+    restarted.remove (eighth);
+    assert (restarted.size () == 4);
+    restarted.remove (fifth);
+    restarted.remove (second);
+    restarted.remove (third);
+    restarted.remove (fourth);
+    assert (restarted.size () == 0);
+
+    // retry policy
+    assert (MailSpool::retryable (SmtpError::ServerUnreachable));
+    assert (MailSpool::retryable (SmtpError::DNSFailed));
+    assert (!MailSpool::retryable (SmtpError::AuthFailed));
+    assert (!MailSpool::retryable (SmtpError::NoRecipient));
+    spool.setBackoff (1000, 3000);
+    assert (spool.retryAt () == 0);
+    spool.failed (100);
+    assert (spool.retryAt () == 1100);
+    spool.failed (500);
+    assert (spool.retryAt () == 1100);
+    spool.failed (1100);
+    assert (spool.retryAt () == 3100);
+    spool.failed (3100);
+    assert (spool.retryAt () == 6100);
+    spool.succeeded ();
+    assert (spool.retryAt () == 0);
+    spool.failed (10000);
+    assert (spool.retryAt () == 11000);
+
+    zsys_dir_delete (path.c_str ());
+    //  @end
+    printf ("OK\n");
+}
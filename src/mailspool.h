@@ -0,0 +1,134 @@
+/*  =========================================================================
+    mailspool - Durable spool of outgoing emails
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef MAILSPOOL_H_INCLUDED
+#define MAILSPOOL_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <set>
+
+#include "email.h"
+
+/**
+ * \class MailSpool
+ *
+ * \brief Directory of rendered emails waiting for delivery
+ *
+ * Each email is one file <seq>.mail, written to .new file, fsynced and
+ * renamed, so it is either complete or not there after a crash. Sequence
+ * numbers give the order of emails, also across restarts. Besides the
+ * email DATA, the file keeps opaque meta data of the caller.
+ *
+ * The directory is locked (flock) while it is open, so two spools, e.g.
+ * two actors with the same configuration, cannot take each other's
+ * emails.
+ *
+ * Spool also tracks the retry schedule. Once delivery fails on error
+ * which may go away (relay is not reachable), retries back off
+ * exponentially until a delivery succeeds.
+ *
+ * Example:
+ *
+ *    spool.open ("/var/spool/fty-email");
+ *    uint64_t seq = spool.add (meta, data);
+ *    ...
+ *    spool.locate (seq, path, offset);
+ *    pool.submit (smtp, std::make_shared <MimeWriter> (MimeWriter::raw (path, offset)));
+ *    ...
+ *    if (result.code == SmtpError::Succeeded)
+ *        spool.remove (seq), spool.succeeded ();
+ *    else
+ *    if (MailSpool::retryable (result.code))
+ *        spool.failed (zclock_mono ());
+ */
+class MailSpool
+{
+ public:
+    MailSpool ();
+    ~MailSpool ();
+
+    // creates and locks the directory, reads the list of spooled emails
+    // returns 0 on success, -1 on error or if the directory is locked
+    int     open (const std::string& path);
+    bool    isOpen () const { return !_path.empty (); }
+    // unlocks the directory, emails stay there
+    void    close ();
+
+    // writes the email, returns its sequence number or 0 on error
+    uint64_t add (const std::string& meta, const std::string& data);
+    // same for email written in pieces, e.g. by MimeWriter
+    uint64_t add (const std::string& meta, const SmtpSource& data);
+    // add in two steps, so the email can be rendered and written by
+    // another thread: reserve () the sequence number, then write () it,
+    // which is thread safe, remove () it if write () fails
+    uint64_t reserve ();
+    // writes the email into spool directory dir, returns 0 on success
+    static int write (const std::string& dir, uint64_t seq, const std::string& meta, const SmtpSource& data);
+    const std::string& path () const { return _path; }
+    // reads meta data of the email only
+    // returns 0 on success, -1 if the email cannot be read
+    int     readMeta (uint64_t seq, std::string& meta) const;
+    // where the email DATA starts, for reading it without loading the
+    // whole file, see MimeWriter::raw ()
+    // returns 0 on success, -1 if the email cannot be read
+    int     locate (uint64_t seq, std::string& path, uint64_t& offset) const;
+    void    remove (uint64_t seq);
+
+    // sequence numbers of spooled emails, in order
+    const std::set <uint64_t>& list () const { return _seqs; }
+    size_t  size () const { return _seqs.size (); }
+
+    // true for errors worth a retry, e.g. relay is not reachable
+    static bool retryable (SmtpError code);
+
+    // delivery failed on retryable error at 'now' [ms], backs off,
+    // failures before the next retry do not prolong it
+    void    failed (int64_t now);
+    // delivery succeeded, retries are not delayed anymore
+    void    succeeded ();
+    // time [ms] of the next retry, 0 if not backing off
+    int64_t retryAt () const { return _retry_at; }
+    // initial and maximal delay [ms] between retries
+    void    setBackoff (int64_t min, int64_t max);
+
+ private:
+    std::string file (uint64_t seq) const;
+
+    std::string _path;
+    // descriptor of the directory holding the lock
+    int _lock;
+    std::set <uint64_t> _seqs;
+    uint64_t _last;
+    int64_t _retry_at;
+    int64_t _backoff;
+    int64_t _backoff_min;
+    int64_t _backoff_max;
+
+    MailSpool (const MailSpool&) = delete;
+    MailSpool& operator= (const MailSpool&) = delete;
+};
+
+//  Self test of this class
+void
+    mailspool_test (bool verbose);
+
+#endif
@@ -0,0 +1,503 @@
+/*  =========================================================================
+    mimeencoder - Base64 and quoted-printable encoders of MIME parts
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    mimeencoder - Base64 and quoted-printable encoders of MIME parts
+@discuss
+    Support bundles carry megabytes of binary attachments, so base64 shows
+    up in profiles. On x86 the encoder uses SSSE3 or AVX2 (12 or 24 bytes
+    per step, after W. Mula and D. Lemire, "Faster Base64 Encoding and
+    Decoding using AVX2 Instructions"). The implementation is chosen at
+    runtime, so the package is still built for the baseline CPU. SSE2
+    alone lacks the byte shuffle the algorithm needs, so the 128-bit
+    variant requires SSSE3.
+
+    Selftest prints the throughput of all implementations when verbose,
+    along with cxxtools::MimeMultipart, which encoded attachments before.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <sstream>
+#include <cxxtools/mime.h>
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#   define MIMEENCODER_X86 1
+#   include <immintrin.h>
+#endif
+
+static const char BASE64_ALPHABET [] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// bytes of input per line of output
+static const size_t LINE = 57;
+
+// Encode whole groups of 3 bytes, returns the end of output
+static char *
+s_base64_scalar (const unsigned char *data, size_t size, char *out)
+{
+    for (size_t i = 0; i + 3 <= size; i += 3) {
+        uint32_t n = (data [i] << 16) | (data [i+1] << 8) | data [i+2];
+        *out++ = BASE64_ALPHABET [(n >> 18) & 63];
+        *out++ = BASE64_ALPHABET [(n >> 12) & 63];
+        *out++ = BASE64_ALPHABET [(n >> 6) & 63];
+        *out++ = BASE64_ALPHABET [n & 63];
+    }
+    return out;
+}
+
+// Encode the rest of 1 or 2 bytes with padding
+static char *
+s_base64_tail (const unsigned char *data, size_t size, char *out)
+{
+    if (size == 0)
+        return out;
+    uint32_t n = data [0] << 16;
+    if (size > 1)
+        n |= data [1] << 8;
+    *out++ = BASE64_ALPHABET [(n >> 18) & 63];
+    *out++ = BASE64_ALPHABET [(n >> 12) & 63];
+    *out++ = size > 1 ? BASE64_ALPHABET [(n >> 6) & 63] : '=';
+    *out++ = '=';
+    return out;
+}
+
+#ifdef MIMEENCODER_X86
+
+// 6-bit indices to ASCII, 16 at once
+__attribute__ ((target ("ssse3"))) static inline __m128i
+s_lookup_ssse3 (__m128i indices)
+{
+    const __m128i shift = _mm_setr_epi8 (
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    __m128i result = _mm_subs_epu8 (indices, _mm_set1_epi8 (51));
+    __m128i less = _mm_cmpgt_epi8 (_mm_set1_epi8 (26), indices);
+    result = _mm_or_si128 (result, _mm_and_si128 (less, _mm_set1_epi8 (13)));
+    return _mm_add_epi8 (_mm_shuffle_epi8 (shift, result), indices);
+}
+
+// 12 bytes of input to 16 characters, reads 16 bytes
+__attribute__ ((target ("ssse3"))) static inline void
+s_block_ssse3 (const unsigned char *data, char *out)
+{
+    __m128i in = _mm_loadu_si128 (reinterpret_cast <const __m128i *> (data));
+    // each 32-bit lane gets 3 bytes as b1 b0 b2 b1
+    in = _mm_shuffle_epi8 (in, _mm_setr_epi8 (1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    // move four 6-bit fields to separate bytes
+    __m128i t0 = _mm_and_si128 (in, _mm_set1_epi32 (0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16 (t0, _mm_set1_epi32 (0x04000040));
+    __m128i t2 = _mm_and_si128 (in, _mm_set1_epi32 (0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16 (t2, _mm_set1_epi32 (0x01000010));
+    __m128i indices = _mm_or_si128 (t1, t3);
+    _mm_storeu_si128 (reinterpret_cast <__m128i *> (out), s_lookup_ssse3 (indices));
+}
+
+// One full line of 57 bytes, 4 blocks read at most 52 bytes
+__attribute__ ((target ("ssse3"))) static char *
+s_line_ssse3 (const unsigned char *data, char *out)
+{
+    for (size_t i = 0; i != 48; i += 12, out += 16)
+        s_block_ssse3 (data + i, out);
+    return s_base64_scalar (data + 48, 9, out);
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+s_lookup_avx2 (__m256i indices)
+{
+    const __m256i shift = _mm256_setr_epi8 (
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    __m256i result = _mm256_subs_epu8 (indices, _mm256_set1_epi8 (51));
+    __m256i less = _mm256_cmpgt_epi8 (_mm256_set1_epi8 (26), indices);
+    result = _mm256_or_si256 (result, _mm256_and_si256 (less, _mm256_set1_epi8 (13)));
+    return _mm256_add_epi8 (_mm256_shuffle_epi8 (shift, result), indices);
+}
+
+// 24 bytes of input to 32 characters, reads 28 bytes
+__attribute__ ((target ("avx2"))) static inline void
+s_block_avx2 (const unsigned char *data, char *out)
+{
+    __m256i in = _mm256_inserti128_si256 (
+        _mm256_castsi128_si256 (_mm_loadu_si128 (reinterpret_cast <const __m128i *> (data))),
+        _mm_loadu_si128 (reinterpret_cast <const __m128i *> (data + 12)),
+        1);
+    in = _mm256_shuffle_epi8 (in, _mm256_setr_epi8 (
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m256i t0 = _mm256_and_si256 (in, _mm256_set1_epi32 (0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16 (t0, _mm256_set1_epi32 (0x04000040));
+    __m256i t2 = _mm256_and_si256 (in, _mm256_set1_epi32 (0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16 (t2, _mm256_set1_epi32 (0x01000010));
+    __m256i indices = _mm256_or_si256 (t1, t3);
+    _mm256_storeu_si256 (reinterpret_cast <__m256i *> (out), s_lookup_avx2 (indices));
+}
+
+// One full line of 57 bytes, 2 blocks read at most 52 bytes
+__attribute__ ((target ("avx2"))) static char *
+s_line_avx2 (const unsigned char *data, char *out)
+{
+    s_block_avx2 (data, out);
+    s_block_avx2 (data + 24, out + 32);
+    return s_base64_scalar (data + 48, 9, out + 64);
+}
+
+#endif
+
+static char *
+s_line_scalar (const unsigned char *data, char *out)
+{
+    return s_base64_scalar (data, LINE, out);
+}
+
+Base64Impl
+base64_best ()
+{
+    static const Base64Impl best = [] {
+#ifdef MIMEENCODER_X86
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2"))
+            return Base64Impl::AVX2;
+        if (__builtin_cpu_supports ("ssse3"))
+            return Base64Impl::SSSE3;
+#endif
+        return Base64Impl::SCALAR;
+    } ();
+    return best;
+}
+
+bool
+base64_supported (Base64Impl impl)
+{
+    return static_cast <int> (impl) <= static_cast <int> (base64_best ());
+}
+
+const char *
+base64_name (Base64Impl impl)
+{
+    switch (impl) {
+        case Base64Impl::AVX2: return "avx2";
+        case Base64Impl::SSSE3: return "ssse3";
+        default: return "scalar";
+    }
+}
+
+void
+base64_mime (const unsigned char *data, size_t size, std::string& out, Base64Impl impl)
+{
+    if (size == 0)
+        return;
+    if (!base64_supported (impl))
+        impl = base64_best ();
+
+    char *(*line) (const unsigned char *, char *) = s_line_scalar;
+#ifdef MIMEENCODER_X86
+    if (impl == Base64Impl::AVX2)
+        line = s_line_avx2;
+    else
+    if (impl == Base64Impl::SSSE3)
+        line = s_line_ssse3;
+#endif
+
+    size_t lines = (size + LINE - 1) / LINE;
+    size_t start = out.size ();
+    out.resize (start + (size + 2) / 3 * 4 + lines * 2);
+    char *p = &out [start];
+    size_t i = 0;
+    for (; i + LINE <= size; i += LINE) {
+        p = line (data + i, p);
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    if (i < size) {
+        size_t rest = size - i;
+        p = s_base64_scalar (data + i, rest, p);
+        p = s_base64_tail (data + i + rest / 3 * 3, rest % 3, p);
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    assert (p == &out [0] + out.size ());
+}
+
+// printable characters copied as they are, except '='
+struct QpLiteral {
+    bool table [256];
+    QpLiteral () {
+        for (int ch = 0; ch != 256; ch++)
+            table [ch] = ch >= 33 && ch <= 126 && ch != '=';
+    }
+};
+static const QpLiteral QP_LITERAL;
+
+void QpEncoder::encode (const char *data, size_t size, std::string& out)
+{
+    const unsigned char *in = reinterpret_cast <const unsigned char *> (data);
+    size_t i = 0;
+    while (i < size) {
+        if (!_cr && !_space) {
+            // fast path, copy the run of printable characters
+            size_t run = i;
+            while (run < size && QP_LITERAL.table [in [run]])
+                run ++;
+            while (i < run) {
+                if (_column >= 75) {
+                    out.append ("=\r\n");
+                    _column = 0;
+                }
+                size_t n = std::min (run - i, 75 - _column);
+                out.append (data + i, n);
+                _column += n;
+                i += n;
+            }
+            if (i == size)
+                break;
+        }
+
+        unsigned char ch = in [i++];
+        if (_cr) {
+            _cr = false;
+            eol (out);
+            if (ch == '\n')
+                continue;
+        }
+        if (ch == '\r' || ch == '\n') {
+            // whitespace at the end of line must be encoded
+            if (_space)
+                put (_space, false, out);
+            _space = 0;
+            if (ch == '\r')
+                _cr = true;
+            else
+                eol (out);
+            continue;
+        }
+        if (_space)
+            put (_space, true, out);
+        _space = 0;
+        if (ch == ' ' || ch == '\t')
+            _space = ch;
+        else
+            put (ch, QP_LITERAL.table [ch], out);
+    }
+}
+
+void QpEncoder::finish (std::string& out)
+{
+    if (_space)
+        put (_space, false, out);
+    _space = 0;
+    if (_cr)
+        eol (out);
+    _cr = false;
+    if (_column != 0)
+        eol (out);
+}
+
+void QpEncoder::put (unsigned char ch, bool literal, std::string& out)
+{
+    static const char hex [] = "0123456789ABCDEF";
+    size_t size = literal ? 1 : 3;
+    if (_column + size > 75) {
+        out.append ("=\r\n");
+        _column = 0;
+    }
+    if (literal)
+        out.push_back (ch);
+    else {
+        out.push_back ('=');
+        out.push_back (hex [ch >> 4]);
+        out.push_back (hex [ch & 15]);
+    }
+    _column += size;
+}
+
+void QpEncoder::eol (std::string& out)
+{
+    out.append ("\r\n");
+    _column = 0;
+}
+
+// MB/s of fn processing size bytes
+static double
+s_throughput (size_t size, const std::function <void ()>& fn)
+{
+    auto start = std::chrono::steady_clock::now ();
+    int rounds = 0;
+    std::chrono::duration <double> elapsed;
+    do {
+        fn ();
+        rounds ++;
+        elapsed = std::chrono::steady_clock::now () - start;
+    } while (elapsed.count () < 0.2);
+    return size * rounds / elapsed.count () / 1e6;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+mimeencoder_test (bool verbose)
+{
+    printf (" * mimeencoder: ");
+
+    //  @selftest
+    static const Base64Impl IMPLS [] = {Base64Impl::SCALAR, Base64Impl::SSSE3, Base64Impl::AVX2};
+    assert (base64_supported (Base64Impl::SCALAR));
+
+    // known values
+    for (Base64Impl impl : IMPLS) {
+        std::string out;
+        base64_mime (reinterpret_cast <const unsigned char *> ("Man"), 3, out, impl);
+        assert (out == "TWFu\r\n");
+        out.clear ();
+        base64_mime (reinterpret_cast <const unsigned char *> ("Ma"), 2, out, impl);
+        assert (out == "TWE=\r\n");
+        out.clear ();
+        base64_mime (reinterpret_cast <const unsigned char *> ("M"), 1, out, impl);
+        assert (out == "TQ==\r\n");
+        out.clear ();
+        base64_mime (NULL, 0, out, impl);
+        assert (out.empty ());
+    }
+
+    // all implementations give the same output, all byte values,
+    // full lines and partial last line
+    std::vector <unsigned char> data (4 * 57 * 64 + 5);
+    uint32_t seed = 42;
+    for (auto& byte : data) {
+        seed = seed * 1103515245 + 12345;
+        byte = seed >> 16;
+    }
+    for (size_t size : {1, 56, 57, 58, 114, 200, 57 * 64, (int) data.size ()}) {
+        std::string expected;
+        base64_mime (data.data (), size, expected, Base64Impl::SCALAR);
+        assert (expected.size () == (size + 2) / 3 * 4 + (size + 56) / 57 * 2);
+        assert (expected.compare (expected.size () - 2, 2, "\r\n") == 0);
+        for (Base64Impl impl : IMPLS) {
+            std::string out = "prefix";
+            base64_mime (data.data (), size, out, impl);
+            assert (out == "prefix" + expected);
+        }
+    }
+    {
+        std::string out;
+        base64_mime (data.data (), 57, out);
+        assert (out.size () == 78);
+        assert (out.find_first_not_of (BASE64_ALPHABET) == 76);
+    }
+
+    // quoted-printable, whitespace at the end of line is encoded
+    // and long lines get soft line breaks
+    {
+        std::string out;
+        QpEncoder qp;
+        std::string text = "caf\xc3\xa9 = 1 \nsecond\t\r\n" + std::string (80, 'x');
+        // pieces split anywhere give the same output
+        qp.encode (text.data (), 11, out);
+        qp.encode (text.data () + 11, text.size () - 11, out);
+        qp.finish (out);
+        assert (out ==
+            "caf=C3=A9 =3D 1=20\r\n"
+            "second=09\r\n" +
+            std::string (75, 'x') + "=\r\n" +
+            std::string (5, 'x') + "\r\n");
+    }
+    {
+        // fast path and byte by byte give the same output
+        std::string text;
+        for (int i = 0; i != 4000; i++)
+            text.push_back (i % 97 == 0 ? '\n' : i % 13 == 0 ? ' ' : i % 251 == 0 ? '\r' : (char) (33 + i % 100));
+        std::string whole, bytes;
+        QpEncoder qp1, qp2;
+        qp1.encode (text.data (), text.size (), whole);
+        qp1.finish (whole);
+        for (char ch : text)
+            qp2.encode (&ch, 1, bytes);
+        qp2.finish (bytes);
+        assert (whole == bytes);
+        size_t pos = 0;
+        while (pos < whole.size ()) {
+            size_t eol = whole.find ("\r\n", pos);
+            assert (eol != std::string::npos);
+            assert (eol - pos <= 76);
+            pos = eol + 2;
+        }
+    }
+
+    // micro-benchmark
+    if (verbose) {
+        std::vector <unsigned char> big (8 * 1024 * 1024 / 57 * 57);
+        for (size_t i = 0; i != big.size (); i++)
+            big [i] = data [i % data.size ()];
+        std::string out;
+        out.reserve (big.size () * 2);
+        for (Base64Impl impl : IMPLS) {
+            if (!base64_supported (impl))
+                continue;
+            double mbs = s_throughput (big.size (), [&] {
+                out.clear ();
+                base64_mime (big.data (), big.size (), out, impl);
+            });
+            zsys_debug ("base64 %-6s: %8.1f MB/s", base64_name (impl), mbs);
+        }
+        // the path MimeWriter replaced
+        std::string binary (big.begin (), big.end ());
+        double mbs = s_throughput (binary.size (), [&] {
+            cxxtools::MimeMultipart mime;
+            std::istringstream input (binary);
+            mime.attachBinaryFile (input, "big.bin", "application/octet-stream");
+            std::ostringstream output;
+            output << mime;
+        });
+        zsys_debug ("base64 cxxtools: %8.1f MB/s", mbs);
+
+        std::string text;
+        while (text.size () < big.size ())
+            text.append ("Alert on ups-1: input voltage out of range, on battery.\n");
+        mbs = s_throughput (text.size (), [&] {
+            out.clear ();
+            QpEncoder qp;
+            qp.encode (text.data (), text.size (), out);
+            qp.finish (out);
+        });
+        zsys_debug ("quoted-printable: %8.1f MB/s", mbs);
+        mbs = s_throughput (text.size (), [&] {
+            cxxtools::MimeMultipart mime;
+            std::istringstream input (text);
+            mime.attachTextFile (input, "big.txt", "text/plain");
+            std::ostringstream output;
+            output << mime;
+        });
+        zsys_debug ("quoted-printable cxxtools: %8.1f MB/s", mbs);
+    }
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,98 @@
+/*  =========================================================================
+    mimeencoder - Base64 and quoted-printable encoders of MIME parts
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef MIMEENCODER_H_INCLUDED
+#define MIMEENCODER_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+/**
+ * \class Base64Impl
+ *
+ * Implementations of base64 encoder, vectorized ones are used only
+ * if the CPU supports them
+ */
+enum class Base64Impl {
+    SCALAR,
+    SSSE3,
+    AVX2
+};
+
+// the fastest implementation supported by this CPU, detected once
+Base64Impl
+    base64_best ();
+
+// true if impl can be used on this CPU
+bool
+    base64_supported (Base64Impl impl);
+
+// name of the implementation for logs
+const char *
+    base64_name (Base64Impl impl);
+
+/**
+ * \brief Append base64 of data as MIME body
+ *
+ * Lines have 76 characters (57 bytes of input) and end by CRLF, the last
+ * one can be shorter. Pieces of one body must be multiples of 57 bytes
+ * except the last one, see MimeWriter::CHUNK.
+ */
+void
+    base64_mime (
+        const unsigned char *data,
+        size_t size,
+        std::string& out,
+        Base64Impl impl = base64_best ());
+
+/**
+ * \class QpEncoder
+ *
+ * \brief Quoted-printable encoder (RFC 2045)
+ *
+ * Input can come in any pieces. Line breaks of input (LF, CRLF or CR)
+ * become CRLF, lines are broken softly at 76 characters. Runs of
+ * printable characters are copied at once.
+ */
+class QpEncoder
+{
+ public:
+    QpEncoder () : _column (0), _space (0), _cr (false) {}
+
+    void    encode (const char *data, size_t size, std::string& out);
+    // flushes the pending whitespace and ends the last line
+    void    finish (std::string& out);
+
+ private:
+    void    put (unsigned char ch, bool literal, std::string& out);
+    void    eol (std::string& out);
+
+    size_t _column;
+    // whitespace is encoded only at the end of line, so it waits
+    unsigned char _space;
+    bool _cr;
+};
+
+//  Self test of this class
+void
+    mimeencoder_test (bool verbose);
+
+#endif
@@ -0,0 +1,245 @@
+/*  =========================================================================
+    mimetypes - MIME types of attachments, cached
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    mimetypes - MIME types of attachments, cached
+@discuss
+    Every Smtp instance used to load the whole libmagic database and every
+    attachment was opened and sniffed, even if the same report was
+    attached again and again.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <sys/stat.h>
+#include <strings.h>
+#include <fstream>
+
+static const struct {
+    const char *extension;
+    const char *type;
+} EXTENSIONS [] = {
+    {".txt",  "text/plain; charset=utf-8"},
+    {".log",  "text/plain; charset=utf-8"},
+    {".csv",  "text/csv; charset=utf-8"},
+    {".json", "application/json"},
+    {".xml",  "application/xml"},
+    {".html", "text/html; charset=utf-8"},
+    {".tgz",  "application/gzip"},
+    {".gz",   "application/gzip"},
+    {".tar",  "application/x-tar"},
+    {".zip",  "application/zip"},
+    {".pdf",  "application/pdf"},
+    {".png",  "image/png"},
+    {".jpg",  "image/jpeg"},
+};
+
+// libmagic cookie of the process, loaded on the first use,
+// magic_file must not be called on one cookie concurrently
+static std::mutex s_magic_mutex;
+
+static magic_t
+s_magic ()
+{
+    static magic_t magic = [] {
+        magic_t ret = magic_open (MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
+        if (!ret) {
+            zsys_error ("Cannot open magic_cookie");
+            return ret;
+        }
+        if (magic_load (ret, NULL) == -1) {
+            zsys_error ("Cannot load magic database: %s", magic_error (ret));
+            magic_close (ret);
+            ret = NULL;
+        }
+        return ret;
+    } ();
+    return magic;
+}
+
+MimeTypes::MimeTypes () :
+    _capacity (1024),
+    _stats {0, 0, 0, 0}
+{
+}
+
+const char *MimeTypes::byExtension (const std::string& path)
+{
+    size_t dot = path.rfind ('.');
+    if (dot == std::string::npos || path.find ('/', dot) != std::string::npos)
+        return NULL;
+    for (const auto& it : EXTENSIONS) {
+        if (strcasecmp (path.c_str () + dot, it.extension) == 0)
+            return it.type;
+    }
+    return NULL;
+}
+
+std::string MimeTypes::type (const std::string& path)
+{
+    const char *known = byExtension (path);
+    if (known) {
+        std::lock_guard <std::mutex> lock (_mutex);
+        _stats.extension ++;
+        return known;
+    }
+
+    struct stat st;
+    if (stat (path.c_str (), &st) != 0)
+        return "";
+    int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        auto it = _cache.find (path);
+        if (it != _cache.end ()
+        &&  it->second.dev == st.st_dev
+        &&  it->second.ino == st.st_ino
+        &&  it->second.mtime == mtime
+        &&  it->second.size == st.st_size) {
+            _stats.hits ++;
+            return it->second.type;
+        }
+    }
+
+    std::string type;
+    {
+        std::lock_guard <std::mutex> lock (s_magic_mutex);
+        magic_t magic = s_magic ();
+        const char *sniffed = magic ? magic_file (magic, path.c_str ()) : NULL;
+        if (sniffed)
+            type = sniffed;
+    }
+    if (type.empty ())
+        return type;
+
+    std::lock_guard <std::mutex> lock (_mutex);
+    _stats.misses ++;
+    if (_cache.size () >= _capacity)
+        _cache.clear ();
+    _cache [path] = Entry {st.st_dev, st.st_ino, mtime, st.st_size, type};
+    return type;
+}
+
+std::string MimeTypes::type (const std::string& name, const char *data, size_t size)
+{
+    const char *known = byExtension (name);
+    if (known) {
+        std::lock_guard <std::mutex> lock (_mutex);
+        _stats.extension ++;
+        return known;
+    }
+
+    std::lock_guard <std::mutex> lock (s_magic_mutex);
+    magic_t magic = s_magic ();
+    const char *sniffed = magic ? magic_buffer (magic, data, size) : NULL;
+    return sniffed ? sniffed : "";
+}
+
+void MimeTypes::capacity (size_t capacity)
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    _capacity = capacity > 0 ? capacity : 1;
+}
+
+MimeTypesStats MimeTypes::stats () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    MimeTypesStats ret = _stats;
+    ret.cached = _cache.size ();
+    return ret;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+mimetypes_test (bool verbose)
+{
+    printf (" * mimetypes: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string dir = std::string (SELFTEST_DIR_RW);
+
+    // extensions, file does not need to exist
+    assert (streq (MimeTypes::byExtension ("/tmp/report.TGZ"), "application/gzip"));
+    assert (streq (MimeTypes::byExtension ("data.csv"), "text/csv; charset=utf-8"));
+    assert (MimeTypes::byExtension ("/tmp/report") == NULL);
+    assert (MimeTypes::byExtension ("/tmp/dir.txt/report") == NULL);
+    assert (MimeTypes::byExtension ("/tmp/report.exe") == NULL);
+
+    MimeTypes types;
+    assert (types.type (dir + "/none.pdf") == "application/pdf");
+    assert (types.type (dir + "/none") == "");
+    assert (types.stats ().extension == 1);
+
+    // sniffed once, until the file changes
+    std::string path = dir + "/mimetypes";
+    {
+        std::ofstream ofs (path);
+        ofs << "plain text\n";
+    }
+    std::string first = types.type (path);
+    assert (first.compare (0, 10, "text/plain") == 0);
+    assert (types.type (path) == first);
+    MimeTypesStats stats = types.stats ();
+    assert (stats.misses == 1);
+    assert (stats.hits == 1);
+    assert (stats.cached == 1);
+    {
+        static const char png [] = "\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\1\0\0\0\1\x08\x02\0\0\0";
+        std::ofstream ofs (path, std::ios::binary);
+        ofs.write (png, sizeof (png) - 1);
+    }
+    std::string second = types.type (path);
+    if (verbose)
+        zsys_debug ("mimetypes: %s -> %s", first.c_str (), second.c_str ());
+    assert (second != first);
+    assert (types.stats ().misses == 2);
+
+    // content in memory
+    assert (types.type ("report.json", "{}", 2) == "application/json");
+    assert (types.type ("report", "plain text\n", 11).compare (0, 10, "text/plain") == 0);
+
+    // cache is bounded
+    types.capacity (1);
+    std::string other = dir + "/mimetypes-other";
+    {
+        std::ofstream ofs (other);
+        ofs << "other text\n";
+    }
+    types.type (other);
+    assert (types.stats ().cached == 1);
+
+    std::remove (path.c_str ());
+    std::remove (other.c_str ());
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,97 @@
+/*  =========================================================================
+    mimetypes - MIME types of attachments, cached
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef MIMETYPES_H_INCLUDED
+#define MIMETYPES_H_INCLUDED
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * \class MimeTypesStats
+ *
+ * Counters of MimeTypes lookups
+ */
+struct MimeTypesStats {
+    uint64_t extension;     // type known from the file name
+    uint64_t hits;          // type of unchanged file found in the cache
+    uint64_t misses;        // file had to be sniffed by libmagic
+    size_t cached;          // files in the cache now
+};
+
+/**
+ * \class MimeTypes
+ *
+ * \brief Type of file to be attached to email
+ *
+ * Well known extensions (.txt, .csv, .json, .tgz, .pdf, ...) give the type
+ * without touching the file. Other files are sniffed by libmagic and the
+ * result is cached until the file changes, that is, until its inode,
+ * mtime or size differ. The libmagic database is loaded on the first
+ * sniff and it is shared by the whole process. Class is thread safe.
+ *
+ * Example:
+ *
+ *    MimeTypes types;
+ *    std::string type = types.type ("/tmp/report.tgz");
+ *    assert (type == "application/gzip");
+ */
+class MimeTypes
+{
+ public:
+    MimeTypes ();
+
+    // MIME type of the file, empty string if it cannot be determined
+    std::string type (const std::string& path);
+    // MIME type of the content given in memory, name is used for the
+    // extension only, content is not cached
+    std::string type (const std::string& name, const char *data, size_t size);
+
+    // MIME type for the extension of path, NULL if it is not well known
+    static const char *byExtension (const std::string& path);
+
+    // maximum number of cached files, the cache is emptied when full
+    void    capacity (size_t capacity);
+    MimeTypesStats stats () const;
+
+ private:
+    struct Entry {
+        dev_t dev;
+        ino_t ino;
+        int64_t mtime;      // [ns]
+        int64_t size;
+        std::string type;
+    };
+
+    mutable std::mutex _mutex;
+    std::unordered_map <std::string, Entry> _cache;
+    size_t _capacity;
+    MimeTypesStats _stats;
+};
+
+//  Self test of this class
+void
+    mimetypes_test (bool verbose);
+
+#endif
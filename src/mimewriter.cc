@@ -0,0 +1,755 @@
+/*  =========================================================================
+    mimewriter - Streaming MIME encoder of emails with attachments
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    mimewriter - Streaming MIME encoder of emails with attachments
+@discuss
+    cxxtools::MimeMultipart keeps the attachments in memory, encodes them
+    into a stream and the result was copied again into std::string, so
+    big attachment was held in memory several times. MimeWriter reads
+    attachments when the email is written to the transport.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <strings.h>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <cxxtools/split.h>
+
+// headers of raw email bigger than this are not looked at
+static const size_t MAX_HEAD = 1024 * 1024;
+
+static ssize_t
+s_pread (int fd, char *data, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = ::pread (fd, data + done, size - done, offset + done);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static int
+s_open (const std::string& path)
+{
+    int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw std::runtime_error ("Cannot open " + path + ": " + strerror (errno));
+    return fd;
+}
+
+static uint64_t
+s_size (int fd, const std::string& path)
+{
+    struct stat st;
+    if (fstat (fd, &st) == -1)
+        throw std::runtime_error ("Cannot stat " + path + ": " + strerror (errno));
+    return st.st_size;
+}
+
+// Pass size bytes of fd to files if set, otherwise read them to sink
+static void
+s_pass (int fd, uint64_t offset, uint64_t size, const std::string& path,
+        const MimeWriter::Sink& sink, const MimeWriter::FileSink& files)
+{
+    if (files) {
+        if (size > 0)
+            files (fd, offset, size);
+        return;
+    }
+    std::vector <char> buffer (std::min <uint64_t> (size, MimeWriter::BUFFER));
+    while (size > 0) {
+        ssize_t r = s_pread (fd, buffer.data (), std::min <uint64_t> (size, buffer.size ()), offset);
+        if (r == -1)
+            throw std::runtime_error ("Cannot read " + path + ": " + strerror (errno));
+        if (r == 0)
+            throw std::runtime_error ("Cannot read " + path + ": file is truncated");
+        sink (buffer.data (), r);
+        offset += r;
+        size -= r;
+    }
+}
+
+ssize_t
+mime_sendfile (int out, int fd, uint64_t offset, size_t size)
+{
+    // splice needs a pipe on one side, sendfile a mmap-able input
+    loff_t in = offset;
+    ssize_t r = ::splice (fd, &in, out, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (r != -1 || (errno != EINVAL && errno != ENOSYS))
+        return r;
+    off_t pos = offset;
+    r = ::sendfile (out, fd, &pos, size);
+    if (r != -1 || (errno != EINVAL && errno != ENOSYS))
+        return r;
+
+    char buffer [16384];
+    r = ::pread (fd, buffer, std::min (size, sizeof (buffer)), offset);
+    if (r <= 0)
+        return r;
+    return ::write (out, buffer, r);
+}
+
+static bool
+s_is_text (const std::string& type)
+{
+    return type.compare (0, 5, "text/") == 0;
+}
+
+// Quoted file name for Content-Disposition, control characters would
+// break the header, so they are dropped
+static std::string
+s_quoted (const std::string& name)
+{
+    std::string ret = "\"";
+    for (char c : name) {
+        if (static_cast <unsigned char> (c) < 0x20 || c == 0x7f)
+            continue;
+        if (c == '"' || c == '\\')
+            ret.push_back ('\\');
+        ret.push_back (c);
+    }
+    ret.push_back ('"');
+    return ret;
+}
+
+// Return the email address from header value like 'Joe Doe <joe.doe@example.com>'
+static std::string
+s_address (const std::string& value)
+{
+    std::string ret = value;
+    auto lt = ret.find ('<');
+    if (lt != std::string::npos) {
+        auto gt = ret.find ('>', lt);
+        ret = ret.substr (lt + 1, gt == std::string::npos ? std::string::npos : gt - lt - 1);
+    }
+    auto begin = ret.find_first_not_of (" \t\r\n");
+    if (begin == std::string::npos)
+        return "";
+    auto end = ret.find_last_not_of (" \t\r\n");
+    return ret.substr (begin, end - begin + 1);
+}
+
+std::vector <std::string>
+mime_recipients (const std::string& data, std::string& stripped)
+{
+    std::vector <std::string> ret;
+    stripped.clear ();
+    stripped.reserve (data.size ());
+
+    size_t pos = 0;
+    bool in_bcc = false;
+    bool in_rcpt = false;
+    while (pos < data.size ()) {
+        size_t eol = data.find ('\n', pos);
+        size_t next = (eol == std::string::npos) ? data.size () : eol + 1;
+        std::string line = data.substr (pos, next - pos);
+        std::string value;
+
+        if (line == "\n" || line == "\r\n") {
+            // end of headers
+            stripped.append (data, pos, std::string::npos);
+            break;
+        }
+
+        if (line [0] == ' ' || line [0] == '\t') {
+            // folded header continues
+            if (in_rcpt)
+                value = line;
+        }
+        else {
+            in_bcc = strncasecmp (line.c_str (), "bcc:", 4) == 0;
+            in_rcpt = in_bcc
+                || strncasecmp (line.c_str (), "to:", 3) == 0
+                || strncasecmp (line.c_str (), "cc:", 3) == 0;
+            if (in_rcpt)
+                value = line.substr (line.find (':') + 1);
+        }
+
+        if (!value.empty ()) {
+            std::vector <std::string> addresses;
+            cxxtools::split (',', value, std::back_inserter (addresses));
+            for (const auto& address : addresses) {
+                std::string addr = s_address (address);
+                if (!addr.empty ())
+                    ret.push_back (addr);
+            }
+        }
+
+        if (!in_bcc)
+            stripped.append (line);
+        pos = next;
+    }
+    return ret;
+}
+
+// Read headers of raw email, returns them with the blank line after,
+// next is the offset of the body
+static std::string
+s_read_head (int fd, uint64_t offset, uint64_t& next)
+{
+    std::string head;
+    std::vector <char> buffer (MimeWriter::CHUNK);
+    size_t end = std::string::npos;
+    while (head.size () < MAX_HEAD) {
+        ssize_t r = s_pread (fd, buffer.data (), buffer.size (), offset + head.size ());
+        if (r == -1)
+            throw std::runtime_error (std::string ("Cannot read email: ") + strerror (errno));
+        size_t from = head.size () > 3 ? head.size () - 3 : 0;
+        head.append (buffer.data (), r);
+        if (head.compare (0, 1, "\n") == 0 || head.compare (0, 2, "\r\n") == 0)
+            end = head [0] == '\n' ? 1 : 2;
+        else {
+            size_t lf = head.find ("\n\n", from);
+            size_t crlf = head.find ("\n\r\n", from);
+            if (lf != std::string::npos && (crlf == std::string::npos || lf < crlf))
+                end = lf + 2;
+            else
+            if (crlf != std::string::npos)
+                end = crlf + 3;
+        }
+        if (end != std::string::npos || (size_t) r < buffer.size ())
+            break;
+    }
+    if (end != std::string::npos && end < head.size ())
+        head.resize (end);
+    next = offset + head.size ();
+    return head;
+}
+
+const size_t MimeWriter::CHUNK;
+const size_t MimeWriter::BUFFER;
+
+MimeWriter::MimeWriter () :
+    _offset (0)
+{
+    zuuid_t *uuid = zuuid_new ();
+    // "=_" cannot appear in quoted-printable nor base64 text
+    _boundary = std::string ("=_fty-email-") + zuuid_str (uuid);
+    zuuid_destroy (&uuid);
+}
+
+MimeWriter MimeWriter::raw (const std::string& path, uint64_t offset)
+{
+    MimeWriter ret;
+    ret._path = path;
+    ret._offset = offset;
+    return ret;
+}
+
+void MimeWriter::header (const std::string& name, const std::string& value)
+{
+    for (auto& it : _headers) {
+        if (strcasecmp (it.first.c_str (), name.c_str ()) == 0) {
+            it.second = value;
+            return;
+        }
+    }
+    _headers.push_back (std::make_pair (name, value));
+}
+
+std::string MimeWriter::header (const std::string& name) const
+{
+    for (const auto& it : _headers) {
+        if (strcasecmp (it.first.c_str (), name.c_str ()) == 0)
+            return it.second;
+    }
+    return "";
+}
+
+void MimeWriter::attach (const std::string& path, const std::string& name, const std::string& type)
+{
+    _attachments.push_back (Attachment {path, name, type, "", nullptr, nullptr});
+}
+
+void MimeWriter::attach (const std::string& path, const std::string& name, const std::string& type, const std::string& encoding)
+{
+    _attachments.push_back (Attachment {path, name, type, encoding, nullptr, nullptr});
+}
+
+void MimeWriter::attachData (const std::string& name, const std::string& type, std::shared_ptr <const std::string> data)
+{
+    _attachments.push_back (Attachment {"", name, type, "", data, nullptr});
+}
+
+void MimeWriter::attachFd (int fd, const std::string& name, const std::string& type)
+{
+    std::shared_ptr <const int> owned (new int (fd), [] (const int *fd) { ::close (*fd); delete fd; });
+    _attachments.push_back (Attachment {"", name, type, "", nullptr, owned});
+}
+
+void MimeWriter::write_headers (std::string& out) const
+{
+    out.append ("MIME-Version: 1.0\r\n");
+    for (const auto& it : _headers) {
+        if (strcasecmp (it.first.c_str (), "Bcc") == 0)
+            continue;
+        out.append (it.first).append (": ").append (it.second).append ("\r\n");
+    }
+    out.append ("Content-Type: multipart/mixed; boundary=\"").append (_boundary).append ("\"\r\n");
+    out.append ("\r\n");
+}
+
+std::vector <std::string> MimeWriter::recipients () const
+{
+    std::string head, stripped;
+    if (!_path.empty ()) {
+        int fd = s_open (_path);
+        uint64_t next;
+        try {
+            head = s_read_head (fd, _offset, next);
+        }
+        catch (...) {
+            ::close (fd);
+            throw;
+        }
+        ::close (fd);
+    }
+    else {
+        for (const auto& it : _headers)
+            head.append (it.first).append (": ").append (it.second).append ("\r\n");
+    }
+    return mime_recipients (head, stripped);
+}
+
+void MimeWriter::write_raw (const Sink& sink, const FileSink& files) const
+{
+    int fd = s_open (_path);
+    try {
+        uint64_t offset;
+        std::string head = s_read_head (fd, _offset, offset);
+        std::string stripped;
+        mime_recipients (head, stripped);
+        sink (stripped.data (), stripped.size ());
+
+        uint64_t size = s_size (fd, _path);
+        if (size > offset)
+            s_pass (fd, offset, size - offset, _path, sink, files);
+    }
+    catch (...) {
+        ::close (fd);
+        throw;
+    }
+    ::close (fd);
+}
+
+void MimeWriter::write (const Sink& sink) const
+{
+    write (sink, FileSink ());
+}
+
+void MimeWriter::write (const Sink& sink, const FileSink& files) const
+{
+    if (!_path.empty ()) {
+        write_raw (sink, files);
+        return;
+    }
+
+    std::string out;
+    out.reserve (BUFFER + 2 * CHUNK);
+    auto flush = [&sink, &out] (bool force) {
+        if (out.size () >= BUFFER || (force && !out.empty ())) {
+            sink (out.data (), out.size ());
+            out.clear ();
+        }
+    };
+
+    write_headers (out);
+    out.append ("--").append (_boundary).append ("\r\n");
+    out.append ("Content-Type: text/plain; charset=UTF-8\r\n"
+                "Content-Transfer-Encoding: quoted-printable\r\n"
+                "\r\n");
+    {
+        QpEncoder qp;
+        for (size_t pos = 0; pos < _body.size (); pos += CHUNK) {
+            qp.encode (_body.data () + pos, std::min (CHUNK, _body.size () - pos), out);
+            flush (false);
+        }
+        qp.finish (out);
+    }
+
+    std::vector <char> buffer;
+    for (const auto& attachment : _attachments) {
+        bool text = s_is_text (attachment.type);
+        std::string encoding = attachment.encoding;
+        if (encoding.empty ())
+            encoding = text ? "quoted-printable" : "base64";
+        out.append ("--").append (_boundary).append ("\r\n");
+        out.append ("Content-Type: ").append (attachment.type).append ("\r\n");
+        out.append ("Content-Transfer-Encoding: ").append (encoding).append ("\r\n");
+        out.append ("Content-Disposition: attachment; filename=").append (s_quoted (attachment.name)).append ("\r\n");
+        out.append ("\r\n");
+
+        if (!attachment.encoding.empty ()) {
+            // written as is, the boundary must start on a new line
+            int fd = s_open (attachment.path);
+            try {
+                uint64_t size = s_size (fd, attachment.path);
+                flush (true);
+                s_pass (fd, 0, size, attachment.path, sink, files);
+                char last = 0;
+                if (size == 0 || s_pread (fd, &last, 1, size - 1) != 1 || last != '\n')
+                    out.append ("\r\n");
+            }
+            catch (...) {
+                ::close (fd);
+                throw;
+            }
+            ::close (fd);
+            continue;
+        }
+
+        if (attachment.data) {
+            const std::string& data = *attachment.data;
+            QpEncoder qp;
+            for (size_t pos = 0; pos < data.size (); pos += CHUNK) {
+                size_t size = std::min (CHUNK, data.size () - pos);
+                if (text)
+                    qp.encode (data.data () + pos, size, out);
+                else
+                    base64_mime (reinterpret_cast <const unsigned char *> (data.data () + pos), size, out);
+                flush (false);
+            }
+            if (text)
+                qp.finish (out);
+            continue;
+        }
+
+        buffer.resize (CHUNK);
+        // descriptor of the writer is duplicated, so it is closed as files are
+        int fd = attachment.fd ? fcntl (*attachment.fd, F_DUPFD_CLOEXEC, 0) : s_open (attachment.path);
+        if (fd == -1)
+            throw std::runtime_error ("Cannot read " + attachment.name + ": " + strerror (errno));
+        const std::string& what = attachment.fd ? attachment.name : attachment.path;
+        QpEncoder qp;
+        uint64_t offset = 0;
+        while (true) {
+            ssize_t r = s_pread (fd, buffer.data (), buffer.size (), offset);
+            if (r == -1) {
+                int err = errno;
+                ::close (fd);
+                throw std::runtime_error ("Cannot read " + what + ": " + strerror (err));
+            }
+            if (r == 0)
+                break;
+            offset += r;
+            if (text)
+                qp.encode (buffer.data (), r, out);
+            else
+                base64_mime (reinterpret_cast <const unsigned char *> (buffer.data ()), r, out);
+            try {
+                flush (false);
+            }
+            catch (...) {
+                ::close (fd);
+                throw;
+            }
+        }
+        ::close (fd);
+        if (text)
+            qp.finish (out);
+    }
+    out.append ("--").append (_boundary).append ("--\r\n");
+    flush (true);
+}
+
+std::string MimeWriter::str () const
+{
+    std::string ret;
+    write ([&ret] (const char *data, size_t size) { ret.append (data, size); });
+    return ret;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+mimewriter_test (bool verbose)
+{
+    printf (" * mimewriter: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string dir = std::string (SELFTEST_DIR_RW);
+
+    // test of mime_recipients
+    {
+        std::string stripped;
+        std::vector <std::string> rcpts = mime_recipients (
+            "To: Joe Doe <joe@example.com>, jane@example.com\r\n"
+            "Cc: foo@example.com,\r\n"
+            " bar@example.com\r\n"
+            "Bcc: secret@example.com\r\n"
+            "Subject: To: nobody@example.com\r\n"
+            "\r\n"
+            "To: body@example.com\r\n",
+            stripped);
+        assert (rcpts.size () == 5);
+        assert (rcpts [0] == "joe@example.com");
+        assert (rcpts [1] == "jane@example.com");
+        assert (rcpts [2] == "foo@example.com");
+        assert (rcpts [3] == "bar@example.com");
+        assert (rcpts [4] == "secret@example.com");
+        assert (stripped.find ("Bcc") == std::string::npos);
+        assert (stripped.find ("secret@example.com") == std::string::npos);
+        assert (stripped.find ("To: body@example.com") != std::string::npos);
+    }
+
+    // attachments are streamed, each piece is bounded
+    std::string text = dir + "/mimewriter.txt";
+    std::string binary = dir + "/mimewriter.bin";
+    {
+        std::ofstream ofs (text);
+        ofs << "line 1\nline 2\n";
+    }
+    size_t binary_size = 5 * MimeWriter::CHUNK + 1;
+    {
+        std::ofstream ofs (binary, std::ios::binary);
+        for (size_t i = 0; i != binary_size; i++)
+            ofs.put (static_cast <char> (i));
+    }
+
+    MimeWriter mime;
+    mime.boundary ("=_b");
+    mime.header ("To", "joe@example.com");
+    mime.header ("Bcc", "secret@example.com");
+    mime.header ("Subject", "subject");
+    mime.header ("subject", "Report");
+    mime.body ("See the attachments.");
+    mime.attach (text, "mimewriter.txt", "text/plain; charset=us-ascii");
+    mime.attach (binary, "mimewriter.bin", "application/octet-stream; charset=binary");
+    assert (mime.attachments () == 2);
+    assert (mime.header ("SUBJECT") == "Report");
+    std::vector <std::string> rcpts = mime.recipients ();
+    assert (rcpts.size () == 2);
+    assert (rcpts [1] == "secret@example.com");
+
+    size_t pieces = 0;
+    size_t biggest = 0;
+    std::string email;
+    mime.write ([&] (const char *data, size_t size) {
+        pieces ++;
+        biggest = std::max (biggest, size);
+        email.append (data, size);
+    });
+    assert (pieces > 2);
+    assert (biggest < MimeWriter::BUFFER + 2 * MimeWriter::CHUNK);
+    assert (email == mime.str ());
+    if (verbose)
+        zsys_debug ("%s", email.substr (0, 1024).c_str ());
+    std::string headers =
+        "MIME-Version: 1.0\r\n"
+        "To: joe@example.com\r\n"
+        "Subject: Report\r\n";
+    assert (email.compare (0, headers.size (), headers) == 0);
+    assert (email.find ("secret@example.com") == std::string::npos);
+    assert (email.find (
+        "Content-Type: multipart/mixed; boundary=\"=_b\"\r\n"
+        "\r\n"
+        "--=_b\r\n"
+        "Content-Type: text/plain; charset=UTF-8\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "\r\n"
+        "See the attachments.\r\n"
+        "--=_b\r\n"
+        "Content-Type: text/plain; charset=us-ascii\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "Content-Disposition: attachment; filename=\"mimewriter.txt\"\r\n"
+        "\r\n"
+        "line 1\r\n"
+        "line 2\r\n"
+        "--=_b\r\n"
+        "Content-Type: application/octet-stream; charset=binary\r\n"
+        "Content-Transfer-Encoding: base64\r\n") != std::string::npos);
+    size_t begin = email.find ("\r\n\r\n", email.find ("mimewriter.bin")) + 4;
+    size_t end = email.find ("--=_b--\r\n");
+    assert (end == email.size () - 9);
+    // 76 characters and CRLF per 57 bytes, the last line is shorter
+    assert (end - begin == (binary_size / 57) * 78 + 4 + 2);
+
+    // attachment in memory is encoded the same way as the file
+    {
+        std::string content;
+        {
+            std::ifstream ifs (binary, std::ios::binary);
+            content.assign (std::istreambuf_iterator <char> (ifs), std::istreambuf_iterator <char> ());
+        }
+        MimeWriter memory;
+        memory.boundary ("=_b");
+        memory.header ("To", "joe@example.com");
+        memory.header ("Subject", "Report");
+        memory.body ("See the attachments.");
+        memory.attach (text, "mimewriter.txt", "text/plain; charset=us-ascii");
+        memory.attachData ("mimewriter.bin", "application/octet-stream; charset=binary",
+            std::make_shared <const std::string> (content));
+        assert (memory.str () == email);
+    }
+
+    // file name can't inject headers
+    {
+        MimeWriter quoted;
+        quoted.attachData ("a\"b\\c\r\nBcc: x@example.com.txt", "text/plain", std::make_shared <const std::string> ("x"));
+        std::string email = quoted.str ();
+        assert (email.find ("Content-Disposition: attachment; filename=\"a\\\"b\\\\cBcc: x@example.com.txt\"\r\n") != std::string::npos);
+        assert (email.find ("\r\nBcc:") == std::string::npos);
+    }
+
+    // descriptor is read from the start by each write, it is closed
+    // with the last copy of the writer
+    {
+        int fd = ::open (text.c_str (), O_RDONLY | O_CLOEXEC);
+        assert (fd != -1);
+        assert (lseek (fd, 3, SEEK_SET) == 3);
+        std::string str;
+        {
+            MimeWriter descriptor;
+            descriptor.boundary ("=_b");
+            descriptor.attachFd (fd, "descriptor.txt", "text/plain");
+            MimeWriter copy = descriptor;
+            str = descriptor.str ();
+            assert (str.find ("filename=\"descriptor.txt\"\r\n\r\nline 1\r\nline 2\r\n") != std::string::npos);
+            assert (copy.str () == str);
+        }
+        assert (fcntl (fd, F_GETFD) == -1);
+    }
+
+    // missing attachment
+    {
+        MimeWriter missing;
+        missing.attach (dir + "/mimewriter.none", "none", "text/plain");
+        try {
+            missing.str ();
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+        }
+    }
+
+    // raw email stored after some other data, Bcc is not passed on
+    {
+        std::string path = dir + "/mimewriter.raw";
+        {
+            std::ofstream ofs (path, std::ios::binary);
+            ofs << "META\n" << "To: joe@example.com\nBcc: secret@example.com\n\n" << email;
+        }
+        MimeWriter raw = MimeWriter::raw (path, 5);
+        rcpts = raw.recipients ();
+        assert (rcpts.size () == 2);
+        assert (rcpts [0] == "joe@example.com");
+        assert (rcpts [1] == "secret@example.com");
+        assert (raw.str () == "To: joe@example.com\n\n" + email);
+
+        // body is passed as file range
+        std::string spliced;
+        size_t ranges = 0;
+        raw.write (
+            [&spliced] (const char *data, size_t size) { spliced.append (data, size); },
+            [&spliced, &ranges] (int fd, uint64_t offset, uint64_t size) {
+                std::vector <char> buffer (size);
+                assert (s_pread (fd, buffer.data (), size, offset) == (ssize_t) size);
+                spliced.append (buffer.data (), size);
+                ranges ++;
+            });
+        assert (ranges == 1);
+        assert (spliced == raw.str ());
+        std::remove (path.c_str ());
+    }
+
+    // attachment already encoded is written as is
+    {
+        std::string path = dir + "/mimewriter.b64";
+        {
+            std::ofstream ofs (path, std::ios::binary);
+            ofs << "bGluZSAxCmxpbmUgMgo=";
+        }
+        MimeWriter encoded;
+        encoded.boundary ("=_b");
+        encoded.attach (path, "report.txt", "text/plain", "base64");
+        encoded.attach (text, "mimewriter.txt", "text/plain", "7bit");
+        std::string plain = encoded.str ();
+        assert (plain.find (
+            "Content-Type: text/plain\r\n"
+            "Content-Transfer-Encoding: base64\r\n"
+            "Content-Disposition: attachment; filename=\"report.txt\"\r\n"
+            "\r\n"
+            "bGluZSAxCmxpbmUgMgo=\r\n"
+            "--=_b\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Transfer-Encoding: 7bit\r\n"
+            "Content-Disposition: attachment; filename=\"mimewriter.txt\"\r\n"
+            "\r\n"
+            "line 1\nline 2\n"
+            "--=_b--\r\n") != std::string::npos);
+
+        // through a pipe as the msmtp transport does it
+        int fds [2];
+        assert (pipe (fds) == 0);
+        std::string piped;
+        size_t ranges = 0;
+        encoded.write (
+            [&piped] (const char *data, size_t size) { piped.append (data, size); },
+            [&] (int fd, uint64_t offset, uint64_t size) {
+                while (size > 0) {
+                    ssize_t r = mime_sendfile (fds [1], fd, offset, size);
+                    assert (r > 0);
+                    std::vector <char> buffer (r);
+                    assert (::read (fds [0], buffer.data (), r) == r);
+                    piped.append (buffer.data (), r);
+                    offset += r;
+                    size -= r;
+                }
+                ranges ++;
+            });
+        ::close (fds [0]);
+        ::close (fds [1]);
+        assert (ranges == 2);
+        assert (piped == plain);
+        std::remove (path.c_str ());
+    }
+
+    std::remove (text.c_str ());
+    std::remove (binary.c_str ());
+    //  @end
+    printf ("OK\n");
+}
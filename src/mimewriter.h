@@ -0,0 +1,175 @@
+/*  =========================================================================
+    mimewriter - Streaming MIME encoder of emails with attachments
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef MIMEWRITER_H_INCLUDED
+#define MIMEWRITER_H_INCLUDED
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+
+/**
+ * \class MimeWriter
+ *
+ * \brief Email with attachments, encoded while it is written out
+ *
+ * Only the headers, the text body and the paths of attachments are kept
+ * in memory, unless the attachment itself is given in memory, see
+ * attachData (). Attachments are opened by write (), read in chunks of
+ * CHUNK bytes, encoded (quoted-printable for text/ types, base64 for the
+ * rest) and passed to the sink in pieces of about BUFFER bytes, so the
+ * memory needed does not depend on the size of attachments. write ()
+ * can be called repeatedly and gives the same output each time, which
+ * lets the transport retry on another connection.
+ *
+ * Already rendered email stored in a file, e.g. in MailSpool, is written
+ * out the same way, see raw ().
+ *
+ * Files which need no encoding, the body of raw email and attachments
+ * added already encoded, can be handed to the transport as file ranges,
+ * see FileSink. The transport can then move them by splice or sendfile
+ * from the page cache and only the headers and boundaries are made in
+ * userspace.
+ *
+ * Bcc header is never written, the addresses are in recipients ().
+ *
+ * Example:
+ *
+ *    MimeWriter mime;
+ *    mime.header ("To", "joe@example.com");
+ *    mime.header ("Subject", "Report");
+ *    mime.body ("Daily report is attached");
+ *    mime.attach ("/tmp/report.tgz", "report.tgz", "application/gzip");
+ *    mime.write ([fd] (const char *data, size_t size) { ::write (fd, data, size); });
+ */
+class MimeWriter
+{
+ public:
+    typedef std::function <void (const char *data, size_t size)> Sink;
+    // size bytes of file fd from offset, fd is valid only during the call
+    typedef std::function <void (int fd, uint64_t offset, uint64_t size)> FileSink;
+
+    // attachment bytes read at once, multiple of 57 (one base64 line)
+    static const size_t CHUNK = 57 * 768;
+    // output is passed to the sink in pieces of about this size
+    static const size_t BUFFER = 64 * 1024;
+
+    MimeWriter ();
+
+    // email already rendered in file at path, starting at offset
+    static MimeWriter raw (const std::string& path, uint64_t offset = 0);
+
+    // sets the header, replaces the one of the same name
+    void    header (const std::string& name, const std::string& value);
+    // returns the value of the header, empty string if not set
+    std::string header (const std::string& name) const;
+
+    // sets the text/plain body
+    void    body (const std::string& text) { _body = text; }
+    // adds the file, it must be readable until the last write ()
+    void    attach (const std::string& path, const std::string& name, const std::string& type);
+    // adds the file already in transfer encoding (base64, 7bit, 8bit),
+    // it is written as is
+    void    attach (const std::string& path, const std::string& name, const std::string& type, const std::string& encoding);
+    // adds the content, it is shared by copies of the writer
+    void    attachData (const std::string& name, const std::string& type, std::shared_ptr <const std::string> data);
+    // adds the content of open descriptor, e.g. from memfd_create, read
+    // from offset 0, writer takes the ownership, the descriptor is shared
+    // by copies of the writer and closed with the last one
+    void    attachFd (int fd, const std::string& name, const std::string& type);
+    size_t  attachments () const { return _attachments.size (); }
+
+    // sets the multipart boundary, random one is used by default
+    void    boundary (const std::string& boundary) { _boundary = boundary; }
+
+    // envelope recipients from To, Cc and Bcc headers
+    std::vector <std::string> recipients () const;
+
+    // passes whole email to the sink
+    // throws std::runtime_error if attachment cannot be read, exceptions
+    // of the sink are passed through
+    void    write (const Sink& sink) const;
+    // the same, files which need no encoding are passed to files
+    void    write (const Sink& sink, const FileSink& files) const;
+
+    // whole email as one string
+    std::string str () const;
+
+ private:
+    struct Attachment {
+        std::string path;
+        std::string name;
+        std::string type;
+        // empty if the file is encoded by write ()
+        std::string encoding;
+        // content given in memory, path is not used
+        std::shared_ptr <const std::string> data;
+        // content of open descriptor, path is not used
+        std::shared_ptr <const int> fd;
+    };
+
+    void    write_raw (const Sink& sink, const FileSink& files) const;
+    void    write_headers (std::string& out) const;
+
+    std::vector <std::pair <std::string, std::string>> _headers;
+    std::string _body;
+    std::vector <Attachment> _attachments;
+    std::string _boundary;
+    // raw email
+    std::string _path;
+    uint64_t _offset;
+};
+
+/**
+ * \brief Deduce recipients from To/Cc/Bcc headers like msmtp -t does
+ *
+ * \param data      email DATA or its headers
+ * \param stripped  data without Bcc header
+ * \return addresses in order of headers
+ */
+std::vector <std::string>
+    mime_recipients (
+        const std::string& data,
+        std::string& stripped);
+
+/**
+ * \brief Copy part of file to pipe or socket without userspace buffer
+ *
+ * Uses splice or sendfile, or read and write if neither supports the
+ * descriptors.
+ *
+ * \return bytes copied, 0 at the end of fd, -1 and errno on error
+ */
+ssize_t
+    mime_sendfile (
+        int out,
+        int fd,
+        uint64_t offset,
+        size_t size);
+
+//  Self test of this class
+void
+    mimewriter_test (bool verbose);
+
+#endif
@@ -0,0 +1,186 @@
+/*  =========================================================================
+    ratelimiter - Token bucket limits of sent emails
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    ratelimiter - Token bucket limits of sent emails
+@discuss
+    Flapping rule can generate notifications faster than the relay is
+    willing to accept them. Notifications over the limit are deferred,
+    not dropped.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <cmath>
+
+RateLimiter::RateLimiter () :
+    _global {0, 0},
+    _allowed (0),
+    _deferred (0)
+{
+    for (auto& limit : _limits)
+        limit = Limit {0, 1};
+}
+
+void RateLimiter::limit (Scope scope, double rate, double burst)
+{
+    _limits [scope] = Limit {rate > 0 ? rate / 60000 : 0, burst >= 1 ? burst : 1};
+    if (scope == GLOBAL)
+        _global = Bucket {_limits [scope].burst, 0};
+    else
+    if (scope == RECIPIENT)
+        _recipients.clear ();
+    else
+        _domains.clear ();
+}
+
+bool RateLimiter::limited () const
+{
+    for (const auto& limit : _limits) {
+        if (limit.rate > 0)
+            return true;
+    }
+    return false;
+}
+
+void RateLimiter::refill (Scope scope, Bucket& bucket, int64_t now) const
+{
+    const Limit& limit = _limits [scope];
+    if (now > bucket.last) {
+        bucket.tokens = std::min (limit.burst, bucket.tokens + (now - bucket.last) * limit.rate);
+        bucket.last = now;
+    }
+}
+
+int64_t RateLimiter::acquire (const std::string& to, bool sms, int64_t now)
+{
+    Bucket *buckets [SCOPES] = {NULL, NULL, NULL};
+    if (_limits [GLOBAL].rate > 0)
+        buckets [GLOBAL] = &_global;
+    if (_limits [RECIPIENT].rate > 0) {
+        auto it = _recipients.emplace (to, Bucket {_limits [RECIPIENT].burst, now}).first;
+        buckets [RECIPIENT] = &it->second;
+    }
+    size_t at = to.rfind ('@');
+    if (sms && _limits [SMS_DOMAIN].rate > 0 && at != std::string::npos) {
+        auto it = _domains.emplace (to.substr (at + 1), Bucket {_limits [SMS_DOMAIN].burst, now}).first;
+        buckets [SMS_DOMAIN] = &it->second;
+    }
+
+    double wait = 0;
+    for (int scope = 0; scope != SCOPES; scope++) {
+        if (!buckets [scope])
+            continue;
+        refill ((Scope) scope, *buckets [scope], now);
+        if (buckets [scope]->tokens < 1)
+            wait = std::max (wait, (1 - buckets [scope]->tokens) / _limits [scope].rate);
+    }
+    if (wait > 0) {
+        _deferred++;
+        return std::max ((int64_t) 1, (int64_t) std::ceil (wait));
+    }
+    for (auto bucket : buckets) {
+        if (bucket)
+            bucket->tokens -= 1;
+    }
+    _allowed++;
+    return 0;
+}
+
+void RateLimiter::expire (int64_t now)
+{
+    std::unordered_map <std::string, Bucket> *maps [] = {&_recipients, &_domains};
+    Scope scopes [] = {RECIPIENT, SMS_DOMAIN};
+    for (int i = 0; i != 2; i++) {
+        for (auto it = maps [i]->begin (); it != maps [i]->end (); ) {
+            refill (scopes [i], it->second, now);
+            if (it->second.tokens >= _limits [scopes [i]].burst)
+                it = maps [i]->erase (it);
+            else
+                ++it;
+        }
+    }
+}
+
+RateLimiterStats RateLimiter::stats () const
+{
+    return RateLimiterStats {
+        _allowed,
+        _deferred,
+        _limits [GLOBAL].rate > 0 ? _global.tokens : -1,
+        _recipients.size (),
+        _domains.size ()
+    };
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+ratelimiter_test (bool verbose)
+{
+    printf (" * ratelimiter: ");
+
+    //  @selftest
+    RateLimiter limiter;
+    assert (!limiter.limited ());
+    assert (limiter.acquire ("joe@example.com", false, 0) == 0);
+    assert (limiter.stats ().global_tokens == -1);
+
+    // 6 per minute is one per 10 s, burst of 2
+    limiter.limit (RateLimiter::RECIPIENT, 6, 2);
+    assert (limiter.limited ());
+    assert (limiter.acquire ("joe@example.com", false, 1000) == 0);
+    assert (limiter.acquire ("joe@example.com", false, 1000) == 0);
+    assert (limiter.acquire ("joe@example.com", false, 1000) == 10000);
+    assert (limiter.acquire ("joe@example.com", false, 6000) == 5000);
+    assert (limiter.acquire ("jane@example.com", false, 6000) == 0);
+    assert (limiter.acquire ("joe@example.com", false, 11000) == 0);
+
+    // sms domain is shared by all phone numbers
+    limiter.limit (RateLimiter::SMS_DOMAIN, 60, 1);
+    assert (limiter.acquire ("0123@sms.example.com", true, 20000) == 0);
+    assert (limiter.acquire ("0456@sms.example.com", true, 20000) == 1000);
+    assert (limiter.acquire ("0456@sms.example.com", false, 20000) == 0);
+
+    // global bucket, nothing is taken when one of buckets is empty
+    limiter.limit (RateLimiter::GLOBAL, 60, 1);
+    assert (limiter.acquire ("0789@sms.example.com", true, 20500) == 500);
+    assert (limiter.acquire ("bob@example.com", false, 20500) == 0);
+    assert (limiter.acquire ("alice@example.com", false, 20500) == 1000);
+    assert (limiter.stats ().global_tokens < 1);
+
+    RateLimiterStats stats = limiter.stats ();
+    assert (stats.allowed == 8);
+    assert (stats.deferred == 5);
+    assert (stats.recipients == 7);
+    assert (stats.domains == 1);
+
+    // full buckets are dropped
+    limiter.expire (1000000);
+    stats = limiter.stats ();
+    assert (stats.recipients == 0);
+    assert (stats.domains == 0);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,105 @@
+/*  =========================================================================
+    ratelimiter - Token bucket limits of sent emails
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef RATELIMITER_H_INCLUDED
+#define RATELIMITER_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// counters of RateLimiter
+struct RateLimiterStats {
+    uint64_t allowed;       // messages which got tokens
+    uint64_t deferred;      // messages which had to wait
+    double global_tokens;   // tokens left in global bucket, -1 if unlimited
+    size_t recipients;      // number of recipient buckets
+    size_t domains;         // number of sms gateway domain buckets
+};
+
+/**
+ * \class RateLimiter
+ *
+ * \brief Token buckets limiting messages globally, per recipient and
+ * per sms gateway domain
+ *
+ * Bucket holds up to burst tokens and it is refilled by rate tokens per
+ * minute. Message takes one token from each bucket it falls into, but
+ * only if all of them have one. Buckets of recipients and domains are
+ * created on demand and dropped by expire () once they are full again.
+ *
+ * Example:
+ *
+ *    limiter.limit (RateLimiter::RECIPIENT, 6, 3);
+ *    int64_t wait = limiter.acquire (to, false, zclock_mono ());
+ *    if (wait > 0)
+ *        defer (to, wait);
+ */
+class RateLimiter
+{
+ public:
+    enum Scope {
+        GLOBAL,
+        RECIPIENT,
+        SMS_DOMAIN,
+        SCOPES
+    };
+
+    RateLimiter ();
+
+    // rate [messages per minute], 0 means unlimited, burst is at least 1
+    void    limit (Scope scope, double rate, double burst);
+    bool    limited () const;
+
+    // returns 0 if the message to 'to' can be sent at 'now' [ms] and takes
+    // the tokens, otherwise returns ms until it can be sent and takes nothing
+    int64_t acquire (const std::string& to, bool sms, int64_t now);
+
+    // drops buckets which are full at 'now' [ms]
+    void    expire (int64_t now);
+
+    RateLimiterStats stats () const;
+
+ private:
+    struct Bucket {
+        double tokens;
+        int64_t last;   // ms of last refill
+    };
+    struct Limit {
+        double rate;    // tokens per ms, 0 for unlimited
+        double burst;
+    };
+
+    void    refill (Scope scope, Bucket& bucket, int64_t now) const;
+
+    Limit _limits [SCOPES];
+    Bucket _global;
+    std::unordered_map <std::string, Bucket> _recipients;
+    std::unordered_map <std::string, Bucket> _domains;
+    uint64_t _allowed;
+    uint64_t _deferred;
+};
+
+//  Self test of this class
+void
+    ratelimiter_test (bool verbose);
+
+#endif
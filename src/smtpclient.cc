@@ -0,0 +1,1359 @@
+/*  =========================================================================
+    smtpclient - Native SMTP client
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    smtpclient - Native SMTP client
+@discuss
+    Supports plain connection, STARTTLS, implicit TLS, AUTH PLAIN/LOGIN
+    and PIPELINING. Errors are mapped onto SmtpError codes used for msmtp,
+    so callers can't tell the difference. Open sessions are pooled and
+    reused for consecutive emails.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <thread>
+#include <chrono>
+#include <set>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+// timeout of connect and of each read/write [ms]
+static const int SMTP_TIMEOUT = 60 * 1000;
+
+SmtpSettings::SmtpSettings ():
+    host {},
+    port {"25"},
+    encryption {Enctryption::NONE},
+    verify_ca {false},
+    username {},
+    password {}
+{
+}
+
+bool SmtpSettings::operator== (const SmtpSettings& other) const
+{
+    return host == other.host
+        && port == other.port
+        && encryption == other.encryption
+        && verify_ca == other.verify_ca
+        && username == other.username
+        && password == other.password;
+}
+
+// ----------------------------------------------------------------------------
+// static helper functions
+
+static int64_t
+s_now ()
+{
+    return std::chrono::duration_cast <std::chrono::milliseconds> (
+            std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+static void
+s_openssl_init ()
+{
+    static std::once_flag flag;
+    std::call_once (flag, [] {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+        SSL_library_init ();
+        SSL_load_error_strings ();
+#endif
+    });
+}
+
+static std::string
+s_ssl_error ()
+{
+    unsigned long e = ERR_get_error ();
+    ERR_clear_error ();
+    if (e == 0)
+        return "unknown error";
+    char buf [256];
+    ERR_error_string_n (e, buf, sizeof (buf));
+    return buf;
+}
+
+static std::string
+s_base64 (const std::string& data)
+{
+    static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string ret;
+    ret.reserve ((data.size () + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < data.size (); i += 3) {
+        uint32_t n = (uint8_t) data [i] << 16 | (uint8_t) data [i+1] << 8 | (uint8_t) data [i+2];
+        ret.push_back (alphabet [(n >> 18) & 63]);
+        ret.push_back (alphabet [(n >> 12) & 63]);
+        ret.push_back (alphabet [(n >> 6) & 63]);
+        ret.push_back (alphabet [n & 63]);
+    }
+    if (i < data.size ()) {
+        uint32_t n = (uint8_t) data [i] << 16;
+        if (i + 1 < data.size ())
+            n |= (uint8_t) data [i+1] << 8;
+        ret.push_back (alphabet [(n >> 18) & 63]);
+        ret.push_back (alphabet [(n >> 12) & 63]);
+        ret.push_back (i + 1 < data.size () ? alphabet [(n >> 6) & 63] : '=');
+        ret.push_back ('=');
+    }
+    return ret;
+}
+
+// Convert line endings to CRLF, escape leading dots and terminate DATA,
+// input can come in any pieces
+class DotStuffer
+{
+ public:
+    DotStuffer () : _bol (true), _cr (false) {}
+
+    void feed (const char *data, size_t size, std::string& out)
+    {
+        for (size_t i = 0; i != size; i++) {
+            char ch = data [i];
+            if (_cr) {
+                _cr = false;
+                out.append ("\r\n");
+                _bol = true;
+                if (ch == '\n')
+                    continue;
+            }
+            if (ch == '\r') {
+                _cr = true;
+                continue;
+            }
+            if (_bol && ch == '.')
+                out.push_back ('.');
+            if (ch == '\n') {
+                out.append ("\r\n");
+                _bol = true;
+                continue;
+            }
+            out.push_back (ch);
+            _bol = false;
+        }
+    }
+
+    void finish (std::string& out)
+    {
+        if (_cr || !_bol)
+            out.append ("\r\n");
+        out.append (".\r\n");
+        _bol = true;
+        _cr = false;
+    }
+
+ private:
+    bool _bol;
+    bool _cr;
+};
+
+static std::string
+s_dotstuff (const std::string& data)
+{
+    std::string ret;
+    ret.reserve (data.size () + data.size () / 32 + 5);
+    DotStuffer stuffer;
+    stuffer.feed (data.data (), data.size (), ret);
+    stuffer.finish (ret);
+    return ret;
+}
+
+// Headers of email bigger than this are passed as they are
+static const size_t MAX_HEAD = 64 * 1024;
+
+// Address can be put into MAIL FROM:<> or RCPT TO:<> as it is,
+// CR/LF would inject SMTP commands
+static bool
+s_valid_address (const std::string& address)
+{
+    if (address.empty ())
+        return false;
+    for (unsigned char ch : address) {
+        if (ch < 0x20 || ch == 0x7f || ch == '<' || ch == '>')
+            return false;
+    }
+    return true;
+}
+
+// True if the headers are complete, i.e. the blank line was seen
+static bool
+s_head_complete (const std::string& head)
+{
+    return head.compare (0, 1, "\n") == 0
+        || head.compare (0, 2, "\r\n") == 0
+        || head.find ("\n\n") != std::string::npos
+        || head.find ("\n\r\n") != std::string::npos;
+}
+
+// True if the header name is among the headers of email
+static bool
+s_has_header (const std::string& head, const char *name)
+{
+    size_t len = strlen (name);
+    size_t pos = 0;
+    while (pos < head.size ()) {
+        if (head [pos] == '\n' || head.compare (pos, 2, "\r\n") == 0)
+            return false;
+        if (strncasecmp (head.c_str () + pos, name, len) == 0 && head.c_str () [pos + len] == ':')
+            return true;
+        size_t eol = head.find ('\n', pos);
+        if (eol == std::string::npos)
+            break;
+        pos = eol + 1;
+    }
+    return false;
+}
+
+// Source of email DATA already in memory, data must outlive the source
+static SmtpSource
+s_source (const std::string& data)
+{
+    return [&data] (const SmtpSink& sink) { sink (data.data (), data.size ()); };
+}
+
+// Error code of negative reply to MAIL/RCPT/DATA
+static SmtpError
+s_reply2code (int code, const std::string& reply)
+{
+    if (code == 530 && strcasestr (reply.c_str (), "TLS"))
+        return SmtpError::SSLRequired;
+    if (code == 530 || code == 535)
+        return SmtpError::AuthFailed;
+    return SmtpError::Unknown;
+}
+
+// ----------------------------------------------------------------------------
+// SmtpSession
+
+SmtpSession::SmtpSession (const SmtpSettings& settings):
+    _settings {settings},
+    _fd {-1},
+    _ctx {NULL},
+    _ssl {NULL},
+    _rbuf {},
+    _has_starttls {false},
+    _has_auth_plain {false},
+    _has_auth_login {false},
+    _has_auth {false},
+    _has_pipelining {false},
+    _dirty {false},
+    _started {false}
+{
+    connect ();
+    if (_settings.encryption == Enctryption::TLS)
+        handshake ();
+    greeting ();
+    ehlo ();
+    if (_settings.encryption == Enctryption::STARTTLS) {
+        starttls ();
+        ehlo ();
+    }
+    if (!_settings.username.empty ())
+        authenticate ();
+}
+
+SmtpSession::~SmtpSession ()
+{
+    if (alive ()) {
+        try {
+            std::string reply;
+            command ("QUIT", reply);
+        }
+        catch (const SmtpException &e) {
+        }
+    }
+    close ();
+}
+
+void SmtpSession::connect ()
+{
+    struct addrinfo hints;
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = NULL;
+    int r = getaddrinfo (_settings.host.c_str (), _settings.port.c_str (), &hints, &result);
+    if (r != 0)
+        fail (SmtpError::DNSFailed, "cannot locate host " + _settings.host + ": " + gai_strerror (r));
+
+    int last_errno = 0;
+    for (struct addrinfo *rp = result; rp != NULL; rp = rp->ai_next) {
+        int fd = socket (rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if (fd == -1) {
+            last_errno = errno;
+            continue;
+        }
+
+        int flags = fcntl (fd, F_GETFL, 0);
+        fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+        r = ::connect (fd, rp->ai_addr, rp->ai_addrlen);
+        if (r == -1 && errno == EINPROGRESS) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            r = poll (&pfd, 1, SMTP_TIMEOUT);
+            if (r == 1) {
+                int err = 0;
+                socklen_t len = sizeof (err);
+                getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                errno = err;
+                r = err == 0 ? 0 : -1;
+            }
+            else {
+                if (r == 0)
+                    errno = ETIMEDOUT;
+                r = -1;
+            }
+        }
+        if (r == 0) {
+            fcntl (fd, F_SETFL, flags);
+            _fd = fd;
+            break;
+        }
+        last_errno = errno;
+        ::close (fd);
+    }
+    freeaddrinfo (result);
+
+    if (_fd == -1)
+        fail (SmtpError::ServerUnreachable,
+                "cannot connect to " + _settings.host + ", port " + _settings.port + ": " + strerror (last_errno));
+
+    struct timeval tv = {SMTP_TIMEOUT / 1000, 0};
+    setsockopt (_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    setsockopt (_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+}
+
+void SmtpSession::greeting ()
+{
+    std::string reply;
+    int code = read_reply (reply);
+    if (code != 220)
+        fail (SmtpError::Unknown, "server refused the connection: " + reply);
+}
+
+void SmtpSession::ehlo ()
+{
+    char hostname [HOST_NAME_MAX + 1] = "localhost";
+    gethostname (hostname, sizeof (hostname) - 1);
+
+    _has_starttls = false;
+    _has_auth = false;
+    _has_auth_plain = false;
+    _has_auth_login = false;
+    _has_pipelining = false;
+
+    std::string reply;
+    int code = command (std::string ("EHLO ") + hostname, reply);
+    if (code != 250) {
+        code = command (std::string ("HELO ") + hostname, reply);
+        if (code != 250)
+            fail (SmtpError::Unknown, "EHLO failed: " + reply);
+        return;
+    }
+
+    std::istringstream lines {reply};
+    std::string line;
+    while (std::getline (lines, line)) {
+        std::transform (line.begin (), line.end (), line.begin (), ::toupper);
+        if (line.compare (0, 8, "STARTTLS") == 0)
+            _has_starttls = true;
+        else
+        if (line == "PIPELINING")
+            _has_pipelining = true;
+        else
+        if (line.compare (0, 5, "AUTH ") == 0 || line.compare (0, 5, "AUTH=") == 0) {
+            _has_auth = true;
+            std::istringstream mechanisms {line.substr (5)};
+            std::string mechanism;
+            while (mechanisms >> mechanism) {
+                if (mechanism == "PLAIN")
+                    _has_auth_plain = true;
+                else
+                if (mechanism == "LOGIN")
+                    _has_auth_login = true;
+            }
+        }
+    }
+}
+
+void SmtpSession::starttls ()
+{
+    if (!_has_starttls)
+        fail (SmtpError::SSLNotSupported, "the server does not support TLS via the STARTTLS command");
+    std::string reply;
+    int code = command ("STARTTLS", reply);
+    if (code != 220)
+        fail (SmtpError::SSLNotSupported, "command STARTTLS failed: " + reply);
+    _rbuf.clear ();
+    handshake ();
+}
+
+void SmtpSession::handshake ()
+{
+    s_openssl_init ();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    _ctx = SSL_CTX_new (SSLv23_client_method ());
+#else
+    _ctx = SSL_CTX_new (TLS_client_method ());
+#endif
+    if (!_ctx)
+        fail (SmtpError::SSLNotSupported, "cannot create TLS context: " + s_ssl_error ());
+    SSL_CTX_set_options (_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    if (_settings.verify_ca) {
+        SSL_CTX_set_default_verify_paths (_ctx);
+        SSL_CTX_set_verify (_ctx, SSL_VERIFY_PEER, NULL);
+    }
+    else
+        SSL_CTX_set_verify (_ctx, SSL_VERIFY_NONE, NULL);
+
+    _ssl = SSL_new (_ctx);
+    if (!_ssl)
+        fail (SmtpError::SSLNotSupported, "cannot create TLS session: " + s_ssl_error ());
+    SSL_set_tlsext_host_name (_ssl, _settings.host.c_str ());
+    if (_settings.verify_ca)
+        X509_VERIFY_PARAM_set1_host (SSL_get0_param (_ssl), _settings.host.c_str (), 0);
+    SSL_set_fd (_ssl, _fd);
+
+    if (SSL_connect (_ssl) != 1) {
+        long verify = SSL_get_verify_result (_ssl);
+        if (_settings.verify_ca && verify != X509_V_OK)
+            fail (SmtpError::UnknownCA,
+                    std::string ("the certificate is not trusted: ") + X509_verify_cert_error_string (verify));
+        fail (SmtpError::SSLNotSupported, "TLS handshake failed: " + s_ssl_error ());
+    }
+}
+
+void SmtpSession::authenticate ()
+{
+    if (!_has_auth)
+        fail (SmtpError::AuthMethodNotSupported, "the server does not support authentication");
+
+    std::string reply;
+    int code = 0;
+    if (_has_auth_plain) {
+        std::string token;
+        token.push_back ('\0');
+        token.append (_settings.username);
+        token.push_back ('\0');
+        token.append (_settings.password);
+        code = command ("AUTH PLAIN " + s_base64 (token), reply);
+    }
+    else
+    if (_has_auth_login) {
+        code = command ("AUTH LOGIN", reply);
+        if (code == 334)
+            code = command (s_base64 (_settings.username), reply);
+        if (code == 334)
+            code = command (s_base64 (_settings.password), reply);
+    }
+    else
+        fail (SmtpError::AuthMethodNotSupported, "cannot find a usable authentication method");
+
+    if (code == 235)
+        return;
+    if (code == 530 && strcasestr (reply.c_str (), "TLS"))
+        fail (SmtpError::SSLRequired, "authentication failed: " + reply);
+    if (code == 504)
+        fail (SmtpError::AuthMethodNotSupported, "authentication method not supported: " + reply);
+    fail (SmtpError::AuthFailed, "authentication failed: " + reply);
+}
+
+void SmtpSession::sendmail (
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const std::string& data)
+{
+    transaction (from, to, s_source (data), false);
+}
+
+void SmtpSession::sendmail (
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const SmtpSource& data)
+{
+    transaction (from, to, data, false);
+}
+
+std::vector <SmtpRecipientStatus> SmtpSession::deliver (
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const std::string& data)
+{
+    return transaction (from, to, s_source (data), true);
+}
+
+std::vector <SmtpRecipientStatus> SmtpSession::deliver (
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const SmtpSource& data)
+{
+    return transaction (from, to, data, true);
+}
+
+std::vector <SmtpRecipientStatus> SmtpSession::transaction (
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const SmtpSource& data,
+        bool partial)
+{
+    if (from.empty ())
+        throw SmtpException (SmtpError::NoSenderAddress, "no sender address");
+    if (!s_valid_address (from))
+        throw SmtpException (SmtpError::NoSenderAddress, "invalid sender address");
+    if (to.empty ())
+        throw SmtpException (SmtpError::NoRecipient, "no recipient");
+    for (const auto& rcpt : to) {
+        if (!s_valid_address (rcpt))
+            throw SmtpException (SmtpError::NoRecipient, "invalid recipient address");
+    }
+
+    std::vector <std::string> commands;
+    if (_dirty)
+        commands.push_back ("RSET");
+    commands.push_back ("MAIL FROM:<" + from + ">");
+    for (const auto& rcpt : to)
+        commands.push_back ("RCPT TO:<" + rcpt + ">");
+    _dirty = true;
+    _started = false;
+
+    // DATA is not pipelined, we need to know if anybody was accepted
+    if (_has_pipelining) {
+        std::string batch;
+        for (const auto& command : commands)
+            batch.append (command).append ("\r\n");
+        write (batch);
+    }
+
+    std::vector <SmtpRecipientStatus> status;
+    status.reserve (to.size ());
+    size_t accepted = 0;
+    std::string reply;
+    std::string error;
+    SmtpError code = SmtpError::Succeeded;
+    for (const auto& command : commands) {
+        int r = _has_pipelining ? read_reply (reply) : this->command (command, reply);
+        if (command.compare (0, 10, "MAIL FROM:") == 0)
+            _started = true;
+        if (code != SmtpError::Succeeded)
+            // read all replies of the batch
+            continue;
+        if (command == "RSET") {
+            if (r != 250)
+                fail (SmtpError::Unknown, "RSET failed: " + reply);
+        }
+        else
+        if (command.compare (0, 10, "MAIL FROM:") == 0) {
+            if (r != 250) {
+                code = s_reply2code (r, reply);
+                error = "sender <" + from + "> not accepted: " + reply;
+            }
+        }
+        else {
+            const std::string& rcpt = to [status.size ()];
+            if (r == 250 || r == 251) {
+                accepted ++;
+                status.push_back (SmtpRecipientStatus {rcpt, SmtpError::Succeeded, "OK"});
+            }
+            else {
+                status.push_back (SmtpRecipientStatus {rcpt, s_reply2code (r, reply), reply});
+                if (!partial) {
+                    code = status.back ().code;
+                    error = "recipient <" + rcpt + "> not accepted: " + reply;
+                }
+            }
+        }
+        if (code != SmtpError::Succeeded && !_has_pipelining)
+            break;
+    }
+    if (code != SmtpError::Succeeded)
+        throw SmtpException (code, error);
+    if (accepted == 0)
+        return status;
+
+    int r = command ("DATA", reply);
+    if (r != 354)
+        throw SmtpException (s_reply2code (r, reply), "DATA not accepted: " + reply);
+
+    // DATA is written as it comes, in pieces of about 64kB, headers are
+    // held back until From: is known to be there, msmtp adds it too
+    {
+        DotStuffer stuffer;
+        std::string out;
+        out.reserve (96 * 1024);
+        std::string head;
+        bool headers = true;
+        auto flush_head = [&from, &stuffer, &out, &head, &headers] () {
+            if (!s_has_header (head, "From"))
+                out.append ("From: ").append (from).append ("\r\n");
+            stuffer.feed (head.data (), head.size (), out);
+            head.clear ();
+            headers = false;
+        };
+        try {
+            data ([this, &stuffer, &out, &head, &headers, &flush_head] (const char *buf, size_t size) {
+                if (headers) {
+                    head.append (buf, size);
+                    if (s_head_complete (head) || head.size () >= MAX_HEAD)
+                        flush_head ();
+                }
+                else
+                    stuffer.feed (buf, size, out);
+                if (out.size () >= 64 * 1024) {
+                    write (out);
+                    out.clear ();
+                }
+            });
+        }
+        catch (...) {
+            // server would take the incomplete email, drop the connection
+            close ();
+            throw;
+        }
+        if (headers)
+            flush_head ();
+        stuffer.finish (out);
+        write (out);
+    }
+    r = read_reply (reply);
+    if (r != 250)
+        throw SmtpException (s_reply2code (r, reply), "email not accepted: " + reply);
+    return status;
+}
+
+int SmtpSession::command (const std::string& line, std::string& reply)
+{
+    write (line + "\r\n");
+    return read_reply (reply);
+}
+
+int SmtpSession::read_reply (std::string& reply)
+{
+    reply.clear ();
+    std::string line;
+    while (true) {
+        if (!read_line (line))
+            fail (SmtpError::ServerUnreachable, "connection to " + _settings.host + " lost");
+        if (line.size () < 3 || !isdigit (line [0]) || !isdigit (line [1]) || !isdigit (line [2]))
+            fail (SmtpError::Unknown, "malformed reply '" + line + "'");
+        if (!reply.empty ())
+            reply.push_back ('\n');
+        reply.append (line.size () > 4 ? line.substr (4) : "");
+        if (line.size () == 3 || line [3] != '-')
+            return std::stoi (line.substr (0, 3));
+    }
+}
+
+bool SmtpSession::read_line (std::string& line)
+{
+    size_t eol;
+    while ((eol = _rbuf.find ('\n')) == std::string::npos) {
+        char buf [4096];
+        ssize_t r;
+        if (_ssl)
+            r = SSL_read (_ssl, buf, sizeof (buf));
+        else
+            r = ::recv (_fd, buf, sizeof (buf), 0);
+        if (r <= 0)
+            return false;
+        _rbuf.append (buf, r);
+    }
+    line = _rbuf.substr (0, eol > 0 && _rbuf [eol-1] == '\r' ? eol - 1 : eol);
+    _rbuf.erase (0, eol + 1);
+    return true;
+}
+
+void SmtpSession::write (const char* data, size_t size)
+{
+    if (!alive ())
+        fail (SmtpError::ServerUnreachable, "not connected to " + _settings.host);
+    while (size > 0) {
+        ssize_t r;
+        if (_ssl)
+            r = SSL_write (_ssl, data, size);
+        else
+            r = ::send (_fd, data, size, MSG_NOSIGNAL);
+        if (r <= 0)
+            fail (SmtpError::ServerUnreachable, "cannot write to " + _settings.host + ": " + strerror (errno));
+        data += r;
+        size -= r;
+    }
+}
+
+void SmtpSession::close ()
+{
+    if (_ssl) {
+        SSL_free (_ssl);
+        _ssl = NULL;
+    }
+    if (_ctx) {
+        SSL_CTX_free (_ctx);
+        _ctx = NULL;
+    }
+    if (_fd != -1) {
+        ::close (_fd);
+        _fd = -1;
+    }
+}
+
+void SmtpSession::fail (SmtpError code, const std::string& message)
+{
+    close ();
+    throw SmtpException (code, message);
+}
+
+// ----------------------------------------------------------------------------
+// SmtpClient
+
+SmtpClient::SmtpClient ():
+    _mutex {},
+    _idle {},
+    _pool_size {4},
+    _keepalive {60000},
+    _hits {0},
+    _misses {0},
+    _expired {0}
+{
+}
+
+std::unique_ptr <SmtpSession>
+SmtpClient::acquire (const SmtpSettings& settings, bool& reused)
+{
+    std::unique_ptr <SmtpSession> session;
+    std::vector <std::unique_ptr <SmtpSession>> garbage;
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        int64_t now = s_now ();
+        while (!_idle.empty ()) {
+            // the most recently used session is the least likely to be closed by server
+            Idle idle = std::move (_idle.back ());
+            _idle.pop_back ();
+            if (!idle.session->alive () || idle.session->settings () != settings)
+                garbage.push_back (std::move (idle.session));
+            else
+            if (now - idle.since > _keepalive) {
+                _expired ++;
+                garbage.push_back (std::move (idle.session));
+            }
+            else {
+                session = std::move (idle.session);
+                break;
+            }
+        }
+        reused = bool (session);
+        if (reused)
+            _hits ++;
+        else
+            _misses ++;
+    }
+    // QUIT the old sessions before opening a new one
+    garbage.clear ();
+
+    if (!session)
+        session.reset (new SmtpSession (settings));
+    return session;
+}
+
+void SmtpClient::release (std::unique_ptr <SmtpSession> session)
+{
+    if (!session->alive ())
+        return;
+
+    std::vector <std::unique_ptr <SmtpSession>> garbage;
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        _idle.push_back (Idle {std::move (session), s_now ()});
+        while (_idle.size () > _pool_size) {
+            garbage.push_back (std::move (_idle.front ().session));
+            _idle.pop_front ();
+        }
+    }
+}
+
+void SmtpClient::sendmail (
+        const SmtpSettings& settings,
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const std::string& data)
+{
+    transaction (settings, from, to, s_source (data), false);
+}
+
+void SmtpClient::sendmail (
+        const SmtpSettings& settings,
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const SmtpSource& data)
+{
+    transaction (settings, from, to, data, false);
+}
+
+std::vector <SmtpRecipientStatus> SmtpClient::deliver (
+        const SmtpSettings& settings,
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const std::string& data)
+{
+    return transaction (settings, from, to, s_source (data), true);
+}
+
+std::vector <SmtpRecipientStatus> SmtpClient::transaction (
+        const SmtpSettings& settings,
+        const std::string& from,
+        const std::vector<std::string>& to,
+        const SmtpSource& data,
+        bool partial)
+{
+    while (true) {
+        bool reused = false;
+        std::unique_ptr <SmtpSession> session = acquire (settings, reused);
+        try {
+            std::vector <SmtpRecipientStatus> status;
+            if (partial)
+                status = session->deliver (from, to, data);
+            else
+                session->sendmail (from, to, data);
+            release (std::move (session));
+            return status;
+        }
+        catch (const SmtpException &e) {
+            // server might have closed idle connection meanwhile, try the
+            // next one, but not once the email could have been taken
+            bool stale = reused && !session->alive () && !session->started ();
+            release (std::move (session));
+            if (!stale)
+                throw;
+        }
+    }
+}
+
+void SmtpClient::pool_size (size_t size)
+{
+    std::vector <std::unique_ptr <SmtpSession>> garbage;
+    std::lock_guard <std::mutex> lock (_mutex);
+    _pool_size = size;
+    while (_idle.size () > _pool_size) {
+        garbage.push_back (std::move (_idle.front ().session));
+        _idle.pop_front ();
+    }
+}
+
+void SmtpClient::keepalive (int64_t keepalive)
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    _keepalive = keepalive;
+}
+
+void SmtpClient::expire ()
+{
+    std::vector <std::unique_ptr <SmtpSession>> garbage;
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        int64_t now = s_now ();
+        // sessions are ordered by time of last use
+        while (!_idle.empty () && now - _idle.front ().since > _keepalive) {
+            garbage.push_back (std::move (_idle.front ().session));
+            _idle.pop_front ();
+            _expired ++;
+        }
+    }
+}
+
+void SmtpClient::close ()
+{
+    std::deque <Idle> garbage;
+    std::lock_guard <std::mutex> lock (_mutex);
+    garbage.swap (_idle);
+}
+
+SmtpPoolStats SmtpClient::stats () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    return SmtpPoolStats {_hits, _misses, _expired, _idle.size ()};
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Minimal SMTP server for selftest, accepts AUTH PLAIN joe/secret
+// and rejects recipients starting with 'reject'
+struct FakeSmtpServer {
+    int listener;
+    bool pipelining;
+    std::string port;
+    std::thread thread;
+    std::vector <std::thread> sessions;
+    std::mutex mutex;
+    std::set <int> fds;
+    std::vector <std::string> emails;
+    std::vector <std::string> commands;
+    int connections;
+    // connection is closed once the email is queued, before the reply
+    bool drop_queued;
+
+    explicit FakeSmtpServer (bool pipelining = false) :
+        listener {-1}, pipelining {pipelining}, port {}, thread {}, sessions {},
+        mutex {}, fds {}, emails {}, commands {}, connections {0}, drop_queued {false}
+    {
+        listener = socket (AF_INET, SOCK_STREAM, 0);
+        assert (listener != -1);
+        struct sockaddr_in addr;
+        memset (&addr, 0, sizeof (addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        int r = bind (listener, (struct sockaddr*) &addr, sizeof (addr));
+        assert (r == 0);
+        socklen_t len = sizeof (addr);
+        r = getsockname (listener, (struct sockaddr*) &addr, &len);
+        assert (r == 0);
+        r = listen (listener, 8);
+        assert (r == 0);
+        port = std::to_string (ntohs (addr.sin_port));
+        thread = std::thread (&FakeSmtpServer::run, this);
+    }
+
+    ~FakeSmtpServer ()
+    {
+        shutdown (listener, SHUT_RDWR);
+        thread.join ();
+        drop ();
+        for (auto &session : sessions)
+            session.join ();
+        ::close (listener);
+    }
+
+    // close all client connections
+    void drop ()
+    {
+        std::lock_guard <std::mutex> lock (mutex);
+        for (int fd : fds)
+            shutdown (fd, SHUT_RDWR);
+    }
+
+    void run ()
+    {
+        while (true) {
+            int fd = accept (listener, NULL, NULL);
+            if (fd == -1)
+                break;
+            std::lock_guard <std::mutex> lock (mutex);
+            connections ++;
+            fds.insert (fd);
+            sessions.push_back (std::thread ([this, fd] {
+                serve (fd);
+                std::lock_guard <std::mutex> lock (mutex);
+                fds.erase (fd);
+                ::close (fd);
+            }));
+        }
+    }
+
+    void reply (int fd, const char* text)
+    {
+        ::send (fd, text, strlen (text), MSG_NOSIGNAL);
+    }
+
+    void serve (int fd)
+    {
+        std::string buf;
+        std::string email;
+        bool in_data = false;
+        reply (fd, "220 fake ESMTP\r\n");
+        while (true) {
+            size_t eol;
+            while ((eol = buf.find ("\r\n")) == std::string::npos) {
+                char chunk [1024];
+                ssize_t r = ::recv (fd, chunk, sizeof (chunk), 0);
+                if (r <= 0)
+                    return;
+                buf.append (chunk, r);
+            }
+            std::string line = buf.substr (0, eol);
+            buf.erase (0, eol + 2);
+
+            if (in_data) {
+                if (line == ".") {
+                    in_data = false;
+                    std::lock_guard <std::mutex> lock (mutex);
+                    emails.push_back (email);
+                    if (drop_queued)
+                        return;
+                    reply (fd, "250 2.0.0 Ok: queued\r\n");
+                }
+                else
+                    email.append (line + "\n");
+                continue;
+            }
+
+            {
+                std::lock_guard <std::mutex> lock (mutex);
+                commands.push_back (line);
+            }
+            if (line.compare (0, 5, "EHLO ") == 0)
+                reply (fd, pipelining ?
+                        "250-fake\r\n250-AUTH PLAIN LOGIN\r\n250-PIPELINING\r\n250 8BITMIME\r\n" :
+                        "250-fake\r\n250-AUTH PLAIN LOGIN\r\n250 8BITMIME\r\n");
+            else
+            if (line.compare (0, 11, "AUTH PLAIN ") == 0)
+                reply (fd, line.substr (11) == s_base64 (std::string ("\0joe\0secret", 11)) ?
+                        "235 2.7.0 Authentication successful\r\n" :
+                        "535 5.7.8 Error: authentication failed\r\n");
+            else
+            if (line.compare (0, 10, "MAIL FROM:") == 0)
+                reply (fd, "250 2.1.0 Ok\r\n");
+            else
+            if (line.compare (0, 15, "RCPT TO:<reject") == 0)
+                reply (fd, "550 5.1.1 Recipient address rejected\r\n");
+            else
+            if (line.compare (0, 8, "RCPT TO:") == 0)
+                reply (fd, "250 2.1.5 Ok\r\n");
+            else
+            if (line == "DATA") {
+                in_data = true;
+                email.clear ();
+                reply (fd, "354 End data with <CR><LF>.<CR><LF>\r\n");
+            }
+            else
+            if (line == "RSET")
+                reply (fd, "250 2.0.0 Ok\r\n");
+            else
+            if (line == "QUIT") {
+                reply (fd, "221 2.0.0 Bye\r\n");
+                return;
+            }
+            else
+                reply (fd, "502 5.5.2 Error: command not recognized\r\n");
+        }
+    }
+};
+
+void
+smtpclient_test (bool verbose)
+{
+    printf (" * smtpclient: ");
+
+    //  @selftest
+    // test case 01 - dot stuffing and line endings
+    assert (s_dotstuff ("a\n.b\r\n..c\rd") == "a\r\n..b\r\n...c\r\nd\r\n.\r\n");
+    assert (s_dotstuff ("") == ".\r\n");
+    {
+        // pieces split anywhere give the same output
+        std::string out;
+        DotStuffer stuffer;
+        stuffer.feed ("a\r", 2, out);
+        stuffer.feed ("\n.", 2, out);
+        stuffer.feed ("b\r", 2, out);
+        stuffer.finish (out);
+        assert (out == "a\r\n..b\r\n.\r\n");
+    }
+    assert (s_base64 (std::string ("\0joe\0secret", 11)) == "AGpvZQBzZWNyZXQ=");
+    assert (s_base64 ("ab") == "YWI=");
+
+    {
+    FakeSmtpServer server;
+    SmtpSettings settings;
+    settings.host = "127.0.0.1";
+    settings.port = server.port;
+
+    // test case 02 - send two emails over one connection
+    SmtpClient client;
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: one\n\n.body\n");
+    client.sendmail (settings, "from@example.com", {"joe@example.com", "jane@example.com"}, "Subject: two\n\nbody\n");
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.emails.size () == 2);
+        assert (server.emails [0] == "From: from@example.com\nSubject: one\n\n..body\n");
+        assert (server.connections == 1);
+    }
+
+    // test case 03 - rejected recipient
+    try {
+        client.sendmail (settings, "from@example.com", {"reject@example.com"}, "Subject: three\n\nbody\n");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::Unknown);
+    }
+    std::vector <SmtpRecipientStatus> status = client.deliver (
+            settings, "from@example.com", {"reject@example.com", "joe@example.com"}, "Subject: three\n\nbody\n");
+    assert (status.size () == 2);
+    assert (status [0].code == SmtpError::Unknown);
+    assert (status [1].code == SmtpError::Succeeded);
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.emails.size () == 3);
+    }
+
+    // test case 04 - no sender/no recipient
+    try {
+        client.sendmail (settings, "", {"joe@example.com"}, "body");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::NoSenderAddress);
+    }
+    try {
+        client.sendmail (settings, "from@example.com", {}, "body");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::NoRecipient);
+    }
+
+    // invalid address must not inject SMTP commands
+    try {
+        client.sendmail (settings, "from@example.com>\r\nRCPT TO:<x@evil", {"joe@example.com"}, "body");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::NoSenderAddress);
+    }
+    try {
+        client.sendmail (settings, "from@example.com", {"joe@example.com", "a@b>\r\nRCPT TO:<x@evil"}, "body");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::NoRecipient);
+    }
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        for (const auto& command : server.commands)
+            assert (command.find ("evil") == std::string::npos);
+    }
+
+    // test case 05 - authentication
+    settings.username = "joe";
+    settings.password = "secret";
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: four\n\nbody\n");
+    settings.password = "wrong";
+    try {
+        client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: five\n\nbody\n");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::AuthFailed);
+    }
+
+    // test case 06 - STARTTLS is not advertised
+    settings.username = "";
+    settings.encryption = Enctryption::STARTTLS;
+    try {
+        client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: six\n\nbody\n");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::SSLNotSupported);
+    }
+    client.close ();
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.emails.size () == 4);
+    }
+    }
+
+    // test case 07 - nobody listens
+    {
+    SmtpSettings settings;
+    settings.host = "127.0.0.1";
+    {
+        FakeSmtpServer server;
+        settings.port = server.port;
+    }
+    SmtpClient client;
+    try {
+        client.sendmail (settings, "from@example.com", {"joe@example.com"}, "body");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::ServerUnreachable);
+    }
+    }
+
+    // test case 08 - pooled sessions with PIPELINING
+    {
+    FakeSmtpServer server {true};
+    SmtpSettings settings;
+    settings.host = "127.0.0.1";
+    settings.port = server.port;
+
+    SmtpClient client;
+    for (int i = 0; i != 3; i++)
+        client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: pooled\n\nbody\n");
+    SmtpPoolStats stats = client.stats ();
+    assert (stats.misses == 1);
+    assert (stats.hits == 2);
+    assert (stats.idle == 1);
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.connections == 1);
+        assert (server.emails.size () == 3);
+        assert (std::count (server.commands.begin (), server.commands.end (), "RSET") == 2);
+    }
+
+    // whole batch is read, session stays usable
+    try {
+        client.sendmail (settings, "from@example.com", {"reject@example.com", "joe@example.com"}, "body");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::Unknown);
+    }
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: pooled\n\nbody\n");
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.connections == 1);
+        assert (server.emails.size () == 4);
+    }
+
+    // server closed idle connection, email is sent over a new one
+    server.drop ();
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: pooled\n\nbody\n");
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.connections == 2);
+        assert (server.emails.size () == 5);
+    }
+
+    // one transaction for many recipients
+    std::vector <SmtpRecipientStatus> status = client.deliver (
+            settings, "from@example.com",
+            {"joe@example.com", "reject@example.com", "jane@example.com"},
+            "Subject: coalesced\n\nbody\n");
+    assert (status.size () == 3);
+    assert (status [0].address == "joe@example.com");
+    assert (status [0].code == SmtpError::Succeeded);
+    assert (status [1].address == "reject@example.com");
+    assert (status [1].code == SmtpError::Unknown);
+    assert (status [2].code == SmtpError::Succeeded);
+    status = client.deliver (settings, "from@example.com", {"reject@example.com"}, "body");
+    assert (status.size () == 1);
+    assert (status [0].code == SmtpError::Unknown);
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.emails.size () == 6);
+        assert (server.emails [5] == "From: from@example.com\nSubject: coalesced\n\nbody\n");
+    }
+
+    // keepalive
+    client.keepalive (0);
+    zclock_sleep (10);
+    client.expire ();
+    stats = client.stats ();
+    assert (stats.idle == 0);
+    assert (stats.expired == 1);
+
+    // pooling turned off
+    client.pool_size (0);
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "Subject: pooled\n\nbody\n");
+    assert (client.stats ().idle == 0);
+    }
+
+    // test case 09 - DATA streamed in pieces, failed source does not send anything
+    {
+    FakeSmtpServer server;
+    SmtpSettings settings;
+    settings.host = "127.0.0.1";
+    settings.port = server.port;
+
+    SmtpClient client;
+    client.sendmail (settings, "from@example.com", {"joe@example.com"},
+        [] (const SmtpSink& sink) {
+            sink ("Subject: streamed\r", 18);
+            sink ("\n\r\n.", 4);
+            sink ("body\n", 5);
+        });
+    try {
+        client.sendmail (settings, "from@example.com", {"joe@example.com"},
+            [] (const SmtpSink& sink) {
+                sink ("Subject: broken\n\n", 17);
+                throw std::runtime_error ("Cannot read attachment");
+            });
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (false);
+    }
+    catch (const std::runtime_error &e) {
+    }
+    zclock_sleep (100);
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        assert (server.emails.size () == 1);
+        assert (server.emails [0] == "From: from@example.com\nSubject: streamed\n\n..body\n");
+    }
+    }
+
+    // test case 10 - From: is added only if the email has none
+    {
+    FakeSmtpServer server;
+    SmtpSettings settings;
+    settings.host = "127.0.0.1";
+    settings.port = server.port;
+
+    SmtpClient client;
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "To: joe@example.com\r\nfrom: Joe <joe@example.com>\r\n\r\nFrom: body\r\n");
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "To: joe@example.com\r\n\r\nFrom: body\r\n");
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "no headers");
+    std::lock_guard <std::mutex> lock (server.mutex);
+    assert (server.emails.size () == 3);
+    assert (server.emails [0] == "To: joe@example.com\nfrom: Joe <joe@example.com>\n\nFrom: body\n");
+    assert (server.emails [1] == "From: from@example.com\nTo: joe@example.com\n\nFrom: body\n");
+    assert (server.emails [2] == "From: from@example.com\nno headers\n");
+    }
+
+    // test case 11 - email is not sent again if connection drops after DATA
+    {
+    FakeSmtpServer server {true};
+    SmtpSettings settings;
+    settings.host = "127.0.0.1";
+    settings.port = server.port;
+
+    SmtpClient client;
+    client.sendmail (settings, "from@example.com", {"joe@example.com"}, "first");
+    {
+        std::lock_guard <std::mutex> lock (server.mutex);
+        server.drop_queued = true;
+    }
+    try {
+        client.sendmail (settings, "from@example.com", {"joe@example.com"}, "second");
+        assert (false);
+    }
+    catch (const SmtpException &e) {
+        assert (e.code () == SmtpError::ServerUnreachable);
+    }
+    std::lock_guard <std::mutex> lock (server.mutex);
+    assert (server.connections == 1);
+    assert (server.emails.size () == 2);
+    }
+    //  @end
+    printf ("OK\n");
+}
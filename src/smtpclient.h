@@ -0,0 +1,276 @@
+/*  =========================================================================
+    smtpclient - Native SMTP client
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   smtpclient.h
+    \brief  In-process SMTP client, alternative to msmtp
+
+Example:
+
+    SmtpSettings settings;
+    settings.host = "mail.example.com";
+    settings.encryption = Enctryption::STARTTLS;
+
+    SmtpClient client;
+    client.pool_size (4);
+    client.keepalive (60000);
+    try {
+        client.sendmail (settings, "joe.doe@example.com", {"agent.smith@matrix.gov"}, data);
+    }
+    catch (const SmtpException& e) {
+        // e.code () is one of SmtpError
+    }
+
+*/
+#ifndef SMTPCLIENT_H_INCLUDED
+#define SMTPCLIENT_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <deque>
+
+#include "email.h"
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+/**
+ * \class SmtpSettings
+ *
+ * Parameters of SMTP connection
+ */
+struct SmtpSettings {
+    std::string host;
+    std::string port;
+    Enctryption encryption;
+    bool verify_ca;
+    std::string username;
+    std::string password;
+
+    SmtpSettings ();
+    bool operator== (const SmtpSettings& other) const;
+    bool operator!= (const SmtpSettings& other) const { return !(*this == other); }
+};
+
+/**
+ * \class SmtpSession
+ *
+ * \brief One connection to SMTP server
+ *
+ * Constructor connects, says EHLO, negotiates TLS and authenticates.
+ * Destructor says QUIT. All errors are reported as SmtpException.
+ * Session can carry any number of emails, each transaction after the
+ * first one starts with RSET. If server advertises PIPELINING, the
+ * envelope commands are sent in one batch.
+ */
+class SmtpSession
+{
+    public:
+        explicit SmtpSession (const SmtpSettings& settings);
+        ~SmtpSession ();
+
+        /**
+         * \brief send one email
+         *
+         * \param from  envelope sender (MAIL FROM)
+         * \param to    envelope recipients (RCPT TO)
+         * \param data  email DATA, line endings are converted to CRLF
+         *              and lines starting with dot are escaped
+         *
+         * \throws SmtpException
+         */
+        void sendmail (
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const std::string& data);
+
+        /** \brief send one email, DATA is streamed in pieces of the source */
+        void sendmail (
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const SmtpSource& data);
+
+        /**
+         * \brief send one email to all accepted recipients
+         *
+         * Unlike sendmail, rejected recipient does not abort the transaction.
+         *
+         * \return status of each recipient, in order of to
+         * \throws SmtpException if the transaction itself failed
+         */
+        std::vector <SmtpRecipientStatus> deliver (
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const std::string& data);
+        std::vector <SmtpRecipientStatus> deliver (
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const SmtpSource& data);
+
+        /** \brief false if connection is known to be broken */
+        bool alive () const { return _fd != -1; }
+
+        /**
+         * \brief MAIL FROM of the last transaction was replied, so the
+         * server may have taken the email even if the transaction failed
+         */
+        bool started () const { return _started; }
+
+        const SmtpSettings& settings () const { return _settings; }
+
+    protected:
+        void connect ();
+        void greeting ();
+        void ehlo ();
+        void starttls ();
+        void handshake ();
+        void authenticate ();
+        void close ();
+
+        // partial == false aborts the transaction on the first rejected recipient
+        std::vector <SmtpRecipientStatus> transaction (
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const SmtpSource& data,
+                bool partial);
+
+        // send command and read the reply, returns reply code
+        int command (const std::string& line, std::string& reply);
+        int read_reply (std::string& reply);
+        void write (const char* data, size_t size);
+        void write (const std::string& data) { write (data.c_str (), data.size ()); }
+        bool read_line (std::string& line);
+
+        // throws SmtpException and drops the connection
+        void fail (SmtpError code, const std::string& message);
+
+        SmtpSettings _settings;
+        int _fd;
+        SSL_CTX *_ctx;
+        SSL *_ssl;
+        std::string _rbuf;
+        bool _has_starttls;
+        bool _has_auth_plain;
+        bool _has_auth_login;
+        bool _has_auth;
+        bool _has_pipelining;
+        // transaction was started, RSET must precede the next one
+        bool _dirty;
+        // see started ()
+        bool _started;
+
+        SmtpSession (const SmtpSession&) = delete;
+        SmtpSession& operator= (const SmtpSession&) = delete;
+};
+
+/**
+ * \class SmtpPoolStats
+ *
+ * Counters of SmtpClient session pool
+ */
+struct SmtpPoolStats {
+    uint64_t hits;      // email sent over pooled session
+    uint64_t misses;    // new session had to be opened
+    uint64_t expired;   // idle sessions closed after keepalive
+    size_t idle;        // sessions in the pool now
+};
+
+/**
+ * \class SmtpClient
+ *
+ * \brief Pool of open SmtpSessions reused across emails
+ *
+ * Each sendmail takes an idle session from the pool, or opens a new one,
+ * and puts it back when done, so concurrent callers use separate
+ * connections. Sessions with different settings, broken ones and those
+ * idle longer than keepalive are closed. If the pooled session turns out
+ * to be closed by the server before MAIL FROM was replied, the email is
+ * retried on a fresh one. Later failure is thrown, the email could have
+ * been queued by the server already.
+ * Class is thread safe.
+ */
+class SmtpClient
+{
+    public:
+        SmtpClient ();
+
+        /** \brief send the email, \see SmtpSession::sendmail */
+        void sendmail (
+                const SmtpSettings& settings,
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const std::string& data);
+        void sendmail (
+                const SmtpSettings& settings,
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const SmtpSource& data);
+
+        /** \brief send the email, \see SmtpSession::deliver */
+        std::vector <SmtpRecipientStatus> deliver (
+                const SmtpSettings& settings,
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const std::string& data);
+
+        /** \brief set maximum number of idle sessions, 0 turns pooling off. Default is 4. */
+        void pool_size (size_t size);
+
+        /** \brief set how long [ms] the idle session is kept open. Default is 60s. */
+        void keepalive (int64_t keepalive);
+
+        /** \brief close sessions idle longer than keepalive */
+        void expire ();
+
+        /** \brief close all idle sessions */
+        void close ();
+
+        SmtpPoolStats stats () const;
+
+    protected:
+        struct Idle {
+            std::unique_ptr <SmtpSession> session;
+            int64_t since;
+        };
+
+        std::unique_ptr <SmtpSession> acquire (const SmtpSettings& settings, bool& reused);
+        void release (std::unique_ptr <SmtpSession> session);
+
+        std::vector <SmtpRecipientStatus> transaction (
+                const SmtpSettings& settings,
+                const std::string& from,
+                const std::vector<std::string>& to,
+                const SmtpSource& data,
+                bool partial);
+
+        mutable std::mutex _mutex;
+        std::deque <Idle> _idle;
+        size_t _pool_size;
+        int64_t _keepalive;
+        uint64_t _hits;
+        uint64_t _misses;
+        uint64_t _expired;
+};
+
+void smtpclient_test (bool verbose);
+
+#endif
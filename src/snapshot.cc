@@ -0,0 +1,346 @@
+/*  =========================================================================
+    snapshot - Binary snapshot of the state
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    snapshot - Binary snapshot of the state
+@discuss
+    Layout of the file, integers are in native byte order
+
+        header      magic "FTYS", version, kind, byte order mark,
+                    record size, number of records and strings,
+                    size of string data
+        records     record_count * record_size bytes
+        padding     to 8 bytes
+        index       string_count * (uint32 offset, uint32 size)
+        strings     '\0' terminated strings
+
+    Snapshot is written by one process and read back by the same one,
+    byte order mark only rejects snapshots copied between architectures.
+    Any change of the layout or of the records must bump SNAPSHOT_VERSION.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SNAPSHOT_MAGIC[4] = {'F', 'T', 'Y', 'S'};
+static const uint16_t SNAPSHOT_VERSION = 1;
+static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+struct SnapshotHeader {
+    char magic [4];
+    uint16_t version;
+    uint16_t kind;
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t string_count;
+    uint64_t strings_size;
+};
+static_assert (sizeof (SnapshotHeader) == 32, "snapshot header must be 32 bytes");
+
+static size_t
+s_pad8 (size_t n)
+{
+    return (n + 7) & ~ (size_t) 7;
+}
+
+static int
+s_write (int fd, const void *data, size_t size)
+{
+    const char *p = static_cast <const char *> (data);
+    while (size > 0) {
+        ssize_t r = ::write (fd, p, size);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        size -= r;
+    }
+    return 0;
+}
+
+SnapshotWriter::SnapshotWriter (uint16_t kind, uint32_t record_size) :
+    _kind (kind),
+    _record_size (record_size),
+    _count (0)
+{
+}
+
+uint32_t SnapshotWriter::intern (const std::string& s)
+{
+    auto it = _interned.find (s);
+    if (it != _interned.end ())
+        return it->second;
+    uint32_t id = _index.size () / 2;
+    _index.push_back (_strings.size ());
+    _index.push_back (s.size ());
+    _strings.append (s);
+    _strings.push_back ('\0');
+    _interned.emplace (s, id);
+    return id;
+}
+
+void SnapshotWriter::append (const void *record)
+{
+    const char *p = static_cast <const char *> (record);
+    _records.insert (_records.end (), p, p + _record_size);
+    _count ++;
+}
+
+int SnapshotWriter::save (const std::string& path) const
+{
+    SnapshotHeader header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.kind = _kind;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.record_size = _record_size;
+    header.record_count = _count;
+    header.string_count = _index.size () / 2;
+    header.strings_size = _strings.size ();
+
+    static const char padding [8] = {0};
+    std::string tmp = path + ".new";
+    int fd = ::open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        zsys_error ("Cannot open file '%s' for write: %s", tmp.c_str (), strerror (errno));
+        return -1;
+    }
+    if (s_write (fd, &header, sizeof (header)) != 0
+    ||  s_write (fd, _records.data (), _records.size ()) != 0
+    ||  s_write (fd, padding, s_pad8 (_records.size ()) - _records.size ()) != 0
+    ||  s_write (fd, _index.data (), _index.size () * sizeof (uint32_t)) != 0
+    ||  s_write (fd, _strings.data (), _strings.size ()) != 0
+    ||  fsync (fd) != 0) {
+        zsys_error ("Cannot write file '%s': %s", tmp.c_str (), strerror (errno));
+        ::close (fd);
+        std::remove (tmp.c_str ());
+        return -1;
+    }
+    ::close (fd);
+    if (std::rename (tmp.c_str (), path.c_str ()) != 0) {
+        zsys_error ("Cannot rename file '%s' to '%s': %s", tmp.c_str (), path.c_str (), strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+SnapshotReader::SnapshotReader () :
+    _map (NULL),
+    _map_size (0),
+    _count (0),
+    _record_size (0),
+    _records (NULL),
+    _index (NULL),
+    _strings_count (0),
+    _strings (NULL)
+{
+}
+
+SnapshotReader::~SnapshotReader ()
+{
+    close ();
+}
+
+void SnapshotReader::close ()
+{
+    if (_map)
+        munmap (_map, _map_size);
+    _map = NULL;
+    _map_size = 0;
+    _count = 0;
+    _strings_count = 0;
+}
+
+int SnapshotReader::open (const std::string& path, uint16_t kind, uint32_t record_size)
+{
+    close ();
+    int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        zsys_error ("Cannot open file '%s' for read: %s", path.c_str (), strerror (errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat (fd, &st) != 0) {
+        zsys_error ("Cannot stat file '%s': %s", path.c_str (), strerror (errno));
+        ::close (fd);
+        return -1;
+    }
+    char magic [sizeof (SNAPSHOT_MAGIC)];
+    if (st.st_size < (off_t) sizeof (SnapshotHeader)
+    ||  pread (fd, magic, sizeof (magic), 0) != (ssize_t) sizeof (magic)
+    ||  memcmp (magic, SNAPSHOT_MAGIC, sizeof (magic)) != 0) {
+        ::close (fd);
+        return 1;
+    }
+    void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close (fd);
+    if (map == MAP_FAILED) {
+        zsys_error ("Cannot map file '%s': %s", path.c_str (), strerror (errno));
+        return -1;
+    }
+    _map = map;
+    _map_size = st.st_size;
+
+    const char *base = static_cast <const char *> (_map);
+    const SnapshotHeader *header = reinterpret_cast <const SnapshotHeader *> (base);
+    if (header->version != SNAPSHOT_VERSION
+    ||  header->byte_order != SNAPSHOT_BYTE_ORDER
+    ||  header->kind != kind
+    ||  header->record_size != record_size) {
+        zsys_error ("Snapshot '%s' has version %u, kind %u and record size %u, expected %u, %u and %u",
+            path.c_str (), header->version, header->kind, header->record_size,
+            SNAPSHOT_VERSION, kind, record_size);
+        close ();
+        return -1;
+    }
+
+    uint64_t records_size = (uint64_t) header->record_count * header->record_size;
+    uint64_t index_offset = sizeof (SnapshotHeader) + s_pad8 (records_size);
+    uint64_t strings_offset = index_offset + (uint64_t) header->string_count * 2 * sizeof (uint32_t);
+    if (strings_offset + header->strings_size != _map_size) {
+        zsys_error ("Snapshot '%s' is damaged: size %zu does not match the header", path.c_str (), _map_size);
+        close ();
+        return -1;
+    }
+
+    _records = base + sizeof (SnapshotHeader);
+    _index = reinterpret_cast <const uint32_t *> (base + index_offset);
+    _strings = base + strings_offset;
+    for (uint32_t i = 0; i != header->string_count; i++) {
+        uint64_t offset = _index [2*i];
+        uint64_t size = _index [2*i + 1];
+        if (offset + size >= header->strings_size || _strings [offset + size] != '\0') {
+            zsys_error ("Snapshot '%s' is damaged: string %u is out of bounds", path.c_str (), i);
+            close ();
+            return -1;
+        }
+    }
+    _count = header->record_count;
+    _record_size = header->record_size;
+    _strings_count = header->string_count;
+    return 0;
+}
+
+bool SnapshotReader::string (uint32_t id, SnapshotString& s) const
+{
+    if (id >= _strings_count)
+        return false;
+    s.data = _strings + _index [2*id];
+    s.size = _index [2*id + 1];
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+struct TestRecord {
+    uint32_t name;
+    uint32_t value;
+    uint64_t time;
+};
+
+void
+snapshot_test (bool verbose)
+{
+    printf (" * snapshot: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    std::string path = std::string (SELFTEST_DIR_RW) + "/snapshot-state";
+    std::remove (path.c_str ());
+
+    {
+    SnapshotWriter writer (SNAPSHOT_ASSETS, sizeof (TestRecord));
+    const char *names [] = {"ups", "epdu", "ups", ""};
+    for (uint32_t i = 0; i != 4; i++) {
+        TestRecord record;
+        record.name = writer.intern (names [i]);
+        record.value = i;
+        record.time = 1000 + i;
+        writer.append (&record);
+    }
+    assert (writer.size () == 4);
+    assert (writer.save (path) == 0);
+    }
+
+    {
+    SnapshotReader reader;
+    assert (reader.open (path, SNAPSHOT_ASSETS, sizeof (TestRecord)) == 0);
+    assert (reader.size () == 4);
+    const TestRecord *r0 = static_cast <const TestRecord *> (reader.record (0));
+    const TestRecord *r2 = static_cast <const TestRecord *> (reader.record (2));
+    const TestRecord *r3 = static_cast <const TestRecord *> (reader.record (3));
+    // equal strings are stored once
+    assert (r0->name == r2->name);
+    assert (r2->value == 2 && r2->time == 1002);
+    SnapshotString s;
+    assert (reader.string (r0->name, s));
+    assert (s == "ups");
+    assert (s.data [s.size] == '\0');
+    assert (reader.string (r3->name, s));
+    assert (s.size == 0);
+    assert (!reader.string (42, s));
+
+    // wrong kind or record
+    assert (reader.open (path, SNAPSHOT_ALERTS, sizeof (TestRecord)) == -1);
+    assert (reader.open (path, SNAPSHOT_ASSETS, sizeof (TestRecord) + 8) == -1);
+    }
+
+    {
+    // damaged file
+    assert (truncate (path.c_str (), 40) == 0);
+    SnapshotReader reader;
+    assert (reader.open (path, SNAPSHOT_ASSETS, sizeof (TestRecord)) == -1);
+    }
+
+    {
+    // JSON is not a snapshot
+    FILE *f = fopen (path.c_str (), "w");
+    assert (f);
+    fputs ("{\"name\":\"ups\",\"priority\":\"1\"}", f);
+    fclose (f);
+    SnapshotReader reader;
+    assert (reader.open (path, SNAPSHOT_ASSETS, sizeof (TestRecord)) == 1);
+    assert (reader.open (path + ".nonexistent", SNAPSHOT_ASSETS, sizeof (TestRecord)) == -1);
+    }
+
+    std::remove (path.c_str ());
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,132 @@
+/*  =========================================================================
+    snapshot - Binary snapshot of the state
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// kinds of the snapshot
+static const uint16_t SNAPSHOT_ALERTS = 1;
+static const uint16_t SNAPSHOT_ASSETS = 2;
+
+/**
+ * \brief String stored in the mapped snapshot
+ *
+ * Valid as long as the SnapshotReader it comes from. Strings are
+ * terminated by '\0' in the file, so data can be used as C string.
+ */
+struct SnapshotString {
+    const char *data;
+    uint32_t size;
+
+    SnapshotString () : data (""), size (0) {};
+    std::string str () const { return std::string (data, size); }
+    bool operator== (const char *s) const { return strlen (s) == size && memcmp (data, s, size) == 0; }
+};
+
+/**
+ * \class SnapshotWriter
+ *
+ * \brief Builds the snapshot from fixed-width records
+ *
+ * Records are plain structures of the caller, strings are stored
+ * in the string table and referred to by index returned by intern ().
+ *
+ * Example:
+ *
+ *    SnapshotWriter writer (SNAPSHOT_ASSETS, sizeof (AssetRecord));
+ *    AssetRecord record;
+ *    record.name = writer.intern (element.name);
+ *    writer.append (&record);
+ *    writer.save (path);
+ */
+class SnapshotWriter
+{
+ public:
+    SnapshotWriter (uint16_t kind, uint32_t record_size);
+
+    // returns index of the string, equal strings are stored once
+    uint32_t intern (const std::string& s);
+    void    append (const void *record);
+    uint32_t size () const { return _count; }
+
+    // writes '<path>.new', fsyncs it and renames it to path
+    // returns 0 on success, -1 on error
+    int     save (const std::string& path) const;
+
+ private:
+    uint16_t _kind;
+    uint32_t _record_size;
+    uint32_t _count;
+    std::vector <char> _records;
+    std::vector <uint32_t> _index;     // offset, size pairs
+    std::string _strings;
+    std::unordered_map <std::string, uint32_t> _interned;
+};
+
+/**
+ * \class SnapshotReader
+ *
+ * \brief Maps the snapshot into memory
+ *
+ * The whole file is validated by open (), so record () and string ()
+ * do not copy anything and cannot fail on valid index.
+ */
+class SnapshotReader
+{
+ public:
+    SnapshotReader ();
+    ~SnapshotReader ();
+
+    // returns 0 on success, 1 if the file is not a snapshot (e.g. JSON),
+    // -1 if it cannot be read or it is damaged
+    int     open (const std::string& path, uint16_t kind, uint32_t record_size);
+    void    close ();
+
+    uint32_t size () const { return _count; }
+    const void *record (uint32_t i) const { return _records + (size_t) i * _record_size; }
+    // returns false if id is out of range
+    bool    string (uint32_t id, SnapshotString& s) const;
+
+ private:
+    void *_map;
+    size_t _map_size;
+    uint32_t _count;
+    uint32_t _record_size;
+    const char *_records;
+    const uint32_t *_index;
+    uint32_t _strings_count;
+    const char *_strings;
+
+    SnapshotReader (const SnapshotReader&) = delete;
+    SnapshotReader& operator= (const SnapshotReader&) = delete;
+};
+
+//  Self test of this class
+void
+    snapshot_test (bool verbose);
+
+#endif
@@ -18,6 +18,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "fty_email_classes.h"
 
+#include <signal.h>
+
 #define BUF_SIZE 4096
 // forward declaration of helper functions
 char * const * _mk_argv(const Argv& vec);
@@ -129,6 +131,12 @@ bool SubProcess::run() {
             ::dup2(_errpair[1], STDERR_FILENO);
         }
 
+        // signal mask is inherited over exec, e.g. SIGPIPE blocked
+        // by DeliveryPool workers, the command must get the default one
+        sigset_t sigset;
+        sigemptyset(&sigset);
+        ::sigprocmask(SIG_SETMASK, &sigset, NULL);
+
         auto argv = _mk_argv(_cxx_argv);
         if (!argv) {
             // need to exit from the child gracefully
@@ -406,6 +414,22 @@ subprocess_test (bool verbose)
 
     //  @selftest
     //  Simple create/destroy test
+
+    //  signals blocked by the caller are not blocked in the command
+    {
+        sigset_t sigpipe, old;
+        sigemptyset (&sigpipe);
+        sigaddset (&sigpipe, SIGPIPE);
+        pthread_sigmask (SIG_BLOCK, &sigpipe, &old);
+        std::string o, e;
+        int r = output ({"grep", "^SigBlk:", "/proc/self/status"}, o, e, 5);
+        pthread_sigmask (SIG_SETMASK, &old, NULL);
+        if (verbose)
+            zsys_debug ("subprocess: %s", o.c_str ());
+        assert (r == 0);
+        assert (o.find (':') != std::string::npos);
+        assert (o.find_first_not_of (" \t0\n", o.find (':') + 1) == std::string::npos);
+    }
     //  @end
     printf ("OK\n");
 }